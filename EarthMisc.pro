@@ -45,6 +45,13 @@ LIBS += \
     -l$$libTarget(osgEarthFeatures) \
     -l$$libTarget(osgEarthSymbology)
 
+# osgEarth Metrics events and counters from the widgets; build with
+# CONFIG+=no_earthmisc_metrics to compile them out
+!no_earthmisc_metrics: DEFINES += EARTHMISC_METRICS
+
+# shm_open for the shared memory stats export
+unix:!macx: LIBS += -lrt
+
 INCLUDEPATH += \
     $$PWD/sdk/include/osg \
     sdk/include/osgearth
@@ -56,4 +63,15 @@ SOURCES += \
     $$PWD/src/ScaleBar.cpp \
     $$PWD/src/Compass.cpp \
     $$PWD/src/StatsHandler.cpp \
+    $$PWD/src/ScreenQuery.cpp \
+    $$PWD/src/OverviewImage.cpp \
+    $$PWD/src/OverviewLive.cpp \
+    $$PWD/src/EntityPoints.cpp \
+    $$PWD/src/EntityTrails.cpp \
+    $$PWD/src/OverviewProjection.cpp \
+    $$PWD/src/FrameTimeStats.cpp \
+    $$PWD/src/StatsExport.cpp \
+    $$PWD/src/BufferedMetrics.cpp \
+    $$PWD/src/Benchmark.cpp \
+    $$PWD/src/EventRecording.cpp \
 
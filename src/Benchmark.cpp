@@ -0,0 +1,351 @@
+#include "Benchmark.h"
+#include "StatsHandler.h"
+
+#include <osg/Notify>
+#include <osgDB/Registry>
+#include <osgEarth/Memory>
+#include <osgEarth/Viewpoint>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+// GPU times arrive a few frames after the frame is drawn
+const unsigned STATS_LAG = 3;
+
+double lerp(double a, double b, double f)
+{
+    return a + (b - a) * f;
+}
+
+// Interpolates angles the short way round
+double lerpDegrees(double a, double b, double f)
+{
+    double delta = fmod(b - a + 540.0, 360.0) - 180.0;
+    return a + delta * f;
+}
+
+// Nearest-rank percentile of sorted samples
+double percentile(const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t rank = static_cast<size_t>(ceil(p * sorted.size()));
+    return sorted[std::min(std::max(rank, size_t(1)), sorted.size()) - 1];
+}
+
+double mean(const std::vector<double>& samples)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < samples.size(); ++i)
+        sum += samples[i];
+    return samples.empty() ? 0.0 : sum / samples.size();
+}
+
+void writeString(std::ostream& out, const std::string& value)
+{
+    out << '"';
+    for (std::string::const_iterator i = value.begin(); i != value.end(); ++i) {
+        if (*i == '"' || *i == '\\')
+            out << '\\';
+        out << *i;
+    }
+    out << '"';
+}
+
+// Writes "mean", "p50", ... "max" of samples given in seconds, as milliseconds
+void writeSummary(std::ostream& out, std::vector<double> samples, bool allPercentiles)
+{
+    std::sort(samples.begin(), samples.end());
+    out << "{\"mean\": " << mean(samples) * 1000.0;
+    if (allPercentiles) {
+        out << ", \"p50\": " << percentile(samples, 0.5) * 1000.0
+            << ", \"p90\": " << percentile(samples, 0.9) * 1000.0;
+    }
+    out << ", \"p95\": " << percentile(samples, 0.95) * 1000.0;
+    if (allPercentiles)
+        out << ", \"p99\": " << percentile(samples, 0.99) * 1000.0;
+    out << ", \"max\": " << (samples.empty() ? 0.0 : samples.back() * 1000.0) << "}";
+}
+
+}
+
+// Counts node reads, which is how the pager loads terrain tiles, and passes every
+// read on to the callback it replaced
+class Benchmark::TileLoadCounter : public osgDB::ReadFileCallback
+{
+public:
+    TileLoadCounter(osgDB::ReadFileCallback* next) : _next(next), _loads(0) { }
+
+    osgDB::ReadFileCallback* getNext() const { return _next.get(); }
+    unsigned getNumLoads() const { return _loads.load(); }
+
+    virtual osgDB::ReaderWriter::ReadResult readNode(const std::string& filename, const osgDB::Options* options)
+    {
+        _loads.fetch_add(1, std::memory_order_relaxed);
+        return _next.valid() ? _next->readNode(filename, options) : ReadFileCallback::readNode(filename, options);
+    }
+
+    virtual osgDB::ReaderWriter::ReadResult readObject(const std::string& filename, const osgDB::Options* options)
+    {
+        return _next.valid() ? _next->readObject(filename, options) : ReadFileCallback::readObject(filename, options);
+    }
+
+    virtual osgDB::ReaderWriter::ReadResult readImage(const std::string& filename, const osgDB::Options* options)
+    {
+        return _next.valid() ? _next->readImage(filename, options) : ReadFileCallback::readImage(filename, options);
+    }
+
+    virtual osgDB::ReaderWriter::ReadResult readHeightField(const std::string& filename, const osgDB::Options* options)
+    {
+        return _next.valid() ? _next->readHeightField(filename, options) : ReadFileCallback::readHeightField(filename, options);
+    }
+
+    virtual osgDB::ReaderWriter::ReadResult readShader(const std::string& filename, const osgDB::Options* options)
+    {
+        return _next.valid() ? _next->readShader(filename, options) : ReadFileCallback::readShader(filename, options);
+    }
+
+private:
+    osg::ref_ptr<osgDB::ReadFileCallback> _next;
+    std::atomic<unsigned> _loads;
+};
+
+Benchmark::Benchmark(double fps)
+    : _fps(fps > 0.0 ? fps : 60.0)
+    , _wallTime(0.0)
+    , _tileLoads(0)
+    , _maxPagerRequests(0)
+    , _peakMemory(0)
+{
+}
+
+bool Benchmark::load(const std::string& pathFile)
+{
+    std::ifstream in(pathFile.c_str());
+    if (!in) {
+        OSG_WARN << "Benchmark: cannot read " << pathFile << std::endl;
+        return false;
+    }
+
+    _pathFile = pathFile;
+    _keyframes.clear();
+    _animationPath = NULL;
+
+    std::ostringstream recorded;
+    bool hasRecorded = false;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string first;
+        if (!(fields >> first) || first[0] == '#')
+            continue;
+        if (first != "viewpoint") {
+            recorded << line << '\n';
+            hasRecorded = true;
+            continue;
+        }
+        Keyframe k;
+        if (fields >> k.time >> k.lon >> k.lat >> k.alt >> k.heading >> k.pitch >> k.range)
+            _keyframes.push_back(k);
+        else
+            OSG_WARN << "Benchmark: skipping malformed keyframe: " << line << std::endl;
+    }
+
+    if (hasRecorded && !_keyframes.empty()) {
+        OSG_WARN << "Benchmark: " << pathFile << " mixes keyframes and recorded camera states" << std::endl;
+        _keyframes.clear();
+        return false;
+    }
+
+    if (hasRecorded) {
+        _animationPath = new osg::AnimationPath;
+        _animationPath->setLoopMode(osg::AnimationPath::NO_LOOPING);
+        std::istringstream states(recorded.str());
+        _animationPath->read(states);
+        if (_animationPath->empty())
+            _animationPath = NULL;
+    } else {
+        std::stable_sort(_keyframes.begin(), _keyframes.end(),
+            [](const Keyframe& a, const Keyframe& b) { return a.time < b.time; });
+    }
+
+    if (!_animationPath.valid() && _keyframes.empty()) {
+        OSG_WARN << "Benchmark: no camera path in " << pathFile << std::endl;
+        return false;
+    }
+    return true;
+}
+
+double Benchmark::getStartTime() const
+{
+    return _animationPath.valid() ? _animationPath->getFirstTime() : _keyframes.front().time;
+}
+
+double Benchmark::getEndTime() const
+{
+    return _animationPath.valid() ? _animationPath->getLastTime() : _keyframes.back().time;
+}
+
+bool Benchmark::setUpOffscreen(osgViewer::Viewer& viewer, int width, int height)
+{
+    osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+    traits->readDISPLAY();
+    traits->setUndefinedScreenDetailsToDefaultScreen();
+    traits->x = 0;
+    traits->y = 0;
+    traits->width = width;
+    traits->height = height;
+    traits->windowDecoration = false;
+    traits->doubleBuffer = false;
+    traits->pbuffer = true;
+
+    osg::ref_ptr<osg::GraphicsContext> gc = osg::GraphicsContext::createGraphicsContext(traits.get());
+    if (!gc.valid()) {
+        OSG_WARN << "Benchmark: cannot create a " << width << "x" << height << " pbuffer" << std::endl;
+        return false;
+    }
+
+    osg::Camera* camera = viewer.getCamera();
+    camera->setGraphicsContext(gc.get());
+    camera->setViewport(new osg::Viewport(0, 0, width, height));
+    camera->setProjectionMatrixAsPerspective(30.0, double(width) / double(height), 1.0, 1000.0);
+    camera->setDrawBuffer(GL_FRONT);
+    camera->setReadBuffer(GL_FRONT);
+    return true;
+}
+
+void Benchmark::applyCamera(double time, osgEarth::Util::EarthManipulator* manip) const
+{
+    if (_animationPath.valid()) {
+        osg::Matrixd matrix;
+        if (_animationPath->getMatrix(time, matrix))
+            manip->setByMatrix(matrix);
+        return;
+    }
+
+    // Interpolate between the keyframes either side of the time
+    std::vector<Keyframe>::const_iterator next = _keyframes.begin();
+    while (next != _keyframes.end() && next->time <= time)
+        ++next;
+    const Keyframe& a = next == _keyframes.begin() ? *next : *(next - 1);
+    const Keyframe& b = next == _keyframes.end() ? a : *next;
+    double f = b.time > a.time ? (time - a.time) / (b.time - a.time) : 0.0;
+    f = osg::clampBetween(f, 0.0, 1.0);
+
+    double range = a.range > 0.0 && b.range > 0.0 ? a.range * pow(b.range / a.range, f) : lerp(a.range, b.range, f);
+
+    osgEarth::Viewpoint vp;
+    vp.focalPoint() = osgEarth::GeoPoint(osgEarth::SpatialReference::get("wgs84"),
+        lerpDegrees(a.lon, b.lon, f), lerp(a.lat, b.lat, f), lerp(a.alt, b.alt, f), osgEarth::ALTMODE_ABSOLUTE);
+    vp.heading()->set(lerpDegrees(a.heading, b.heading, f), osgEarth::Units::DEGREES);
+    vp.pitch()->set(lerp(a.pitch, b.pitch, f), osgEarth::Units::DEGREES);
+    vp.range()->set(range, osgEarth::Units::METERS);
+    manip->setViewpoint(vp);
+}
+
+int Benchmark::run(osgViewer::Viewer& viewer, osgEarth::Util::EarthManipulator* manip, StatsHandler* statsHandler)
+{
+    if (!manip || !statsHandler || (!_animationPath.valid() && _keyframes.empty())) {
+        OSG_WARN << "Benchmark: needs a camera path, an EarthManipulator and a StatsHandler" << std::endl;
+        return 1;
+    }
+
+    // The pager threads read the registry's callback without a lock, so the counter
+    // goes in before realize() starts them
+    osgDB::Registry* registry = osgDB::Registry::instance();
+    osg::ref_ptr<TileLoadCounter> counter = new TileLoadCounter(registry->getReadFileCallback());
+    registry->setReadFileCallback(counter.get());
+
+    // Phases run one after another, so their times add up to the frame time
+    viewer.setThreadingModel(osgViewer::ViewerBase::SingleThreaded);
+    if (!viewer.isRealized())
+        viewer.realize();
+    statsHandler->setCollectFrameStats(true, &viewer);
+
+    const double start = getStartTime();
+    const unsigned numFrames = static_cast<unsigned>(floor((getEndTime() - start) * _fps)) + 1;
+    _frames.clear();
+    _frames.reserve(numFrames);
+    _maxPagerRequests = 0;
+
+    // Hold the last camera for a few extra frames so the path's last frames get GPU times
+    const osg::Timer_t begin = osg::Timer::instance()->tick();
+    osg::Timer_t end = begin;
+    for (unsigned i = 0; i < numFrames + STATS_LAG && !viewer.done(); ++i) {
+        const double time = start + std::min(i, numFrames - 1) / _fps;
+        applyCamera(time, manip);
+        viewer.frame(time);
+        if (i + 1 == numFrames)
+            end = osg::Timer::instance()->tick();
+
+        FrameStatsRecord record;
+        const unsigned frame = viewer.getFrameStamp()->getFrameNumber();
+        if (i >= STATS_LAG && i - STATS_LAG < numFrames && statsHandler->readFrameStats(&viewer, frame - STATS_LAG, record)) {
+            _frames.push_back(record);
+            _maxPagerRequests = std::max(_maxPagerRequests, record.pagerRequests);
+        }
+    }
+    if (end == begin)
+        end = osg::Timer::instance()->tick();
+
+    statsHandler->setCollectFrameStats(false, &viewer);
+
+    // The run is over; stop the pager threads before taking the counter out again
+    viewer.setDone(true);
+    viewer.stopThreading();
+    if (viewer.getDatabasePager())
+        viewer.getDatabasePager()->cancel();
+    registry->setReadFileCallback(counter->getNext());
+
+    _wallTime = osg::Timer::instance()->delta_s(begin, end);
+    _tileLoads = counter->getNumLoads();
+    _peakMemory = osgEarth::Memory::getProcessPeakPhysicalUsage();
+    return 0;
+}
+
+bool Benchmark::writeReport(const std::string& path) const
+{
+    std::ofstream out(path.c_str());
+    if (!out) {
+        OSG_WARN << "Benchmark: cannot write " << path << std::endl;
+        return false;
+    }
+
+    std::vector<double> durations;
+    std::vector<double> phases[FrameTimeStats::NUM_PHASES];
+    for (size_t i = 0; i < _frames.size(); ++i) {
+        durations.push_back(_frames[i].duration);
+        for (int p = 0; p < FrameTimeStats::NUM_PHASES; ++p)
+            phases[p].push_back(_frames[i].phases[p]);
+    }
+
+    out << std::fixed << std::setprecision(3);
+    out << "{\n  \"path\": ";
+    writeString(out, _pathFile);
+    out << ",\n  \"fps\": " << _fps
+        << ",\n  \"frames\": " << _frames.size()
+        << ",\n  \"wall_time_s\": " << _wallTime
+        << ",\n  \"frame_ms\": ";
+    writeSummary(out, durations, true);
+    out << ",\n  \"phase_ms\": {";
+    for (int p = 0; p < FrameTimeStats::NUM_PHASES; ++p) {
+        out << (p > 0 ? "," : "") << "\n    \"" << FrameTimeStats::phaseName(static_cast<FrameTimeStats::Phase>(p)) << "\": ";
+        writeSummary(out, phases[p], false);
+    }
+    out << "\n  },\n  \"tile_loads\": " << _tileLoads
+        << ",\n  \"max_pager_requests\": " << _maxPagerRequests
+        << ",\n  \"peak_memory_mb\": " << _peakMemory / (1024.0 * 1024.0)
+        << "\n}\n";
+
+    std::sort(durations.begin(), durations.end());
+    OSG_NOTICE << "Benchmark: " << _frames.size() << " frames, p50 " << percentile(durations, 0.5) * 1000.0
+        << " ms, p99 " << percentile(durations, 0.99) * 1000.0 << " ms, " << _tileLoads << " tile loads, peak memory "
+        << _peakMemory / (1024 * 1024) << " MB; report in " << path << std::endl;
+    return static_cast<bool>(out);
+}
@@ -0,0 +1,84 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "StatsExport.h"
+
+#include <osg/AnimationPath>
+#include <osgViewer/Viewer>
+#include <osgEarthUtil/EarthManipulator>
+
+#include <string>
+#include <vector>
+
+class StatsHandler;
+
+/**
+ * Repeatable fly-through for measuring EarthMisc. A camera path is replayed at a
+ * fixed simulated frame rate, so every run shows the same frames whatever they cost,
+ * and the stats of each frame are kept for a report written at the end.
+ *
+ * The path file either holds recorded camera states in the osg::AnimationPath text
+ * format ("time x y z qx qy qz qw" per line, as written by osgViewer's camera path
+ * recorder), or viewpoint keyframes, one per line:
+ *
+ *     viewpoint <time s> <lon> <lat> <alt m> <heading deg> <pitch deg> <range m>
+ *
+ * Keyframes are interpolated linearly, the range geometrically. Lines starting
+ * with '#' are comments.
+ */
+class Benchmark
+{
+public:
+    /** @param fps Simulated frame rate; the path advances 1/fps seconds per frame */
+    Benchmark(double fps = 60.0);
+
+    /** Reads the camera path; false if it cannot be read or has no frames */
+    bool load(const std::string& pathFile);
+
+    /**
+     * Renders the viewer's camera into an offscreen pbuffer instead of a window, which
+     * works under Mesa software GL. Call before the viewer is realized.
+     * @return false if no pbuffer could be created; the viewer is left as it was
+     */
+    static bool setUpOffscreen(osgViewer::Viewer& viewer, int width, int height);
+
+    /**
+     * Realizes the viewer and flies the path, reading each frame's stats through
+     * the stats handler. Call before the viewer is realized, so tile loads can be
+     * counted from the first one; the viewer is done and its pager stopped afterwards.
+     * @return 0 on success, like osgViewer::Viewer::run()
+     */
+    int run(osgViewer::Viewer& viewer, osgEarth::Util::EarthManipulator* manip, StatsHandler* statsHandler);
+
+    /** Writes frame time percentiles, phase times, tile loads and peak memory as JSON */
+    bool writeReport(const std::string& path) const;
+
+private:
+    struct Keyframe {
+        double time;
+        double lon, lat, alt;           ///< Focal point (degrees, meters)
+        double heading, pitch;          ///< Degrees
+        double range;                   ///< Meters
+    };
+
+    class TileLoadCounter;
+
+    /** Moves the camera to where the path is at the given time */
+    void applyCamera(double time, osgEarth::Util::EarthManipulator* manip) const;
+
+    double getStartTime() const;
+    double getEndTime() const;
+
+    double _fps;
+    std::string _pathFile;
+    osg::ref_ptr<osg::AnimationPath> _animationPath;    ///< Recorded camera states, or
+    std::vector<Keyframe> _keyframes;                   ///< viewpoint keyframes
+
+    std::vector<FrameStatsRecord> _frames;
+    double _wallTime;
+    unsigned _tileLoads;
+    unsigned _maxPagerRequests;
+    unsigned _peakMemory;                               ///< Bytes
+};
+
+#endif
@@ -0,0 +1,338 @@
+#include "BufferedMetrics.h"
+
+#include <osg/Notify>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+// How long the writer sleeps between drains
+const unsigned WRITER_SLEEP_US = 20000;
+
+// Name id of an unused counter slot
+const unsigned NO_NAME = ~0u;
+
+std::atomic<unsigned> s_nextSerial(1);
+
+unsigned roundUpPowerOfTwo(unsigned value)
+{
+    unsigned result = 1;
+    while (result < value)
+        result <<= 1;
+    return result;
+}
+
+void writeString(std::ostream& out, const std::string& value)
+{
+    out << '"';
+    for (std::string::const_iterator i = value.begin(); i != value.end(); ++i) {
+        unsigned char c = static_cast<unsigned char>(*i);
+        if (c == '"' || c == '\\')
+            out << '\\' << *i;
+        else if (c < 0x20)
+            out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<unsigned>(c)
+                << std::dec << std::setfill(' ');
+        else
+            out << *i;
+    }
+    out << '"';
+}
+
+}
+
+// One begin, end or counter event
+struct BufferedMetricsBackend::Event
+{
+    char phase;                 ///< Chrome trace phase: 'B', 'E' or 'C'
+    unsigned name;
+    osg::Timer_t tick;
+    unsigned counterNames[3];
+    double counterValues[3];
+    std::string args;           ///< JSON object, or empty; reuses its storage from lap to lap
+};
+
+// Events of one thread, pushed by that thread and drained by the writer
+class BufferedMetricsBackend::ThreadBuffer
+{
+public:
+    ThreadBuffer(unsigned capacity, unsigned tid, const std::string& threadName)
+        : ring(capacity)
+        , mask(capacity - 1)
+        , head(0)
+        , tail(0)
+        , tid(tid)
+        , threadName(threadName)
+        , thread(std::this_thread::get_id())
+    {
+    }
+
+    /** The slot to fill next, or NULL if the ring is full; owning thread only */
+    Event* claim()
+    {
+        unsigned h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) > mask)
+            return NULL;
+        return &ring[h & mask];
+    }
+
+    /** Hands the claimed slot to the writer */
+    void publish()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    std::vector<Event> ring;
+    const unsigned mask;
+    std::atomic<unsigned> head;     ///< Events pushed
+    std::atomic<unsigned> tail;     ///< Events drained
+
+    const unsigned tid;
+    const std::string threadName;
+    const std::thread::id thread;
+
+    std::unordered_map<std::string, unsigned> nameIds;  ///< Interned names seen by the owning thread
+};
+
+// Drains the rings until stopped, then once more so nothing recorded is lost
+class BufferedMetricsBackend::Writer : public OpenThreads::Thread
+{
+public:
+    Writer(BufferedMetricsBackend* owner) : _owner(owner), _done(false) { }
+
+    ~Writer()
+    {
+        _done.store(true);
+        join();
+    }
+
+    virtual void run()
+    {
+        while (!_done.load()) {
+            if (_owner->drain_() == 0)
+                OpenThreads::Thread::microSleep(WRITER_SLEEP_US);
+        }
+        _owner->drain_();
+    }
+
+private:
+    BufferedMetricsBackend* _owner;
+    std::atomic<bool> _done;
+};
+
+BufferedMetricsBackend::BufferedMetricsBackend(const std::string& filename, unsigned capacity)
+    : _serial(s_nextSerial.fetch_add(1))
+    , _capacity(roundUpPowerOfTwo(capacity > 0 ? capacity : 1))
+    , _startTick(osg::Timer::instance()->tick())
+    , _dropped(0)
+    , _out(filename.c_str())
+    , _writerBuffers(0)
+    , _firstEvent(true)
+{
+    if (!_out) {
+        OSG_WARN << "BufferedMetricsBackend: cannot open " << filename << std::endl;
+        return;
+    }
+    _out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" << std::fixed << std::setprecision(3);
+    _writer.reset(new Writer(this));
+    _writer->start();
+}
+
+BufferedMetricsBackend::~BufferedMetricsBackend()
+{
+    if (!_writer)
+        return;
+    // Stop the writer before closing the file it writes to
+    _writer.reset();
+    _out << "\n]}\n";
+    if (getNumDropped() > 0)
+        OSG_WARN << "BufferedMetricsBackend: dropped " << getNumDropped() << " events" << std::endl;
+}
+
+bool BufferedMetricsBackend::isOpen() const
+{
+    return _writer.get() != NULL;
+}
+
+unsigned BufferedMetricsBackend::getNumDropped() const
+{
+    return _dropped.load(std::memory_order_relaxed);
+}
+
+BufferedMetricsBackend::ThreadBuffer* BufferedMetricsBackend::threadBuffer_()
+{
+    static thread_local unsigned cachedSerial = 0;
+    static thread_local ThreadBuffer* cachedBuffer = NULL;
+    if (cachedSerial == _serial)
+        return cachedBuffer;
+
+    // First event of this thread on this backend, or the thread last used another one
+    ScopedLock lock(_buffersMutex);
+    ThreadBuffer* buffer = NULL;
+    std::thread::id self = std::this_thread::get_id();
+    for (unsigned i = 0; i < _buffers.size() && !buffer; ++i) {
+        if (_buffers[i]->thread == self)
+            buffer = _buffers[i].get();
+    }
+    if (!buffer) {
+        unsigned tid = static_cast<unsigned>(_buffers.size()) + 1;
+        std::ostringstream name;
+        OpenThreads::Thread* thread = OpenThreads::Thread::CurrentThread();
+        if (thread)
+            name << "OpenThreads " << thread->getThreadId();
+        else
+            name << "Thread " << tid;
+        _buffers.push_back(std::unique_ptr<ThreadBuffer>(new ThreadBuffer(_capacity, tid, name.str())));
+        buffer = _buffers.back().get();
+    }
+    cachedSerial = _serial;
+    cachedBuffer = buffer;
+    return buffer;
+}
+
+unsigned BufferedMetricsBackend::intern_(ThreadBuffer* buffer, const std::string& name)
+{
+    std::unordered_map<std::string, unsigned>::const_iterator i = buffer->nameIds.find(name);
+    if (i != buffer->nameIds.end())
+        return i->second;
+
+    unsigned id;
+    {
+        ScopedLock lock(_namesMutex);
+        std::pair<std::unordered_map<std::string, unsigned>::iterator, bool> inserted =
+            _nameIds.insert(std::make_pair(name, static_cast<unsigned>(_names.size())));
+        if (inserted.second)
+            _names.push_back(name);
+        id = inserted.first->second;
+    }
+    buffer->nameIds[name] = id;
+    return id;
+}
+
+void BufferedMetricsBackend::record_(char phase, const std::string& name, const osgEarth::Config& args)
+{
+    if (!_writer)
+        return;
+    ThreadBuffer* buffer = threadBuffer_();
+    Event* event = buffer->claim();
+    if (!event) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    event->phase = phase;
+    event->name = intern_(buffer, name);
+    event->tick = osg::Timer::instance()->tick();
+    if (args.empty())
+        event->args.clear();
+    else
+        event->args = args.toJSON();
+    buffer->publish();
+}
+
+void BufferedMetricsBackend::begin(const std::string& name, const osgEarth::Config& args)
+{
+    record_('B', name, args);
+}
+
+void BufferedMetricsBackend::end(const std::string& name, const osgEarth::Config& args)
+{
+    record_('E', name, args);
+}
+
+void BufferedMetricsBackend::counter(const std::string& graph,
+                                     const std::string& name0, double value0,
+                                     const std::string& name1, double value1,
+                                     const std::string& name2, double value2)
+{
+    if (!_writer)
+        return;
+    ThreadBuffer* buffer = threadBuffer_();
+    Event* event = buffer->claim();
+    if (!event) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    event->phase = 'C';
+    event->name = intern_(buffer, graph);
+    event->tick = osg::Timer::instance()->tick();
+    event->counterNames[0] = name0.empty() ? NO_NAME : intern_(buffer, name0);
+    event->counterNames[1] = name1.empty() ? NO_NAME : intern_(buffer, name1);
+    event->counterNames[2] = name2.empty() ? NO_NAME : intern_(buffer, name2);
+    event->counterValues[0] = value0;
+    event->counterValues[1] = value1;
+    event->counterValues[2] = value2;
+    event->args.clear();
+    buffer->publish();
+}
+
+unsigned BufferedMetricsBackend::drain_()
+{
+    std::vector<ThreadBuffer*> buffers;
+    {
+        ScopedLock lock(_buffersMutex);
+        for (unsigned i = 0; i < _buffers.size(); ++i)
+            buffers.push_back(_buffers[i].get());
+    }
+    unsigned numBuffers = static_cast<unsigned>(buffers.size());
+
+    // Name threads the first time they show up
+    for (; _writerBuffers < numBuffers; ++_writerBuffers) {
+        ThreadBuffer* buffer = buffers[_writerBuffers];
+        _out << (_firstEvent ? "" : ",\n") << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << buffer->tid
+             << ",\"args\":{\"name\":";
+        writeString(_out, buffer->threadName);
+        _out << "}}";
+        _firstEvent = false;
+    }
+
+    // Snapshot every head before copying the names: a name is interned before the event
+    // using it is published, so every event up to the heads has its name in the copy
+    std::vector<unsigned> heads(numBuffers);
+    for (unsigned b = 0; b < numBuffers; ++b)
+        heads[b] = buffers[b]->head.load(std::memory_order_acquire);
+    {
+        ScopedLock lock(_namesMutex);
+        _writerNames.insert(_writerNames.end(), _names.begin() + _writerNames.size(), _names.end());
+    }
+
+    unsigned written = 0;
+    osg::Timer* timer = osg::Timer::instance();
+    for (unsigned b = 0; b < numBuffers; ++b) {
+        ThreadBuffer* buffer = buffers[b];
+        unsigned tail = buffer->tail.load(std::memory_order_relaxed);
+        unsigned head = heads[b];
+        for (unsigned i = tail; i != head; ++i) {
+            const Event& event = buffer->ring[i & buffer->mask];
+            _out << (_firstEvent ? "" : ",\n") << "{\"ph\":\"" << event.phase << "\",\"name\":";
+            writeString(_out, _writerNames[event.name]);
+            _out << ",\"pid\":1,\"tid\":" << buffer->tid << ",\"ts\":" << timer->delta_u(_startTick, event.tick);
+            if (event.phase == 'C') {
+                _out << ",\"args\":{";
+                bool first = true;
+                for (int c = 0; c < 3; ++c) {
+                    if (event.counterNames[c] == NO_NAME)
+                        continue;
+                    _out << (first ? "" : ",");
+                    writeString(_out, _writerNames[event.counterNames[c]]);
+                    _out << ':' << event.counterValues[c];
+                    first = false;
+                }
+                _out << '}';
+            } else if (!event.args.empty()) {
+                _out << ",\"args\":" << event.args;
+            }
+            _out << '}';
+            _firstEvent = false;
+        }
+        buffer->tail.store(head, std::memory_order_release);
+        written += head - tail;
+    }
+    if (written > 0)
+        _out.flush();
+    return written;
+}
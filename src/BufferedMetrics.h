@@ -0,0 +1,87 @@
+#ifndef BUFFEREDMETRICS_H
+#define BUFFEREDMETRICS_H
+
+#include <osgEarth/Metrics>
+#include <osg/Timer>
+#include <OpenThreads/Mutex>
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * MetricsBackend for always-on tracing. Each thread that records an event gets its
+ * own single-producer, single-consumer ring, so begin(), end() and counter() only
+ * look up interned names and copy a small record; the only locks are taken the
+ * first time a thread records anything and the first time it uses a name. A writer
+ * thread drains the rings into a Chrome trace event file, which chrome://tracing and
+ * the Perfetto UI both open.
+ *
+ * Events recorded while a thread's ring is full are dropped and counted.
+ */
+class BufferedMetricsBackend : public osgEarth::MetricsBackend
+{
+public:
+    /**
+     * Opens the trace file and starts the writer thread.
+     * @param capacity Events buffered per thread, rounded up to a power of two
+     */
+    BufferedMetricsBackend(const std::string& filename, unsigned capacity = 16384);
+
+    /** False if the trace file could not be opened; nothing is recorded then. */
+    bool isOpen() const;
+
+    /** Events dropped because the writer fell behind. */
+    unsigned getNumDropped() const;
+
+public: // osgEarth::MetricsBackend
+    virtual void begin(const std::string& name, const osgEarth::Config& args = osgEarth::Config());
+    virtual void end(const std::string& name, const osgEarth::Config& args = osgEarth::Config());
+    virtual void counter(const std::string& graph,
+                         const std::string& name0, double value0,
+                         const std::string& name1, double value1,
+                         const std::string& name2, double value2);
+
+protected:
+    /** Writes out everything recorded and closes the trace */
+    virtual ~BufferedMetricsBackend();
+
+private:
+    struct Event;
+    class ThreadBuffer;
+    class Writer;
+
+    /** The calling thread's ring, registered on first use */
+    ThreadBuffer* threadBuffer_();
+
+    /** Id of a name in the shared table; the calling thread caches ids it has seen */
+    unsigned intern_(ThreadBuffer* buffer, const std::string& name);
+
+    void record_(char phase, const std::string& name, const osgEarth::Config& args);
+
+    /** Writes the queued events of every thread; writer thread only. Returns the number written. */
+    unsigned drain_();
+
+    const unsigned _serial;             ///< Tells apart backends in the per-thread cache
+    const unsigned _capacity;
+    const osg::Timer_t _startTick;
+    std::atomic<unsigned> _dropped;
+
+    OpenThreads::Mutex _buffersMutex;
+    std::vector<std::unique_ptr<ThreadBuffer> > _buffers;
+
+    OpenThreads::Mutex _namesMutex;
+    std::vector<std::string> _names;                    ///< Interned names by id
+    std::unordered_map<std::string, unsigned> _nameIds;
+
+    std::ofstream _out;
+    std::vector<std::string> _writerNames;      ///< Writer's copy of _names
+    unsigned _writerBuffers;                    ///< Buffers the writer has named in the trace
+    bool _firstEvent;
+    std::unique_ptr<Writer> _writer;
+};
+
+#endif
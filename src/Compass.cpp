@@ -5,13 +5,21 @@
 #include <osgEarthUtil/EarthManipulator>
 #include <osgEarthUtil/Controls>
 #include <osgEarth/Units>
+#include <osgEarth/VirtualProgram>
+#include <osg/Timer>
+#include <OpenThreads/ScopedLock>
 #include "Compass.h"
+#include "StatsHandler.h"
+#include "WidgetMetrics.h"
 #include <assert.h>
 
 namespace ui = osgEarth::Util::Controls;
 
 #define M_PI 3.14159265358979323846  /* mathematical constant pi */
 
+WIDGET_METRIC_COUNTER(s_geometryRebuilds, "Compass", "geometry rebuilds");
+WIDGET_METRIC_COUNTER(s_textRelayouts, "Compass", "text relayouts");
+
 ///Radian to degree conversion factor
 static const double RAD2DEG = 180.0 / M_PI;
 ///Degree to radian conversion factor
@@ -47,6 +55,118 @@ inline bool areEqual(double a, double b, double t=1.0e-6)
   return fabs(a - b) < t;
 }
 
+/**
+* Formats a non-negative angle in hundredths of a degree as "ddd.cc", without
+* allocating or touching the locale
+* @param[in ] centi angle (centidegrees)
+* @param[out] buf destination, at least 16 characters
+* @return buf
+*/
+inline const char* formatCentidegrees(int centi, char* buf)
+{
+  char digits[16];
+  int n = 0;
+  int whole = centi / 100;
+  do
+  {
+    digits[n++] = static_cast<char>('0' + whole % 10);
+    whole /= 10;
+  } while (whole > 0);
+
+  char* out = buf;
+  while (n > 0)
+    *out++ = digits[--n];
+  *out++ = '.';
+  *out++ = static_cast<char>('0' + (centi / 10) % 10);
+  *out++ = static_cast<char>('0' + centi % 10);
+  *out = '\0';
+  return buf;
+}
+
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+/// Name of the compass rotation shader function
+static const char* ROTATE_FUNCTION = "compass_rotate";
+
+/**
+* Rotates the compass quad about its center.  The control canvas draws in window
+* coordinates, so view space is in pixels with the origin at the bottom left.
+*/
+static const char* ROTATE_SHADER =
+    "#version " GLSL_VERSION_STR "\n"
+    GLSL_DEFAULT_PRECISION_FLOAT "\n"
+    "uniform float compass_rotation;\n"
+    "uniform vec2 compass_center;\n"
+    "void compass_rotate(inout vec4 vertex)\n"
+    "{\n"
+    "    float s = sin(compass_rotation);\n"
+    "    float c = cos(compass_rotation);\n"
+    "    vec2 d = vertex.xy - compass_center * vertex.w;\n"
+    "    vertex.xy = compass_center * vertex.w + vec2(d.x * c - d.y * s, d.x * s + d.y * c);\n"
+    "}\n";
+
+CompassHeadingBroadcast::CompassHeadingBroadcast()
+    : sequence_(0),
+      heading_(0.0),
+      time_(0.0)
+{
+}
+
+void CompassHeadingBroadcast::publish(double heading, double time)
+{
+    // odd while writing; the fence keeps the data stores after the odd count
+    const unsigned seq = sequence_.load(std::memory_order_relaxed);
+    sequence_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    heading_.store(heading, std::memory_order_relaxed);
+    time_.store(time, std::memory_order_relaxed);
+    sequence_.store(seq + 2, std::memory_order_release);
+}
+
+unsigned CompassHeadingBroadcast::read(CompassHeadingSample& out_sample) const
+{
+    for (;;)
+    {
+        const unsigned seq = sequence_.load(std::memory_order_acquire);
+        if (seq & 1)
+            continue;
+        const double heading = heading_.load(std::memory_order_relaxed);
+        const double time = time_.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (sequence_.load(std::memory_order_relaxed) != seq)
+            continue;
+        if (seq == 0)
+            return 0;
+        out_sample.heading = heading;
+        out_sample.time = time;
+        // sequence numbers of finished writes are even and nonzero
+        return seq / 2;
+    }
+}
+
+CompassSubscription::CompassSubscription(std::shared_ptr<const CompassHeadingBroadcast> broadcast, double minInterval)
+    : broadcast_(broadcast),
+      minInterval_(minInterval),
+      lastSequence_(0),
+      lastDelivery_(0.0)
+{
+}
+
+bool CompassSubscription::poll(CompassHeadingSample& out_sample)
+{
+    const double now = osg::Timer::instance()->time_s();
+    if (lastSequence_ != 0 && now - lastDelivery_ < minInterval_)
+        return false;
+    CompassHeadingSample sample;
+    const unsigned seq = broadcast_->read(sample);
+    if (seq == 0 || seq == lastSequence_)
+        return false;
+    lastSequence_ = seq;
+    lastDelivery_ = now;
+    out_sample = sample;
+    return true;
+}
 
 /**
  * Callback handler for frame updates, for viewpoint/heading changes
@@ -75,11 +195,18 @@ private:
 Compass::Compass(const std::string& compassFilename, osgEarth::Util::Controls::ControlCanvas* canvas) :
     drawView_(NULL),
     activeView_(NULL),
+    canvas_(canvas),
     compass_(NULL),
     readout_(NULL),
     pointer_(NULL),
     compassUpdateEventHandler_(NULL),
-    canvas_(canvas)
+    earthManipulator_(NULL),
+    broadcast_(new CompassHeadingBroadcast),
+    shaderRotation_(false),
+    heading_(0.0),
+    rotationUniform_(new osg::Uniform("compass_rotation", 0.0f)),
+    centerUniform_(new osg::Uniform("compass_center", osg::Vec2f())),
+    readoutCentidegrees_(-1)
 {
     osg::ref_ptr<osg::Image> image = osgDB::readImageFile(compassFilename);
     if (image)
@@ -129,15 +256,65 @@ Compass::~Compass()
     }
 }
 
-void Compass::setListener(CompassUpdateListenerPtr listener)
+void Compass::setListener(CompassUpdateListenerPtr listener, double minInterval)
 {
-    compassUpdateListener_ = listener;
+    if (!listener)
+        return;
+    ScopedLock lock(listenersMutex_);
+    for (std::vector<ListenerEntry>::iterator i = listeners_.begin(); i != listeners_.end(); ++i)
+    {
+        if (i->listener == listener)
+        {
+            i->minInterval = minInterval;
+            return;
+        }
+    }
+    ListenerEntry entry;
+    entry.listener = listener;
+    entry.minInterval = minInterval;
+    entry.lastNotify = 0.0;
+    entry.pending = false;
+    listeners_.push_back(entry);
 }
 
 void Compass::removeListener(const CompassUpdateListenerPtr& listener)
 {
-    if (compassUpdateListener_ == listener)
-        compassUpdateListener_.reset();
+    ScopedLock lock(listenersMutex_);
+    for (std::vector<ListenerEntry>::iterator i = listeners_.begin(); i != listeners_.end(); ++i)
+    {
+        if (i->listener == listener)
+        {
+            listeners_.erase(i);
+            return;
+        }
+    }
+}
+
+CompassSubscriptionPtr Compass::subscribe(double minInterval) const
+{
+    return CompassSubscriptionPtr(new CompassSubscription(broadcast_, minInterval));
+}
+
+void Compass::notifyListeners_(bool changed, double now)
+{
+    {
+        ScopedLock lock(listenersMutex_);
+        for (std::vector<ListenerEntry>::iterator i = listeners_.begin(); i != listeners_.end(); ++i)
+        {
+            i->pending = i->pending || changed;
+            if (i->pending && now - i->lastNotify >= i->minInterval)
+            {
+                i->pending = false;
+                i->lastNotify = now;
+                notifying_.push_back(i->listener);
+            }
+        }
+    }
+
+    // called unlocked, so listeners may add or remove listeners
+    for (size_t i = 0; i < notifying_.size(); ++i)
+        notifying_[i]->onUpdate(heading_);
+    notifying_.clear();
 }
 
 void Compass::setDrawView(osgViewer::View* drawView)
@@ -182,6 +359,8 @@ void Compass::removeFromView()
 void Compass::setActiveView(osgViewer::View* activeView)
 {
     activeView_ = activeView;
+    manipulator_ = NULL;
+    earthManipulator_ = NULL;
 }
 
 int Compass::size() const
@@ -193,6 +372,101 @@ int Compass::size() const
     return image != NULL ? image->t() : 0;
 }
 
+void Compass::setShaderRotation(bool value)
+{
+    if (value == shaderRotation_)
+        return;
+    shaderRotation_ = value;
+    if (!compass_)
+        return;
+
+    osg::StateSet* ss = compass_->getOrCreateStateSet();
+    if (shaderRotation_)
+    {
+        osgEarth::VirtualProgram* vp = osgEarth::VirtualProgram::getOrCreate(ss);
+        vp->setFunction(ROTATE_FUNCTION, ROTATE_SHADER, osgEarth::ShaderComp::LOCATION_VERTEX_VIEW);
+        ss->addUniform(rotationUniform_.get());
+        ss->addUniform(centerUniform_.get());
+        // The control itself stays unrotated from here on; one last relayout
+        compass_->setRotation(0.0);
+    }
+    else
+    {
+        osgEarth::VirtualProgram* vp = osgEarth::VirtualProgram::get(ss);
+        if (vp)
+            vp->removeShader(ROTATE_FUNCTION);
+        ss->removeUniform(rotationUniform_.get());
+        ss->removeUniform(centerUniform_.get());
+    }
+    rotate_(heading_);
+}
+
+bool Compass::shaderRotation() const
+{
+    return shaderRotation_;
+}
+
+void Compass::rotate_(double heading)
+{
+    heading_ = heading;
+    if (!compass_)
+        return;
+    // note that compass rotation is -heading
+    if (!shaderRotation_)
+    {
+        WIDGET_METRIC_ADD(s_geometryRebuilds, 1);
+        compass_->setRotation(-heading);
+        // test to make sure -that a negative rotation is not converted to a positive 360+rotation
+        assert(areEqual(compass_->getRotation().as(osgEarth::Units::DEGREES), -heading));
+        return;
+    }
+    rotationUniform_->set(static_cast<float>(-heading * DEG2RAD));
+}
+
+double Compass::activeHeading_()
+{
+    // Resolve the manipulator type only when the view's manipulator changes
+    osgGA::CameraManipulator* manip = activeView_->getCameraManipulator();
+    if (manip != manipulator_.get())
+    {
+        manipulator_ = manip;
+        earthManipulator_ = dynamic_cast<const osgEarth::Util::EarthManipulator*>(manip);
+    }
+
+    // Use EarthManipulator to account for tether mode rotations
+    if (earthManipulator_ != NULL)
+    {
+        double heading = 0.0;
+        earthManipulator_->getCompositeEulerAngles(&heading);
+        return angFix360(heading * RAD2DEG);
+    }
+
+    // Otherwise take the heading straight from the view matrix, assuming a geocentric
+    // map: the camera's look and up directions in world space are columns of the view
+    // matrix, and the eye position is -R^T * t
+    const osg::Matrixd& view = activeView_->getCamera()->getViewMatrix();
+    const osg::Vec3d look(-view(0, 2), -view(1, 2), -view(2, 2));
+    const osg::Vec3d camUp(view(0, 1), view(1, 1), view(2, 1));
+    const osg::Vec3d trans(view(3, 0), view(3, 1), view(3, 2));
+    const osg::Vec3d eye(-(view(0, 0) * trans.x() + view(0, 1) * trans.y() + view(0, 2) * trans.z()),
+        -(view(1, 0) * trans.x() + view(1, 1) * trans.y() + view(1, 2) * trans.z()),
+        -(view(2, 0) * trans.x() + view(2, 1) * trans.y() + view(2, 2) * trans.z()));
+
+    // Local east and north at the eye; undefined at the poles, where north is 0
+    const osg::Vec3d east(-eye.y(), eye.x(), 0.0);
+    const osg::Vec3d north(-eye.z() * eye.x(), -eye.z() * eye.y(), eye.x() * eye.x() + eye.y() * eye.y());
+
+    // The horizontal parts of the look and up vectors both point along the heading
+    // (up's backwards when looking above the horizon); their sum never vanishes
+    const osg::Vec3d dir = (look * eye) > 0.0 ? look - camUp : look + camUp;
+    // |north| is |east| * |eye|, so scaling the east component by |eye| normalizes both
+    const double e = (dir * east) * eye.length();
+    const double n = dir * north;
+    if (e == 0.0 && n == 0.0)
+        return 0.0;
+    return angFix360(atan2(e, n) * RAD2DEG);
+}
+
 void Compass::update_()
 {
     const double TWO_DECIMAL_PLACES = 1e-02;
@@ -200,55 +474,55 @@ void Compass::update_()
     {
         return;
     }
+    ScopedStatsTimer timer(drawView_.get(), StatsHandler::COMPASS_TIMER);
+    WIDGET_METRIC_SCOPED("Compass::update_");
+
     // if activeView not already set, or if it went away, set the active view to the draw view
     if (!activeView_.valid())
     {
         activeView_ = drawView_.get();
     }
 
-    double heading = 0.0; // degrees
-    if (true)
-    {
-        // Figure out the camera heading; use EarthManipulator to account for tether mode rotations
-        const osgEarth::Util::EarthManipulator* manip = dynamic_cast<const osgEarth::Util::EarthManipulator*>(activeView_->getCameraManipulator());
-        if (manip != NULL)
-        {
-            manip->getCompositeEulerAngles(&heading);
-            // Convert to degrees
-            heading = angFix360(heading * RAD2DEG);
-        }
-        else
-        {
-            // Fall back to the viewpoint's heading
-            heading = angFix360(manip->getViewpoint().heading()->as(osgEarth::Units::DEGREES));
-        }
+    double heading = activeHeading_(); // degrees
+    // make sure that anything equivalent to 0.00 is displayed as 0.00
+    if (areEqual(heading, 0.0, TWO_DECIMAL_PLACES) || areEqual(heading, 360.0, TWO_DECIMAL_PLACES))
+        heading = 0.0;
 
-        // make sure that anything equivalent to 0.00 is displayed as 0.00
-        if (areEqual(heading, 0.0, TWO_DECIMAL_PLACES) || areEqual(heading, 360.0, TWO_DECIMAL_PLACES))
-            heading = 0.0;
+    // keep the shader's rotation center on the control, which only moves on relayout or resize
+    if (compass_ && shaderRotation_ && drawView_->getCamera()->getViewport())
+    {
+        const float vph = static_cast<float>(drawView_->getCamera()->getViewport()->height());
+        const osg::Vec2f& pos = compass_->renderPos();
+        const osg::Vec2f& size = compass_->renderSize();
+        const osg::Vec2f center(pos.x() + size.x() * 0.5f, vph - pos.y() - size.y() * 0.5f);
+        osg::Vec2f oldCenter;
+        centerUniform_->get(oldCenter);
+        if (center != oldCenter)
+            centerUniform_->set(center);
     }
 
-    // check to see if this is a change of heading; note that compass rotation is -heading
-    if (compass_ && !areEqual(compass_->getRotation().as(osgEarth::Units::DEGREES), -heading, TWO_DECIMAL_PLACES))
+    // check to see if this is a change of heading
+    const double now = osg::Timer::instance()->time_s();
+    bool changed = false;
+    if (compass_ && !areEqual(heading_, heading, TWO_DECIMAL_PLACES))
     {
-        compass_->setRotation(-heading);
-        // test to make sure -that a negative rotation is not converted to a positive 360+rotation
-        assert(areEqual(compass_->getRotation().as(osgEarth::Units::DEGREES), -heading));
+        rotate_(heading);
 
-        if (readout_ && readout_.valid())
+        // the readout shows hundredths of a degree, so only relabel when that value changes
+        const int centi = static_cast<int>(heading * 100.0 + 0.5) % 36000;
+        if (readout_.valid() && centi != readoutCentidegrees_)
         {
-            std::stringstream str;
-            str << std::fixed << std::setprecision(2) << heading;
-            std::string dirStr = str.str();
-            if (dirStr.empty())
-                return;
-            if (readout_->text() != dirStr)
-                readout_->setText(dirStr);
+            char buf[16];
+            readoutCentidegrees_ = centi;
+            WIDGET_METRIC_ADD(s_textRelayouts, 1);
+            readout_->setText(formatCentidegrees(centi, buf));
         }
 
-        // if we have a listener, notify that we have updated
-        if (compassUpdateListener_)
-            compassUpdateListener_->onUpdate(heading);
+        broadcast_->publish(heading, now);
+        changed = true;
     }
+
+    // rate limited listeners may still owe a notification of an earlier change
+    notifyListeners_(changed, now);
 }
 
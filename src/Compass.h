@@ -3,12 +3,17 @@
 
 #include <osg/ref_ptr>
 #include <osg/observer_ptr>
+#include <osg/Uniform>
 #include <osgViewer/View>
+#include <OpenThreads/Mutex>
 
+#include <atomic>
 #include <memory>
+#include <vector>
 
 namespace osgEarth{
 namespace Util{
+class EarthManipulator;
 namespace Controls{
 class ImageControl;
 class LabelControl;
@@ -31,6 +36,70 @@ public:
 /// Shared pointer to a CompassUpdateListener
 typedef std::shared_ptr<CompassUpdateListener> CompassUpdateListenerPtr;
 
+/// A heading published by the compass
+struct CompassHeadingSample
+{
+    double heading;     ///< Heading (deg)
+    double time;        ///< osg::Timer time at publication (s)
+};
+
+/**
+  * Latest compass heading, written by the render thread and readable from any thread
+  * without locks.  A sequence counter brackets each write: readers retry while it is
+  * odd or changed under them, and the writer never waits on readers.
+  */
+class  CompassHeadingBroadcast
+{
+public:
+    CompassHeadingBroadcast();
+
+    /** Publishes a new sample; only one thread may publish */
+    void publish(double heading, double time);
+
+    /**
+    * Reads the latest sample
+    * @param out_sample Latest sample, untouched if nothing was published yet
+    * @return sequence number of the sample, 0 if nothing was published yet
+    */
+    unsigned read(CompassHeadingSample& out_sample) const;
+
+private:
+    std::atomic<unsigned> sequence_;
+    std::atomic<double> heading_;
+    std::atomic<double> time_;
+};
+
+/**
+  * Polls the compass heading broadcast from any thread, at the consumer's own pace.
+  * Each subscription belongs to a single consumer thread.
+  */
+class  CompassSubscription
+{
+public:
+    /**
+    * @param broadcast Broadcast to read
+    * @param minInterval Minimum time between delivered samples (s); 0 delivers every new one
+    */
+    CompassSubscription(std::shared_ptr<const CompassHeadingBroadcast> broadcast, double minInterval);
+
+    /**
+    * Gets the latest heading if it was not yet delivered and the minimum interval has
+    * passed since the last delivery.  Headings published in between are coalesced.
+    * @param out_sample Latest sample
+    * @return true if out_sample holds a new sample
+    */
+    bool poll(CompassHeadingSample& out_sample);
+
+private:
+    std::shared_ptr<const CompassHeadingBroadcast> broadcast_;
+    double minInterval_;
+    unsigned lastSequence_;
+    double lastDelivery_;
+};
+
+/// Shared pointer to a CompassSubscription
+typedef std::shared_ptr<CompassSubscription> CompassSubscriptionPtr;
+
 /**
   * Creates a Compass which can be displayed as a HUD control in a single view.  The
   * Compass is drawn on a single view, but may reflect the heading of a different view.
@@ -72,23 +141,45 @@ public:
     void setActiveView(osgViewer::View* activeView);
 
     /**
-    * Set our listener
+    * Add a listener, called on the render thread after heading changes.  Replaces the
+    * listener's previous rate limit if it was already added.
     * @param listener Observer for the compass updates
+    * @param minInterval Minimum time between calls (s); changes in between are coalesced
+    *   and the latest heading is delivered once the interval has passed
     */
-    void setListener(CompassUpdateListenerPtr listener);
+    void setListener(CompassUpdateListenerPtr listener, double minInterval = 0.0);
 
     /**
-    * Unset our listener
+    * Remove a listener
     * @param listener Observer for the compass updates
     */
     void removeListener(const CompassUpdateListenerPtr& listener);
 
+    /**
+    * Subscribe to headings from another thread.  Publishing never blocks the frame, so
+    * slow consumers should poll a subscription rather than add a listener.
+    * @param minInterval Minimum time between delivered samples (s)
+    * @return subscription to poll; it stays valid after the compass is gone
+    */
+    CompassSubscriptionPtr subscribe(double minInterval = 0.0) const;
+
     /**
     * Get the width/height size of the image in pixels. Width and height are the same
     * @return size of the compass image in pixels, returns 0 if no image found
     */
     int size() const;
 
+    /**
+    * Rotate the compass image in a vertex shader instead of rotating the image control.
+    * Heading changes then only update a uniform rather than dirtying the control, which
+    * makes the canvas redo its layout and rebuild the control geometry.  Off by default.
+    * @param value True to rotate the image on the GPU
+    */
+    void setShaderRotation(bool value);
+
+    /** Returns true if the compass image is rotated in a vertex shader */
+    bool shaderRotation() const;
+
 protected:
     /** Destructor */
     virtual ~Compass();
@@ -97,6 +188,12 @@ private:
     /** Update the compass display */
     void update_();
 
+    /** Rotate the compass image to the given heading (deg), through the control or the shader */
+    void rotate_(double heading);
+
+    /** Heading (deg) of the active view, in [0, 360) */
+    double activeHeading_();
+
 private:
     class FrameEventHandler;
 
@@ -108,7 +205,31 @@ private:
     osg::ref_ptr<osgEarth::Util::Controls::LabelControl> pointer_;  ///< compass pointer control
 
     osg::ref_ptr<FrameEventHandler> compassUpdateEventHandler_;     ///< Reference to the update event handler
-    CompassUpdateListenerPtr compassUpdateListener_;        ///< Listener for our updates, if any
+
+    osg::observer_ptr<osgGA::CameraManipulator> manipulator_;       ///< Active view's manipulator as of the last update
+    const osgEarth::Util::EarthManipulator* earthManipulator_;      ///< manipulator_ if it is an EarthManipulator, else NULL
+    /// A listener and its rate limit state
+    struct ListenerEntry
+    {
+        CompassUpdateListenerPtr listener;
+        double minInterval;
+        double lastNotify;
+        bool pending;
+    };
+
+    /** Notify listeners of pending heading changes their rate limits allow */
+    void notifyListeners_(bool changed, double now);
+
+    OpenThreads::Mutex listenersMutex_;                     ///< Guards listeners_
+    std::vector<ListenerEntry> listeners_;                  ///< Listeners for our updates
+    std::vector<CompassUpdateListenerPtr> notifying_;       ///< Listeners being called, reused each frame
+    std::shared_ptr<CompassHeadingBroadcast> broadcast_;    ///< Latest heading for other threads
+
+    bool shaderRotation_;                                   ///< Rotate the image in a vertex shader
+    double heading_;                                        ///< Heading shown by the compass (deg)
+    osg::ref_ptr<osg::Uniform> rotationUniform_;            ///< Shader rotation angle (rad)
+    osg::ref_ptr<osg::Uniform> centerUniform_;              ///< Shader rotation center (window pixels)
+    int readoutCentidegrees_;                               ///< Heading shown by the readout (centidegrees), -1 before the first
 
 };
 
@@ -21,6 +21,7 @@
 */
 
 #include <osgViewer/Viewer>
+#include <osgDB/FileUtils>
 #include <osgEarth/Notify>
 #include <osgEarthUtil/EarthManipulator>
 #include <osgEarthUtil/ExampleResources>
@@ -34,6 +35,12 @@
 #include "OverviewMap.h"
 #include "Compass.h"
 #include "StatsHandler.h"
+#include "ScreenQuery.h"
+#include "OverviewImage.h"
+#include "OverviewLive.h"
+#include "BufferedMetrics.h"
+#include "Benchmark.h"
+#include "EventRecording.h"
 
 #define LC "[viewer] "
 
@@ -52,6 +59,24 @@ usage(const char* name)
 {
     OE_NOTICE 
         << "\nUsage: " << name << " file.earth" << std::endl
+        << "    --fast-scalebar : compute the scale bar against the ellipsoid instead of the terrain" << std::endl
+        << "    --async-scalebar : compute the scale bar on a worker thread" << std::endl
+        << "    --overview-dxt : DXT compress the overview map texture" << std::endl
+        << "    --overview-cache <dir> : cache for processed overview images (default overview_cache)" << std::endl
+        << "    --overview-live : render the overview map from the map's image layers" << std::endl
+        << "    --overview-refresh <seconds> : periodic refresh of the live overview map" << std::endl
+        << "    --overview-projection <name> : equirect (default), mercator, polar or ortho" << std::endl
+        << "    --overview-center <lon> <lat> : center of the ortho overview globe" << std::endl
+        << "    --compass-shader : rotate the compass image in a vertex shader" << std::endl
+        << "    --hitch-budget <ms> : log frames that take longer than this" << std::endl
+        << "    --stats-export <csv|jsonl|shm> <path> : stream per-frame stats to a file or shared memory" << std::endl
+        << "    --metrics-trace <file> : record osgEarth metrics to a Chrome/Perfetto trace file" << std::endl
+        << "    --benchmark <path-file> : fly a camera path offscreen and report frame times" << std::endl
+        << "    --benchmark-fps <fps> : simulated frame rate of the benchmark (default 60)" << std::endl
+        << "    --benchmark-size <width> <height> : benchmark pbuffer size (default 1280 720)" << std::endl
+        << "    --benchmark-report <file> : benchmark report (default benchmark.json)" << std::endl
+        << "    --record-events <file> : record the input events of the session" << std::endl
+        << "    --replay-events <file> : replay recorded input events offscreen" << std::endl
         << MapNodeHelper().usage() << std::endl;
 
     return 0;
@@ -75,35 +100,69 @@ void createScaleBar(osgEarth::MapNode* mapNode, osgViewer::View* view)
 }
 
 
-void createOverviewMap(osgEarth::MapNode* mapNode, osgViewer::View* view)
+void createOverviewMap(osgEarth::MapNode* mapNode, osgViewer::View* view, bool compress, const std::string& cacheDir,
+    bool live, double liveRefresh, OverviewProjector::Type projection, const osg::Vec2f& center)
 {
-    osg::ref_ptr<osg::Image> image = osgDB::readImageFile("world.jpg");
-    if (image.valid()) {
-        g_overviewMap = new OverviewMapControl(image);
-        g_overviewMap->setWidth(200);
-        g_overviewMap->setHeight(100);
+    std::string file = osgDB::findDataFile("world.jpg");
+    if (live || !file.empty()) {
+        // The live renderer draws equirectangular tiles only
+        if (live && projection != OverviewProjector::EQUIRECTANGULAR) {
+            OE_WARN << "Live overview map only supports the equirect projection" << std::endl;
+            projection = OverviewProjector::EQUIRECTANGULAR;
+        }
+
+        g_overviewMap = new OverviewMapControl();
+        // Square for the projections that draw a disc, and for Web Mercator, whose world is square
+        bool square = projection != OverviewProjector::EQUIRECTANGULAR;
+        g_overviewMap->setWidth(square ? 150 : 200);
+        g_overviewMap->setHeight(square ? 150 : 100);
+        g_overviewMap->setProjection(projection, center.x(), center.y());
+
+        if (live) {
+            // Render the overview from the map's own image layers
+            osg::ref_ptr<OverviewLayerRenderer> renderer = new OverviewLayerRenderer(mapNode);
+            renderer->setRefreshInterval(liveRefresh);
+            g_overviewMap->setLiveRenderer(renderer.get());
+        } else {
+            // Downsample, mipmap and cache the world image in the background
+            osg::ref_ptr<OverviewImageLoader> loader = new OverviewImageLoader(file,
+                g_overviewMap->width().value(), g_overviewMap->height().value());
+            loader->setProjector(g_overviewMap->getProjector());
+            loader->setCompress(compress);
+            loader->setCacheDir(cacheDir);
+            g_overviewMap->setImageLoader(loader.get());
+        }
+
         g_controlCanvas->addControl(g_overviewMap.get());
-        view->addEventHandler(new OverviewMapHandler(g_overviewMap, dynamic_cast< osgEarth::Util::EarthManipulator*>(view->getCameraManipulator())));
+        view->addEventHandler(new OverviewMapHandler(g_overviewMap,
+            dynamic_cast< osgEarth::Util::EarthManipulator*>(view->getCameraManipulator()),
+            ScreenQuery::getOrCreate(view, mapNode)));
     }
 }
 
-void createCopass(osgViewer::View* view)
+void createCopass(osgViewer::View* view, bool shaderRotation)
 {
     // create a compass image control, add it to the HUD/Overlay
     g_compass = new Compass("compass.png", g_controlCanvas);
+    g_compass->setShaderRotation(shaderRotation);
     g_compass->setDrawView(view);
 
 }
 
-void createFrameRate(osgViewer::View* view)
+void createFrameRate(osgViewer::View* view, double hitchBudget, StatsExporter* exporter)
 {
     g_statsHandler = new StatsHandler;
     g_statsHandler->setKeyEventTogglesOnScreenStats(osgGA::GUIEventAdapter::KEY_S);
+    g_statsHandler->setKeyEventCyclesCustomPages(osgGA::GUIEventAdapter::KEY_F9);
     view->addEventHandler(g_statsHandler);
     // Pick the StatsType based on turnOn flag
     StatsHandler::StatsType type = StatsHandler::FRAME_RATE;
     // Update the stats type in the handler
     g_statsHandler->setStatsType(type, view);
+    if (hitchBudget > 0.0)
+        g_statsHandler->setHitchBudget(hitchBudget, view);
+    if (exporter && exporter->isOpen())
+        g_statsHandler->setExporter(exporter, view);
 }
 
 int
@@ -118,11 +177,87 @@ main(int argc, char** argv)
     float vfov = -1.0f;
     arguments.read("--vfov", vfov);
 
-    
+    bool fastScaleBar = arguments.read("--fast-scalebar");
+    bool asyncScaleBar = arguments.read("--async-scalebar");
+
+    bool overviewDxt = arguments.read("--overview-dxt");
+    std::string overviewCache = "overview_cache";
+    arguments.read("--overview-cache", overviewCache);
+    bool overviewLive = arguments.read("--overview-live");
+    double overviewRefresh = 0.0;
+    arguments.read("--overview-refresh", overviewRefresh);
+    OverviewProjector::Type overviewProjection = OverviewProjector::EQUIRECTANGULAR;
+    std::string projectionName;
+    if (arguments.read("--overview-projection", projectionName)
+        && !OverviewProjector::parseType(projectionName, overviewProjection)) {
+        OE_WARN << "Unknown overview projection " << projectionName << std::endl;
+    }
+    osg::Vec2f overviewCenter;
+    arguments.read("--overview-center", overviewCenter.x(), overviewCenter.y());
+
+    bool compassShader = arguments.read("--compass-shader");
+
+    double hitchBudgetMs = 0.0;
+    arguments.read("--hitch-budget", hitchBudgetMs);
+
+    osg::ref_ptr<StatsExporter> statsExporter;
+    std::string exportFormatName, exportPath;
+    if (arguments.read("--stats-export", exportFormatName, exportPath)) {
+        StatsExporter::Format exportFormat;
+        if (StatsExporter::parseFormat(exportFormatName, exportFormat))
+            statsExporter = new StatsExporter(exportFormat, exportPath);
+        else
+            OE_WARN << "Unknown stats export format " << exportFormatName << std::endl;
+    }
+
+    // Install before the map loads so loading shows up in the trace
+    osg::ref_ptr<BufferedMetricsBackend> metricsBackend;
+    std::string metricsTrace;
+    if (arguments.read("--metrics-trace", metricsTrace)) {
+        metricsBackend = new BufferedMetricsBackend(metricsTrace);
+        if (metricsBackend->isOpen())
+            Metrics::setMetricsBackend(metricsBackend.get());
+    }
+
+    std::string benchmarkPath;
+    bool benchmarking = arguments.read("--benchmark", benchmarkPath);
+    double benchmarkFps = 60.0;
+    arguments.read("--benchmark-fps", benchmarkFps);
+    int benchmarkWidth = 1280, benchmarkHeight = 720;
+    arguments.read("--benchmark-size", benchmarkWidth, benchmarkHeight);
+    std::string benchmarkReport = "benchmark.json";
+    arguments.read("--benchmark-report", benchmarkReport);
+    Benchmark benchmark(benchmarkFps);
+    if (benchmarking && !benchmark.load(benchmarkPath))
+        return 1;
+
+    std::string recordEventsPath, replayEventsPath;
+    arguments.read("--record-events", recordEventsPath);
+    bool replaying = arguments.read("--replay-events", replayEventsPath);
+    if (replaying && benchmarking) {
+        OE_WARN << "--replay-events is ignored while benchmarking" << std::endl;
+        replaying = false;
+    }
+    EventPlayer eventPlayer;
+    if (replaying && !eventPlayer.load(replayEventsPath))
+        return 1;
 
     // create a viewer:
     osgViewer::Viewer viewer(arguments);
 
+    // A benchmark renders offscreen, so it also runs on a machine without a screen;
+    // falling back to a window would measure something else
+    if (benchmarking && !Benchmark::setUpOffscreen(viewer, benchmarkWidth, benchmarkHeight))
+        return 1;
+
+    // Replay at the recorded size, and offscreen so live input cannot interfere
+    if (replaying) {
+        int width, height;
+        eventPlayer.getWindowSize(width, height);
+        if (width <= 0 || height <= 0 || !Benchmark::setUpOffscreen(viewer, width, height))
+            OE_WARN << "Replaying in a window; input events during the replay will disturb it" << std::endl;
+    }
+
     // Tell the database pager to not modify the unref settings
     viewer.getDatabasePager()->setUnrefImageDataAfterApplyPolicy( true, false );
 
@@ -160,11 +295,36 @@ main(int argc, char** argv)
         node->asGroup()->addChild(g_controlCanvas);
 
         createScaleBar(MapNode::get(node), &viewer);
-        createOverviewMap(MapNode::get(node), &viewer);
-        createCopass(&viewer);
-        createFrameRate(&viewer);
+        g_scaleBar->setFastMode(fastScaleBar);
+        g_scaleBar->setAsync(asyncScaleBar);
+        createOverviewMap(MapNode::get(node), &viewer, overviewDxt, overviewCache, overviewLive, overviewRefresh,
+            overviewProjection, overviewCenter);
+        createCopass(&viewer, compassShader);
+        createFrameRate(&viewer, hitchBudgetMs / 1000.0, statsExporter.get());
+
+        // Ahead of every other handler, so it sees events before they can be handled
+        osg::ref_ptr<EventRecorder> eventRecorder;
+        if (!recordEventsPath.empty() && !replaying) {
+            eventRecorder = new EventRecorder(recordEventsPath);
+            if (eventRecorder->isOpen())
+                eventRecorder->install(&viewer);
+        }
+
+        int result = 0;
+        if (replaying) {
+            result = eventPlayer.run(viewer);
+        } else if (benchmarking) {
+            result = benchmark.run(viewer, dynamic_cast<EarthManipulator*>(viewer.getCameraManipulator()), g_statsHandler.get());
+            if (result == 0 && !benchmark.writeReport(benchmarkReport))
+                result = 1;
+        } else {
+            Metrics::run(viewer);
+        }
 
-        Metrics::run(viewer);
+        // Let the backend write out the rest of the trace
+        if (metricsBackend.valid() && Metrics::getMetricsBackend() == metricsBackend.get())
+            Metrics::setMetricsBackend(NULL);
+        return result;
     }
     else
     {
@@ -0,0 +1,105 @@
+#ifndef ELLIPSOIDMATH_H
+#define ELLIPSOIDMATH_H 1
+
+#include <osg/Camera>
+#include <osg/CoordinateSystemNode>
+
+#include <cmath>
+
+// Analytic screen ray helpers shared by the HUD widgets. They replace scene
+// graph intersections where the ellipsoid (or the z plane of a projected map)
+// is a good enough stand-in for the terrain.
+
+// Computes the inverse of the camera's view * projection * window matrix and
+// the window depth of the near plane.
+inline bool computeInverseWindowMatrix(const osg::Camera* camera, osg::Matrixd& out_inverse, double& out_zNear)
+{
+    osg::Matrixd matrix = camera->getViewMatrix() * camera->getProjectionMatrix();
+    out_zNear = -1.0;
+    if (camera->getViewport()) {
+        matrix.postMult(camera->getViewport()->computeWindowMatrix());
+        out_zNear = 0.0;
+    }
+    return out_inverse.invert(matrix);
+}
+
+// Builds the world space segment under window coordinates (x, y) from the
+// inverse of the camera's view * projection * window matrix, the same way
+// Terrain::getWorldCoordsUnderMouse builds its intersector.
+inline void computeWindowRay(const osg::Matrixd& inverseWindowMatrix, double zNear, double x, double y,
+    osg::Vec3d& start, osg::Vec3d& end)
+{
+    start = osg::Vec3d(x, y, zNear) * inverseWindowMatrix;
+    end = osg::Vec3d(x, y, 1.0) * inverseWindowMatrix;
+}
+
+// Intersects the segment with the ellipsoid grown by height meters, returning
+// the hit nearest to start.
+inline bool intersectEllipsoid(const osg::EllipsoidModel* ellipsoid, double height,
+    const osg::Vec3d& start, const osg::Vec3d& end, osg::Vec3d& out)
+{
+    // Scale into a unit sphere and solve |s + t*d| = 1
+    double a = 1.0 / (ellipsoid->getRadiusEquator() + height);
+    double b = 1.0 / (ellipsoid->getRadiusPolar() + height);
+    osg::Vec3d s(start.x() * a, start.y() * a, start.z() * b);
+    osg::Vec3d dir = end - start;
+    osg::Vec3d d(dir.x() * a, dir.y() * a, dir.z() * b);
+
+    double qa = d * d;
+    double qb = 2.0 * (s * d);
+    double qc = s * s - 1.0;
+    double disc = qb * qb - 4.0 * qa * qc;
+    if (qa <= 0.0 || disc < 0.0)
+        return false;
+
+    double sq = sqrt(disc);
+    double t = (-qb - sq) / (2.0 * qa);
+    if (t < 0.0)
+        t = (-qb + sq) / (2.0 * qa);
+    if (t < 0.0 || t > 1.0)
+        return false;
+    out = start + dir * t;
+    return true;
+}
+
+// Intersects the segment with the plane z = height of a projected map.
+inline bool intersectPlane(double height, const osg::Vec3d& start, const osg::Vec3d& end, osg::Vec3d& out)
+{
+    double dz = end.z() - start.z();
+    if (dz == 0.0)
+        return false;
+    double t = (height - start.z()) / dz;
+    if (t < 0.0 || t > 1.0)
+        return false;
+    out = start + (end - start) * t;
+    return true;
+}
+
+// Intersects the segment with the ellipsoid, or with the z plane of a
+// projected map when there is no ellipsoid, raised by height meters.
+inline bool intersectSurface(const osg::EllipsoidModel* ellipsoid, double height,
+    const osg::Vec3d& start, const osg::Vec3d& end, osg::Vec3d& out)
+{
+    return ellipsoid
+        ? intersectEllipsoid(ellipsoid, height, start, end, out)
+        : intersectPlane(height, start, end, out);
+}
+
+// Point where a segment that misses the ellipsoid comes closest to it,
+// projected onto the surface. Along the edge of the view this traces the
+// horizon.
+inline void horizonPoint(const osg::EllipsoidModel* ellipsoid,
+    const osg::Vec3d& start, const osg::Vec3d& end, osg::Vec3d& out)
+{
+    double a = ellipsoid->getRadiusEquator();
+    double b = ellipsoid->getRadiusPolar();
+    osg::Vec3d s(start.x() / a, start.y() / a, start.z() / b);
+    osg::Vec3d dir = end - start;
+    osg::Vec3d d(dir.x() / a, dir.y() / a, dir.z() / b);
+    double t = d * d > 0.0 ? -(s * d) / (d * d) : 0.0;
+    osg::Vec3d p = s + d * osg::maximum(t, 0.0);
+    p.normalize();
+    out.set(p.x() * a, p.y() * a, p.z() * b);
+}
+
+#endif
@@ -0,0 +1,424 @@
+#include "EntityPoints.h"
+
+#include <osg/Point>
+#include <osgEarth/NodeUtils>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+const unsigned NO_CELL = ~0u;
+
+// Grid size limit; a tiny pick radius on a large control would otherwise
+// allocate many empty cells
+const unsigned MAX_GRID_DIM = 256;
+
+// A cell holding more entities than this is split into SUBDIVISIONS x
+// SUBDIVISIONS subcells, so crowded areas such as a city do not make picks
+// scan every entity in them
+const unsigned MAX_CELL_SIZE = 64;
+const unsigned SUBDIVISIONS = 8;
+
+// Points examined per subcell during a pick. Subcells are an eighth of a
+// pick radius wide, so entities past this many in one are stacked on screen.
+const unsigned MAX_SUBCELL_CANDIDATES = 16;
+
+// Where entities on the hidden side of the projection are parked
+const osg::Vec2f HIDDEN_VERTEX(-1.0e6f, -1.0e6f);
+
+// Every chunk draws from a preallocated array sized CHUNK_SIZE; only the
+// DrawArrays count changes as entities come and go
+osg::Geometry* createChunk(osg::Vec4Array* color)
+{
+    osg::Geometry* geom = new osg::Geometry();
+    geom->setUseVertexBufferObjects(true);
+    geom->setUseDisplayList(false);
+    geom->setDataVariance(osg::Object::DYNAMIC);
+    osg::Vec2Array* verts = new osg::Vec2Array(EntityPointLayer::CHUNK_SIZE);
+    verts->setDataVariance(osg::Object::DYNAMIC);
+    geom->setVertexArray(verts);
+    geom->setColorArray(color, osg::Array::BIND_OVERALL);
+    geom->addPrimitiveSet(new osg::DrawArrays(GL_POINTS, 0, 0));
+    return geom;
+}
+
+}
+
+const unsigned EntityPointLayer::CHUNK_SIZE;
+
+EntityPointLayer::EntityPointLayer(const osg::Vec4& color, unsigned capacity)
+    : _capacity(capacity)
+    , _color(new osg::Vec4Array)
+    , _dirty(false)
+    , _drawnCount(0)
+    , _pickRadius(6.0f)
+    , _gridCols(0)
+    , _gridRows(0)
+{
+    _color->push_back(color);
+    _staging.reserve(std::min(capacity, CHUNK_SIZE));
+
+    osg::StateSet* stateset = getOrCreateStateSet();
+    osg::Point* point = new osg::Point;
+    point->setSize(5.0f);
+    stateset->setAttribute(point);
+
+    // sync() runs from the update traversal
+    ADJUST_UPDATE_TRAV_COUNT(this, 1);
+}
+
+void EntityPointLayer::setProjector(const OverviewProjector* projector)
+{
+    if (projector == _projector.get())
+        return;
+    _projector = projector;
+    resetGrid();
+
+    ScopedLock lock(_mutex);
+    markAllDirty();
+}
+
+void EntityPointLayer::setPickRadius(float pixels)
+{
+    if (pixels == _pickRadius || pixels <= 0.0f)
+        return;
+    _pickRadius = pixels;
+    resetGrid();
+
+    // Refill the new grid on the next sync
+    ScopedLock lock(_mutex);
+    markAllDirty();
+}
+
+void EntityPointLayer::markDirty(unsigned slot)
+{
+    unsigned c = slot / CHUNK_SIZE;
+    if (c >= _chunkDirty.size())
+        _chunkDirty.resize(c + 1, false);
+    _chunkDirty[c] = true;
+    _dirty = true;
+}
+
+void EntityPointLayer::markAllDirty()
+{
+    if (!_staging.empty())
+        markDirty(static_cast<unsigned>(_staging.size()) - 1);
+    std::fill(_chunkDirty.begin(), _chunkDirty.end(), true);
+    _dirty = true;
+}
+
+void EntityPointLayer::setPositionLocked(unsigned id, float lon, float lat)
+{
+    std::unordered_map<unsigned, unsigned>::iterator i = _slots.find(id);
+    unsigned slot;
+    if (i != _slots.end()) {
+        slot = i->second;
+    } else {
+        if (_staging.size() >= _capacity)
+            return;
+        slot = static_cast<unsigned>(_staging.size());
+        _slots[id] = slot;
+        _staging.push_back(osg::Vec2f());
+        _slotIds.push_back(id);
+    }
+    _staging[slot].set(lon, lat);
+    markDirty(slot);
+}
+
+void EntityPointLayer::setPosition(unsigned id, float lon, float lat)
+{
+    ScopedLock lock(_mutex);
+    setPositionLocked(id, lon, lat);
+}
+
+void EntityPointLayer::setPositions(const unsigned* ids, const osg::Vec2f* lonLat, unsigned count)
+{
+    ScopedLock lock(_mutex);
+    for (unsigned i = 0; i < count; ++i)
+        setPositionLocked(ids[i], lonLat[i].x(), lonLat[i].y());
+}
+
+void EntityPointLayer::remove(unsigned id)
+{
+    ScopedLock lock(_mutex);
+    std::unordered_map<unsigned, unsigned>::iterator i = _slots.find(id);
+    if (i == _slots.end())
+        return;
+
+    // Move the last entity into the freed slot to keep the drawn range packed
+    unsigned slot = i->second;
+    unsigned last = static_cast<unsigned>(_staging.size()) - 1;
+    _slots.erase(i);
+    if (slot != last) {
+        _staging[slot] = _staging[last];
+        _slotIds[slot] = _slotIds[last];
+        _slots[_slotIds[slot]] = slot;
+        markDirty(slot);
+    }
+    _staging.pop_back();
+    _slotIds.pop_back();
+    // Shrinking also needs a sync so the draw counts drop
+    markDirty(last);
+}
+
+void EntityPointLayer::clear()
+{
+    ScopedLock lock(_mutex);
+    if (_staging.empty())
+        return;
+    markAllDirty();
+    _staging.clear();
+    _slotIds.clear();
+    _slots.clear();
+}
+
+unsigned EntityPointLayer::size() const
+{
+    ScopedLock lock(_mutex);
+    return static_cast<unsigned>(_staging.size());
+}
+
+const osg::Vec2f& EntityPointLayer::getVertex(unsigned slot) const
+{
+    const osg::Vec2Array* verts = static_cast<const osg::Vec2Array*>(_chunks[slot / CHUNK_SIZE]->getVertexArray());
+    return (*verts)[slot % CHUNK_SIZE];
+}
+
+bool EntityPointLayer::getDrawnEntity(unsigned slot, unsigned& out_id, osg::Vec2f& out_lonLat) const
+{
+    if (slot >= _drawnCount)
+        return false;
+    out_id = _drawnIds[slot];
+    out_lonLat = _drawnLonLat[slot];
+    return true;
+}
+
+unsigned EntityPointLayer::cellOf(const osg::Vec2f& uv) const
+{
+    float x = uv.x() / _projector->getWidth() * _gridCols;
+    float y = uv.y() / _projector->getHeight() * _gridRows;
+    int col = osg::clampBetween(static_cast<int>(floor(x)), 0, static_cast<int>(_gridCols) - 1);
+    int row = osg::clampBetween(static_cast<int>(floor(y)), 0, static_cast<int>(_gridRows) - 1);
+    unsigned cell = static_cast<unsigned>(row) * _gridCols + static_cast<unsigned>(col);
+    unsigned first = _cellSplit[cell];
+    if (first == NO_CELL)
+        return cell;
+
+    int subCol = osg::clampBetween(static_cast<int>((x - col) * SUBDIVISIONS), 0, static_cast<int>(SUBDIVISIONS) - 1);
+    int subRow = osg::clampBetween(static_cast<int>((y - row) * SUBDIVISIONS), 0, static_cast<int>(SUBDIVISIONS) - 1);
+    return first + static_cast<unsigned>(subRow) * SUBDIVISIONS + static_cast<unsigned>(subCol);
+}
+
+void EntityPointLayer::gridInsert(unsigned slot, unsigned cell)
+{
+    _slotCell[slot] = cell;
+    _slotCellIndex[slot] = static_cast<unsigned>(_cells[cell].size());
+    _cells[cell].push_back(slot);
+    if (cell < _cellSplit.size() && _cells[cell].size() > MAX_CELL_SIZE)
+        splitCell(cell);
+}
+
+void EntityPointLayer::splitCell(unsigned cell)
+{
+    // Subcells are appended after the grid cells and kept until the grid is reset
+    std::vector<unsigned> members;
+    members.swap(_cells[cell]);
+    _cellSplit[cell] = static_cast<unsigned>(_cells.size());
+    _cells.resize(_cells.size() + SUBDIVISIONS * SUBDIVISIONS);
+    for (std::vector<unsigned>::const_iterator i = members.begin(); i != members.end(); ++i)
+        gridInsert(*i, cellOf(getVertex(*i)));
+}
+
+void EntityPointLayer::gridRemove(unsigned slot)
+{
+    unsigned cell = _slotCell[slot];
+    if (cell == NO_CELL)
+        return;
+    std::vector<unsigned>& members = _cells[cell];
+    unsigned index = _slotCellIndex[slot];
+    members[index] = members.back();
+    _slotCellIndex[members[index]] = index;
+    members.pop_back();
+    _slotCell[slot] = NO_CELL;
+}
+
+void EntityPointLayer::resetGrid()
+{
+    _cells.clear();
+    _cellSplit.clear();
+    _slotCell.assign(_drawnCount, NO_CELL);
+    _slotCellIndex.resize(_drawnCount);
+    if (!_projector.valid() || _projector->getWidth() <= 0.0f || _projector->getHeight() <= 0.0f) {
+        _gridCols = _gridRows = 0;
+        return;
+    }
+    _gridCols = osg::clampBetween(static_cast<unsigned>(_projector->getWidth() / _pickRadius), 1u, MAX_GRID_DIM);
+    _gridRows = osg::clampBetween(static_cast<unsigned>(_projector->getHeight() / _pickRadius), 1u, MAX_GRID_DIM);
+    _cells.resize(_gridCols * _gridRows);
+    _cellSplit.resize(_gridCols * _gridRows, NO_CELL);
+}
+
+bool EntityPointLayer::pick(const osg::Vec2f& uv, unsigned& out_id, osg::Vec2f& out_lonLat, float& out_distance) const
+{
+    if (_cells.empty())
+        return false;
+
+    // Cells are at least a pick radius wide, so the neighbours of the
+    // point's cell cover the whole pick circle
+    float cellW = _projector->getWidth() / _gridCols;
+    float cellH = _projector->getHeight() / _gridRows;
+    int col = static_cast<int>(floor(uv.x() / cellW));
+    int row = static_cast<int>(floor(uv.y() / cellH));
+
+    float best = _pickRadius * _pickRadius;
+    bool found = false;
+    for (int r = std::max(row - 1, 0); r <= std::min(row + 1, static_cast<int>(_gridRows) - 1); ++r) {
+        for (int c = std::max(col - 1, 0); c <= std::min(col + 1, static_cast<int>(_gridCols) - 1); ++c) {
+            unsigned cell = r * _gridCols + c;
+            unsigned first = _cellSplit[cell];
+            if (first == NO_CELL) {
+                // Unsplit cells hold at most MAX_CELL_SIZE entities
+                found |= pickNearest(_cells[cell], MAX_CELL_SIZE, uv, best, out_id, out_lonLat);
+                continue;
+            }
+
+            // Skip subcells farther away than the nearest entity found so far
+            float subW = cellW / SUBDIVISIONS;
+            float subH = cellH / SUBDIVISIONS;
+            for (unsigned sr = 0; sr < SUBDIVISIONS; ++sr) {
+                float y0 = r * cellH + sr * subH;
+                float dy = std::max(std::max(y0 - uv.y(), uv.y() - (y0 + subH)), 0.0f);
+                if (dy * dy > best)
+                    continue;
+                for (unsigned sc = 0; sc < SUBDIVISIONS; ++sc) {
+                    float x0 = c * cellW + sc * subW;
+                    float dx = std::max(std::max(x0 - uv.x(), uv.x() - (x0 + subW)), 0.0f);
+                    if (dx * dx + dy * dy > best)
+                        continue;
+                    found |= pickNearest(_cells[first + sr * SUBDIVISIONS + sc], MAX_SUBCELL_CANDIDATES,
+                        uv, best, out_id, out_lonLat);
+                }
+            }
+        }
+    }
+    if (found)
+        out_distance = sqrt(best);
+    return found;
+}
+
+bool EntityPointLayer::pickNearest(const std::vector<unsigned>& members, unsigned maxCandidates,
+    const osg::Vec2f& uv, float& inout_best, unsigned& out_id, osg::Vec2f& out_lonLat) const
+{
+    bool found = false;
+    unsigned n = std::min(static_cast<unsigned>(members.size()), maxCandidates);
+    for (unsigned i = 0; i < n; ++i) {
+        unsigned slot = members[i];
+        float d2 = (getVertex(slot) - uv).length2();
+        if (d2 <= inout_best) {
+            inout_best = d2;
+            out_id = _drawnIds[slot];
+            out_lonLat = _drawnLonLat[slot];
+            found = true;
+        }
+    }
+    return found;
+}
+
+void EntityPointLayer::sync()
+{
+    if (!_projector.valid())
+        return;
+
+    // Only copy the written chunks under the lock; projecting them and
+    // updating the pick grid happen after the producer is released
+    unsigned count;
+    {
+        ScopedLock lock(_mutex);
+        if (!_dirty)
+            return;
+        count = static_cast<unsigned>(_staging.size());
+        _drawnIds.resize(count);
+        _drawnLonLat.resize(count);
+        _syncChunks.clear();
+        for (unsigned c = 0; c < _chunkDirty.size(); ++c) {
+            if (!_chunkDirty[c])
+                continue;
+            _chunkDirty[c] = false;
+            unsigned begin = c * CHUNK_SIZE;
+            unsigned end = std::min(count, begin + CHUNK_SIZE);
+            if (begin >= end)
+                continue;
+            std::copy(_staging.begin() + begin, _staging.begin() + end, _drawnLonLat.begin() + begin);
+            std::copy(_slotIds.begin() + begin, _slotIds.begin() + end, _drawnIds.begin() + begin);
+            _syncChunks.push_back(c);
+        }
+        _dirty = false;
+    }
+
+    unsigned numChunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    while (_chunks.size() < numChunks) {
+        _chunks.push_back(createChunk(_color.get()));
+        addChild(_chunks.back().get());
+    }
+
+    // Slots past the new end leave the pick grid
+    if (!_cells.empty()) {
+        for (unsigned slot = count; slot < _drawnCount; ++slot)
+            gridRemove(slot);
+    }
+    _slotCell.resize(count, NO_CELL);
+    _slotCellIndex.resize(count);
+
+    // Project the copied chunks; untouched chunks keep their buffer objects
+    // as they are
+    const OverviewProjector& projector = *_projector;
+    for (std::vector<unsigned>::const_iterator i = _syncChunks.begin(); i != _syncChunks.end(); ++i) {
+        unsigned c = *i;
+        unsigned begin = c * CHUNK_SIZE;
+        unsigned end = std::min(count, begin + CHUNK_SIZE);
+        osg::Vec2Array* verts = static_cast<osg::Vec2Array*>(_chunks[c]->getVertexArray());
+        for (unsigned slot = begin; slot < end; ++slot) {
+            const osg::Vec2f& lonLat = _drawnLonLat[slot];
+            osg::Vec2f& uv = (*verts)[slot - begin];
+            bool visible = projector.project(lonLat.x(), lonLat.y(), uv);
+            if (!visible) {
+                uv = HIDDEN_VERTEX;
+                if (!_cells.empty())
+                    gridRemove(slot);
+            } else if (!_cells.empty()) {
+                unsigned cell = cellOf(uv);
+                if (cell != _slotCell[slot]) {
+                    gridRemove(slot);
+                    gridInsert(slot, cell);
+                }
+            }
+        }
+        verts->dirty();
+        _chunks[c]->dirtyBound();
+    }
+
+    // Draw counts only change for chunks around the old and new ends
+    for (unsigned c = 0; c < _chunks.size(); ++c) {
+        unsigned chunkStart = c * CHUNK_SIZE;
+        unsigned n = count > chunkStart ? std::min(count - chunkStart, CHUNK_SIZE) : 0;
+        osg::DrawArrays* da = static_cast<osg::DrawArrays*>(_chunks[c]->getPrimitiveSet(0));
+        if (da->getCount() != static_cast<GLsizei>(n)) {
+            da->setCount(n);
+            da->dirty();
+            _chunks[c]->dirtyBound();
+        }
+    }
+
+    _drawnCount = count;
+}
+
+void EntityPointLayer::traverse(osg::NodeVisitor& nv)
+{
+    if (nv.getVisitorType() == osg::NodeVisitor::UPDATE_VISITOR)
+        sync();
+    osg::Group::traverse(nv);
+}
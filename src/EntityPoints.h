@@ -0,0 +1,127 @@
+#ifndef ENTITYPOINTS_H
+#define ENTITYPOINTS_H 1
+
+#include "OverviewProjection.h"
+
+#include <osg/Geometry>
+#include <osg/Group>
+#include <OpenThreads/Mutex>
+
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Point layer for the overview map fed from a producer thread. Positions are
+ * kept as packed (lon, lat) floats in a staging buffer guarded by a mutex.
+ * The drawn arrays are split into chunks with their own buffer objects, and
+ * the producer marks the chunks it writes to. The update traversal copies
+ * only those chunks out of the staging buffer under the lock, then projects
+ * them and re-uploads their buffer objects without holding it. Removing an
+ * entity moves the last one into its slot, keeping the drawn range packed.
+ */
+class EntityPointLayer : public osg::Group
+{
+public:
+    EntityPointLayer(const osg::Vec4& color, unsigned capacity = 100000);
+
+    /** Points per buffer object; also the granularity of partial uploads. */
+    static const unsigned CHUNK_SIZE = 4096;
+
+    /** Adds or moves an entity (degrees). Safe to call from any thread. */
+    void setPosition(unsigned id, float lon, float lat);
+
+    /** Adds or moves many entities under a single lock. */
+    void setPositions(const unsigned* ids, const osg::Vec2f* lonLat, unsigned count);
+
+    /** Removes an entity. Safe to call from any thread. */
+    void remove(unsigned id);
+
+    /** Removes every entity. */
+    void clear();
+
+    /** Number of entities stored by the producer, including unsynced ones. */
+    unsigned size() const;
+
+    /** Number of entities drawn as of the last update traversal. */
+    unsigned getNumDrawn() const { return _drawnCount; }
+
+    /**
+     * Looks up the entity drawn at a slot as of the last update traversal;
+     * false if the slot is unused. Call from the update or event traversal.
+     */
+    bool getDrawnEntity(unsigned slot, unsigned& out_id, osg::Vec2f& out_lonLat) const;
+
+    /**
+     * Sets the mapping to control pixels. Nothing is drawn until a projector
+     * is set; a new one reprojects every entity on the next update.
+     */
+    void setProjector(const OverviewProjector* projector);
+
+    /** Pick distance in control pixels (default 6). */
+    void setPickRadius(float pixels);
+    float getPickRadius() const { return _pickRadius; }
+
+    /**
+     * Finds the drawn entity nearest to a point in control pixels (origin
+     * bottom left), within the pick radius. Only the grid cells around the
+     * point are searched, and cells crowded past 64 entities are split into
+     * 8 x 8 subcells of which at most 16 entities are tested, so a pick tests
+     * at most 9 x 64 x 16 points whatever the entity count. The result is
+     * exact unless more than 16 entities share a subcell, usually under a
+     * pixel wide; then it is at most a subcell diagonal farther away than the
+     * nearest entity. Call from the update or event traversal.
+     */
+    bool pick(const osg::Vec2f& uv, unsigned& out_id, osg::Vec2f& out_lonLat, float& out_distance) const;
+
+public: // osg::Node
+    virtual void traverse(osg::NodeVisitor& nv);
+
+protected:
+    virtual ~EntityPointLayer() { }
+
+private:
+    void setPositionLocked(unsigned id, float lon, float lat);
+    void markDirty(unsigned slot);
+    void markAllDirty();
+    void sync();
+    const osg::Vec2f& getVertex(unsigned slot) const;
+
+    unsigned cellOf(const osg::Vec2f& uv) const;
+    void gridInsert(unsigned slot, unsigned cell);
+    void splitCell(unsigned cell);
+    bool pickNearest(const std::vector<unsigned>& members, unsigned maxCandidates,
+        const osg::Vec2f& uv, float& inout_best, unsigned& out_id, osg::Vec2f& out_lonLat) const;
+    void gridRemove(unsigned slot);
+    void resetGrid();
+
+    unsigned _capacity;
+    osg::ref_ptr<osg::Vec4Array> _color;
+    std::vector<osg::ref_ptr<osg::Geometry> > _chunks;
+    osg::ref_ptr<const OverviewProjector> _projector;
+
+    // Producer side, guarded by _mutex
+    mutable OpenThreads::Mutex _mutex;
+    std::vector<osg::Vec2f> _staging;
+    std::vector<unsigned> _slotIds;
+    std::unordered_map<unsigned, unsigned> _slots;
+    std::vector<bool> _chunkDirty;
+    bool _dirty;
+
+    // Render side copy of the slot owners and positions, written during sync
+    std::vector<unsigned> _drawnIds;
+    std::vector<osg::Vec2f> _drawnLonLat;
+    unsigned _drawnCount;
+    std::vector<unsigned> _syncChunks;      ///< Chunks copied by the current sync
+
+    // Pick grid over the drawn pixels, with cells at least a pick radius
+    // wide and crowded cells split further; kept up to date during sync
+    float _pickRadius;
+    unsigned _gridCols;
+    unsigned _gridRows;
+    std::vector<std::vector<unsigned> > _cells;     ///< Grid cells, then the subcells of split ones
+    std::vector<unsigned> _cellSplit;               ///< First subcell of each grid cell, or NO_CELL
+    std::vector<unsigned> _slotCell;
+    std::vector<unsigned> _slotCellIndex;
+};
+
+#endif
@@ -0,0 +1,225 @@
+#include "EntityTrails.h"
+
+#include <osg/LineWidth>
+#include <osgEarth/NodeUtils>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+// Smallest queue worth compacting
+const size_t MIN_COMPACT_SIZE = 4096;
+
+}
+
+const unsigned EntityTrailLayer::TRACKS_PER_CHUNK;
+
+EntityTrailLayer::EntityTrailLayer(const osg::Vec4& color, unsigned maxTracks, unsigned segmentsPerTrack)
+    : _maxTracks(maxTracks)
+    , _segments(std::max(segmentsPerTrack, 1u))
+    , _minPixelDistance(2.0f)
+    , _color(new osg::Vec4Array)
+    , _compactAt(MIN_COMPACT_SIZE)
+{
+    _color->push_back(color);
+    getOrCreateStateSet()->setAttribute(new osg::LineWidth(1.0f), osg::StateAttribute::ON);
+
+    // sync() runs from the update traversal
+    ADJUST_UPDATE_TRAV_COUNT(this, 1);
+}
+
+void EntityTrailLayer::setProjector(const OverviewProjector* projector)
+{
+    if (projector == _projector.get())
+        return;
+    _projector = projector;
+    for (std::unordered_map<unsigned, unsigned>::const_iterator i = _tracks.begin(); i != _tracks.end(); ++i)
+        restart(i->second);
+    uploadChunks();
+}
+
+void EntityTrailLayer::append(unsigned id, float lon, float lat)
+{
+    Command cmd;
+    cmd.id = id;
+    cmd.lonLat.set(lon, lat);
+    cmd.remove = false;
+    ScopedLock lock(_mutex);
+    if (_queue.size() >= _compactAt)
+        compactQueue();
+    _queue.push_back(cmd);
+}
+
+void EntityTrailLayer::remove(unsigned id)
+{
+    Command cmd;
+    cmd.id = id;
+    cmd.remove = true;
+    ScopedLock lock(_mutex);
+    if (_queue.size() >= _compactAt)
+        compactQueue();
+    _queue.push_back(cmd);
+}
+
+void EntityTrailLayer::compactQueue()
+{
+    // Walk back from the newest command. A track shows at most _segments segments,
+    // so older positions would be overwritten anyway, and nothing before a removal
+    // survives it.
+    std::unordered_map<unsigned, unsigned> kept;
+    size_t out = _queue.size();
+    for (size_t i = _queue.size(); i-- > 0;) {
+        const Command cmd = _queue[i];
+        unsigned& count = kept[cmd.id];
+        if (count > _segments)
+            continue;
+        count = cmd.remove ? _segments + 1 : count + 1;
+        _queue[--out] = cmd;
+    }
+    _queue.erase(_queue.begin(), _queue.begin() + out);
+    // Grow the threshold with the live tracks so compaction stays amortized
+    _compactAt = std::max(_queue.size() * 2, MIN_COMPACT_SIZE);
+}
+
+osg::Vec2Array* EntityTrailLayer::getChunkVerts(unsigned track, unsigned& out_offset)
+{
+    unsigned c = track / TRACKS_PER_CHUNK;
+    if (c >= _chunks.size()) {
+        // Segments are drawn as independent line pairs so a ring needs no
+        // index buffer; unused segments are zero length and draw nothing
+        unsigned numVerts = TRACKS_PER_CHUNK * _segments * 2;
+        osg::Geometry* geom = new osg::Geometry();
+        geom->setUseVertexBufferObjects(true);
+        geom->setUseDisplayList(false);
+        geom->setDataVariance(osg::Object::DYNAMIC);
+        osg::Vec2Array* verts = new osg::Vec2Array(numVerts);
+        verts->setDataVariance(osg::Object::DYNAMIC);
+        geom->setVertexArray(verts);
+        geom->setColorArray(_color.get(), osg::Array::BIND_OVERALL);
+        geom->addPrimitiveSet(new osg::DrawArrays(GL_LINES, 0, numVerts));
+        _chunks.push_back(geom);
+        _chunkDirty.push_back(false);
+        addChild(geom);
+    }
+    _chunkDirty[c] = true;
+    out_offset = (track % TRACKS_PER_CHUNK) * _segments * 2;
+    return static_cast<osg::Vec2Array*>(_chunks[c]->getVertexArray());
+}
+
+void EntityTrailLayer::fillTrack(unsigned track, const osg::Vec2f& uv)
+{
+    unsigned offset;
+    osg::Vec2Array* verts = getChunkVerts(track, offset);
+    std::fill(verts->begin() + offset, verts->begin() + offset + _segments * 2, uv);
+}
+
+void EntityTrailLayer::restart(unsigned track)
+{
+    osg::Vec2f uv;
+    _trackLastVisible[track] = _projector->project(_trackLastLonLat[track].x(), _trackLastLonLat[track].y(), uv);
+    _trackLast[track] = uv;
+    _trackHead[track] = 0;
+    // Zero-length segments at the last position draw nothing
+    fillTrack(track, uv);
+}
+
+void EntityTrailLayer::record(unsigned id, const osg::Vec2f& lonLat)
+{
+    std::unordered_map<unsigned, unsigned>::iterator i = _tracks.find(id);
+    if (i == _tracks.end()) {
+        unsigned track;
+        if (!_freeTracks.empty()) {
+            track = _freeTracks.back();
+            _freeTracks.pop_back();
+        } else if (_trackHead.size() < _maxTracks) {
+            track = static_cast<unsigned>(_trackHead.size());
+            _trackHead.push_back(0);
+            _trackLast.push_back(osg::Vec2f());
+            _trackLastLonLat.push_back(lonLat);
+            _trackLastVisible.push_back(false);
+        } else {
+            return;
+        }
+        _tracks[id] = track;
+        _trackLastLonLat[track] = lonLat;
+        restart(track);
+        return;
+    }
+
+    unsigned track = i->second;
+    osg::Vec2f uv;
+    bool visible = _projector->project(lonLat.x(), lonLat.y(), uv);
+    bool wasVisible = _trackLastVisible[track];
+    if (visible && wasVisible && (uv - _trackLast[track]).length2() < _minPixelDistance * _minPixelDistance)
+        return;
+
+    // Overwrite the oldest segment. Segments touching the hidden side of the
+    // projection, or jumping across the antimeridian of a cylindrical one,
+    // are left zero length instead of drawn across the map.
+    bool wraps = _projector->isCylindrical() && fabs(lonLat.x() - _trackLastLonLat[track].x()) > 180.0f;
+    if (visible) {
+        unsigned offset;
+        osg::Vec2Array* verts = getChunkVerts(track, offset);
+        unsigned v = offset + _trackHead[track] * 2;
+        (*verts)[v] = wasVisible && !wraps ? _trackLast[track] : uv;
+        (*verts)[v + 1] = uv;
+        _trackHead[track] = (_trackHead[track] + 1) % _segments;
+    }
+    _trackLast[track] = uv;
+    _trackLastLonLat[track] = lonLat;
+    _trackLastVisible[track] = visible;
+}
+
+void EntityTrailLayer::release(unsigned id)
+{
+    std::unordered_map<unsigned, unsigned>::iterator i = _tracks.find(id);
+    if (i == _tracks.end())
+        return;
+    unsigned track = i->second;
+    _tracks.erase(i);
+    fillTrack(track, _trackLast[track]);
+    _freeTracks.push_back(track);
+}
+
+void EntityTrailLayer::uploadChunks()
+{
+    for (unsigned c = 0; c < _chunks.size(); ++c) {
+        if (_chunkDirty[c]) {
+            _chunks[c]->getVertexArray()->dirty();
+            _chunks[c]->dirtyBound();
+            _chunkDirty[c] = false;
+        }
+    }
+}
+
+void EntityTrailLayer::sync()
+{
+    {
+        ScopedLock lock(_mutex);
+        if (_queue.empty() || !_projector.valid())
+            return;
+        _applying.swap(_queue);
+    }
+
+    for (size_t i = 0; i < _applying.size(); ++i) {
+        const Command& cmd = _applying[i];
+        if (cmd.remove)
+            release(cmd.id);
+        else
+            record(cmd.id, cmd.lonLat);
+    }
+    _applying.clear();
+
+    uploadChunks();
+}
+
+void EntityTrailLayer::traverse(osg::NodeVisitor& nv)
+{
+    if (nv.getVisitorType() == osg::NodeVisitor::UPDATE_VISITOR)
+        sync();
+    osg::Group::traverse(nv);
+}
@@ -0,0 +1,98 @@
+#ifndef ENTITYTRAILS_H
+#define ENTITYTRAILS_H 1
+
+#include "OverviewProjection.h"
+
+#include <osg/Geometry>
+#include <osg/Group>
+#include <OpenThreads/Mutex>
+
+#include <unordered_map>
+#include <vector>
+
+/**
+ * History trails for overview map entities. Every track owns a fixed run of
+ * segments in one contiguous vertex pool, used as a ring: a new position
+ * overwrites the track's oldest segment, so appending never allocates. Track
+ * state (owner, ring head, last recorded position) is kept in parallel arrays
+ * indexed by track slot. Positions closer than the minimum pixel distance to
+ * the last recorded one are dropped, which keeps a small inset from storing
+ * more vertices than it can show. Positions are projected as they are
+ * recorded; a new projector restarts every trail at its entity's last position.
+ *
+ * Producers append from any thread; the update traversal applies the queued
+ * positions to the pool. While nothing drains the queue (no projector yet, or
+ * the layer is not traversed) it is compacted to the newest positions each
+ * track can show, so it stays bounded. The pool is split into chunks with their own buffer
+ * objects and only chunks written this frame are uploaded.
+ */
+class EntityTrailLayer : public osg::Group
+{
+public:
+    EntityTrailLayer(const osg::Vec4& color, unsigned maxTracks = 16384, unsigned segmentsPerTrack = 16);
+
+    /** Tracks per buffer object; also the granularity of partial uploads. */
+    static const unsigned TRACKS_PER_CHUNK = 1024;
+
+    /** Queues a position (degrees) for the entity's trail. Safe to call from any thread. */
+    void append(unsigned id, float lon, float lat);
+
+    /** Queues removal of the entity's trail. Safe to call from any thread. */
+    void remove(unsigned id);
+
+    /** Positions closer than this to the last recorded one are dropped (default 2). */
+    void setMinPixelDistance(float pixels) { _minPixelDistance = pixels; }
+    float getMinPixelDistance() const { return _minPixelDistance; }
+
+    /** Sets the mapping to control pixels; nothing is recorded until one is set. */
+    void setProjector(const OverviewProjector* projector);
+
+    /** Number of tracks with a trail, as of the last update traversal. */
+    unsigned getNumTracks() const { return static_cast<unsigned>(_tracks.size()); }
+
+public: // osg::Node
+    virtual void traverse(osg::NodeVisitor& nv);
+
+protected:
+    virtual ~EntityTrailLayer() { }
+
+private:
+    struct Command {
+        unsigned id;
+        osg::Vec2f lonLat;
+        bool remove;
+    };
+
+    void sync();
+    void compactQueue();
+    void uploadChunks();
+    void record(unsigned id, const osg::Vec2f& lonLat);
+    void release(unsigned id);
+    void restart(unsigned track);
+    void fillTrack(unsigned track, const osg::Vec2f& uv);
+    osg::Vec2Array* getChunkVerts(unsigned track, unsigned& out_offset);
+
+    unsigned _maxTracks;
+    unsigned _segments;
+    float _minPixelDistance;
+    osg::ref_ptr<const OverviewProjector> _projector;
+    osg::ref_ptr<osg::Vec4Array> _color;
+    std::vector<osg::ref_ptr<osg::Geometry> > _chunks;
+    std::vector<bool> _chunkDirty;
+
+    // Producer queue, guarded by _mutex
+    OpenThreads::Mutex _mutex;
+    std::vector<Command> _queue;
+    std::vector<Command> _applying;
+    size_t _compactAt;                          ///< Queue size that triggers compactQueue()
+
+    // Track pool, one entry per track slot
+    std::unordered_map<unsigned, unsigned> _tracks;
+    std::vector<unsigned> _freeTracks;
+    std::vector<unsigned> _trackHead;
+    std::vector<osg::Vec2f> _trackLast;         ///< Last recorded pixel
+    std::vector<osg::Vec2f> _trackLastLonLat;
+    std::vector<bool> _trackLastVisible;
+};
+
+#endif
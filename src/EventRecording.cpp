@@ -0,0 +1,292 @@
+#include "EventRecording.h"
+
+#include <osg/Notify>
+
+#include <cstring>
+#include <stdint.h>
+
+namespace {
+
+const char MAGIC[4] = { 'E', 'M', 'E', 'V' };
+const uint32_t VERSION = 1;
+
+// Record tags
+const uint8_t WINDOW_RECORD = 'W';
+const uint8_t INPUT_RECORD = 'E';
+const uint8_t FRAME_RECORD = 'F';
+
+template<typename T>
+void put(std::ostream& out, T value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+bool get(std::istream& in, T& out_value)
+{
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&out_value), sizeof(T)));
+}
+
+bool isKeyEvent(unsigned type)
+{
+    return type == osgGA::GUIEventAdapter::KEYDOWN || type == osgGA::GUIEventAdapter::KEYUP;
+}
+
+bool isButtonEvent(unsigned type)
+{
+    return type == osgGA::GUIEventAdapter::PUSH || type == osgGA::GUIEventAdapter::RELEASE
+        || type == osgGA::GUIEventAdapter::DOUBLECLICK;
+}
+
+}
+
+EventRecorder::EventRecorder(const std::string& path)
+    : _out(path.c_str(), std::ios::binary)
+    , _hasWindow(false)
+    , _yOrientation(0)
+    , _numFrames(0)
+{
+    if (!_out) {
+        OSG_WARN << "EventRecorder: cannot open " << path << std::endl;
+        return;
+    }
+    _out.write(MAGIC, sizeof(MAGIC));
+    put(_out, VERSION);
+}
+
+EventRecorder::~EventRecorder()
+{
+    if (_out.is_open())
+        OSG_NOTICE << "EventRecorder: recorded " << _numFrames << " frames" << std::endl;
+}
+
+bool EventRecorder::isOpen() const
+{
+    return _out.is_open() && _out.good();
+}
+
+void EventRecorder::install(osgViewer::View* view)
+{
+    view->getEventHandlers().push_front(this);
+}
+
+void EventRecorder::recordWindow(const osgGA::GUIEventAdapter& ea)
+{
+    const int window[4] = { ea.getWindowX(), ea.getWindowY(), ea.getWindowWidth(), ea.getWindowHeight() };
+    const float range[4] = { ea.getXmin(), ea.getXmax(), ea.getYmin(), ea.getYmax() };
+    const int yOrientation = ea.getMouseYOrientation();
+    if (_hasWindow && memcmp(window, _window, sizeof(window)) == 0 && memcmp(range, _range, sizeof(range)) == 0
+        && yOrientation == _yOrientation) {
+        return;
+    }
+    memcpy(_window, window, sizeof(window));
+    memcpy(_range, range, sizeof(range));
+    _yOrientation = yOrientation;
+    _hasWindow = true;
+
+    put(_out, WINDOW_RECORD);
+    for (int i = 0; i < 4; ++i)
+        put(_out, static_cast<int32_t>(window[i]));
+    for (int i = 0; i < 4; ++i)
+        put(_out, range[i]);
+    put(_out, static_cast<uint8_t>(yOrientation));
+}
+
+bool EventRecorder::handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter&)
+{
+    if (!isOpen())
+        return false;
+
+    recordWindow(ea);
+    const unsigned type = ea.getEventType();
+    if (type == osgGA::GUIEventAdapter::FRAME) {
+        put(_out, FRAME_RECORD);
+        put(_out, ea.getTime());
+        ++_numFrames;
+        // A session that crashes still leaves every finished frame on disk
+        _out.flush();
+        return false;
+    }
+
+    // Only the fields that mean something for the event type are written
+    put(_out, INPUT_RECORD);
+    put(_out, static_cast<uint32_t>(type));
+    put(_out, ea.getTime());
+    put(_out, ea.getX());
+    put(_out, ea.getY());
+    put(_out, static_cast<uint8_t>(ea.getButtonMask()));
+    put(_out, static_cast<uint16_t>(ea.getModKeyMask()));
+    if (isKeyEvent(type)) {
+        put(_out, static_cast<int32_t>(ea.getKey()));
+        put(_out, static_cast<int32_t>(ea.getUnmodifiedKey()));
+    } else if (isButtonEvent(type)) {
+        put(_out, static_cast<uint8_t>(ea.getButton()));
+    } else if (type == osgGA::GUIEventAdapter::SCROLL) {
+        put(_out, static_cast<uint8_t>(ea.getScrollingMotion()));
+        put(_out, ea.getScrollingDeltaX());
+        put(_out, ea.getScrollingDeltaY());
+    }
+    return false;
+}
+
+EventPlayer::EventPlayer()
+{
+}
+
+bool EventPlayer::load(const std::string& path)
+{
+    _windows.clear();
+    _inputs.clear();
+    _frames.clear();
+
+    std::ifstream in(path.c_str(), std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    uint32_t version = 0;
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || !get(in, version)
+        || version != VERSION) {
+        OSG_WARN << "EventPlayer: " << path << " is not an event recording" << std::endl;
+        return false;
+    }
+
+    // Until the first window record, events get an empty window
+    Window window = { 0, 0, 0, 0, -1.0f, 1.0f, -1.0f, 1.0f, 0 };
+    _windows.push_back(window);
+
+    uint8_t tag;
+    bool complete = true;
+    unsigned frameStart = 0;
+    while (get(in, tag)) {
+        if (tag == WINDOW_RECORD) {
+            int32_t rect[4];
+            uint8_t yOrientation;
+            complete = get(in, rect[0]) && get(in, rect[1]) && get(in, rect[2]) && get(in, rect[3])
+                && get(in, window.xMin) && get(in, window.xMax) && get(in, window.yMin) && get(in, window.yMax)
+                && get(in, yOrientation);
+            window.x = rect[0];
+            window.y = rect[1];
+            window.width = rect[2];
+            window.height = rect[3];
+            window.yOrientation = yOrientation;
+            // The initial placeholder is replaced by the first real window
+            if (_windows.size() == 1 && _inputs.empty() && _frames.empty())
+                _windows[0] = window;
+            else
+                _windows.push_back(window);
+        } else if (tag == FRAME_RECORD) {
+            Frame frame;
+            complete = get(in, frame.time);
+            frame.firstInput = frameStart;
+            frame.numInputs = static_cast<unsigned>(_inputs.size()) - frameStart;
+            frameStart = static_cast<unsigned>(_inputs.size());
+            if (complete)
+                _frames.push_back(frame);
+        } else if (tag == INPUT_RECORD) {
+            Input input = Input();
+            uint32_t type;
+            uint8_t buttonMask;
+            uint16_t modKeyMask;
+            complete = get(in, type) && get(in, input.time) && get(in, input.x) && get(in, input.y)
+                && get(in, buttonMask) && get(in, modKeyMask);
+            input.type = type;
+            input.buttonMask = buttonMask;
+            input.modKeyMask = modKeyMask;
+            if (complete && isKeyEvent(type)) {
+                int32_t key, unmodifiedKey;
+                complete = get(in, key) && get(in, unmodifiedKey);
+                input.key = key;
+                input.unmodifiedKey = unmodifiedKey;
+            } else if (complete && isButtonEvent(type)) {
+                uint8_t button;
+                complete = get(in, button);
+                input.button = button;
+            } else if (complete && type == osgGA::GUIEventAdapter::SCROLL) {
+                uint8_t motion;
+                complete = get(in, motion) && get(in, input.scrollingDeltaX) && get(in, input.scrollingDeltaY);
+                input.scrollingMotion = motion;
+            }
+            input.window = static_cast<unsigned>(_windows.size()) - 1;
+            if (complete)
+                _inputs.push_back(input);
+        } else {
+            OSG_WARN << "EventPlayer: unknown record in " << path << std::endl;
+            complete = false;
+        }
+        if (!complete)
+            break;
+    }
+
+    // A session that crashed leaves a partial record at the end; replay what came before it
+    if (!complete)
+        OSG_WARN << "EventPlayer: " << path << " ends early, replaying " << _frames.size() << " frames" << std::endl;
+    if (_frames.empty()) {
+        OSG_WARN << "EventPlayer: no frames in " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void EventPlayer::getWindowSize(int& out_width, int& out_height) const
+{
+    out_width = _windows.empty() ? 0 : _windows.front().width;
+    out_height = _windows.empty() ? 0 : _windows.front().height;
+}
+
+void EventPlayer::queueInput(osgGA::EventQueue* queue, const Input& input) const
+{
+    const Window& window = _windows[input.window];
+    osgGA::GUIEventAdapter* event = queue->createEvent();
+    event->setWindowRectangle(window.x, window.y, window.width, window.height, false);
+    event->setInputRange(window.xMin, window.yMin, window.xMax, window.yMax);
+    event->setMouseYOrientation(static_cast<osgGA::GUIEventAdapter::MouseYOrientation>(window.yOrientation));
+    event->setEventType(static_cast<osgGA::GUIEventAdapter::EventType>(input.type));
+    event->setTime(input.time);
+    event->setX(input.x);
+    event->setY(input.y);
+    event->setButtonMask(input.buttonMask);
+    event->setModKeyMask(input.modKeyMask);
+    if (isKeyEvent(input.type)) {
+        event->setKey(input.key);
+        event->setUnmodifiedKey(input.unmodifiedKey);
+    } else if (isButtonEvent(input.type)) {
+        event->setButton(input.button);
+    } else if (input.type == osgGA::GUIEventAdapter::SCROLL) {
+        event->setScrollingMotion(static_cast<osgGA::GUIEventAdapter::ScrollingMotion>(input.scrollingMotion));
+        event->setScrollingDeltaX(input.scrollingDeltaX);
+        event->setScrollingDeltaY(input.scrollingDeltaY);
+    }
+    queue->addEvent(event);
+}
+
+int EventPlayer::run(osgViewer::Viewer& viewer)
+{
+    if (_frames.empty())
+        return 1;
+
+    // The first frame sets the viewer and manipulator up; the recording replays after it
+    if (!viewer.isRealized())
+        viewer.realize();
+    viewer.frame();
+
+    osgGA::EventQueue* queue = viewer.getEventQueue();
+    unsigned replayed = 0;
+    for (; replayed < _frames.size() && !viewer.done(); ++replayed) {
+        const Frame& frame = _frames[replayed];
+        viewer.advance();
+        for (unsigned i = 0; i < frame.numInputs; ++i)
+            queueInput(queue, _inputs[frame.firstInput + i]);
+
+        // The frame event and the event cut-off take the frame stamp's time; the rest
+        // of the frame keeps the real time so the frame stats measure the replay
+        osg::FrameStamp* stamp = viewer.getFrameStamp();
+        const double now = stamp->getReferenceTime();
+        stamp->setReferenceTime(frame.time);
+        viewer.eventTraversal();
+        stamp->setReferenceTime(now);
+
+        viewer.updateTraversal();
+        viewer.renderingTraversals();
+    }
+
+    OSG_NOTICE << "EventPlayer: replayed " << replayed << " of " << _frames.size() << " frames" << std::endl;
+    return 0;
+}
@@ -0,0 +1,117 @@
+#ifndef EVENTRECORDING_H
+#define EVENTRECORDING_H
+
+#include <osgGA/GUIEventHandler>
+#include <osgViewer/Viewer>
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+/**
+ * Records every event the view's handlers see to a compact binary file, for
+ * EventPlayer to replay. Add it ahead of the other handlers with install(), so it
+ * sees events before anything can mark them handled.
+ *
+ * The file starts with the magic "EMEV" and a version, followed by tagged records
+ * in native byte order: the window rectangle and input range whenever they change,
+ * each input event, and each frame's time. A frame's record follows the events it
+ * dispatched, and the file is flushed after it.
+ */
+class EventRecorder : public osgGA::GUIEventHandler
+{
+public:
+    EventRecorder(const std::string& path);
+
+    /** False if the file could not be opened; nothing is recorded then. */
+    bool isOpen() const;
+
+    /** Adds the recorder ahead of the view's other event handlers */
+    void install(osgViewer::View* view);
+
+    /** Frames recorded so far */
+    unsigned getNumFrames() const { return _numFrames; }
+
+public: // osgGA::GUIEventHandler
+    virtual bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa);
+
+protected:
+    virtual ~EventRecorder();
+
+private:
+    /** Writes the window record if the event's window or input range changed */
+    void recordWindow(const osgGA::GUIEventAdapter& ea);
+
+    std::ofstream _out;
+    bool _hasWindow;
+    int _window[4];                 ///< x, y, width, height
+    float _range[4];                ///< Xmin, Xmax, Ymin, Ymax
+    int _yOrientation;
+    unsigned _numFrames;
+};
+
+/**
+ * Replays a file written by EventRecorder. Each recorded frame runs as one viewer
+ * frame: its input events are queued with their recorded times and the frame event
+ * carries the recorded frame time, so manipulators and handlers see the same events
+ * at the same times as in the recorded session. Frame stats still measure the replay.
+ *
+ * Live input would break the replay, so it is meant to run offscreen at the
+ * recorded window size.
+ */
+class EventPlayer
+{
+public:
+    EventPlayer();
+
+    /** Reads a recording; false if it cannot be read or holds no frames */
+    bool load(const std::string& path);
+
+    /** Window size at the start of the recording */
+    void getWindowSize(int& out_width, int& out_height) const;
+
+    /** Frames in the recording */
+    unsigned getNumFrames() const { return static_cast<unsigned>(_frames.size()); }
+
+    /**
+     * Realizes the viewer and replays every recorded frame, or until the viewer is done.
+     * @return 0 on success, like osgViewer::Viewer::run()
+     */
+    int run(osgViewer::Viewer& viewer);
+
+private:
+    struct Window {
+        int x, y, width, height;
+        float xMin, xMax, yMin, yMax;
+        int yOrientation;
+    };
+
+    struct Input {
+        unsigned type;
+        double time;
+        float x, y;
+        int button;
+        int buttonMask;
+        int modKeyMask;
+        int key;
+        int unmodifiedKey;
+        int scrollingMotion;
+        float scrollingDeltaX, scrollingDeltaY;
+        unsigned window;            ///< Index into _windows
+    };
+
+    struct Frame {
+        double time;
+        unsigned firstInput;
+        unsigned numInputs;
+    };
+
+    /** Queues a recorded input event with its recorded time and window */
+    void queueInput(osgGA::EventQueue* queue, const Input& input) const;
+
+    std::vector<Window> _windows;
+    std::vector<Input> _inputs;
+    std::vector<Frame> _frames;
+};
+
+#endif
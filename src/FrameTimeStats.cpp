@@ -0,0 +1,153 @@
+#include "FrameTimeStats.h"
+
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+
+namespace {
+
+typedef OpenThreads::ScopedLock<OpenThreads::Mutex> ScopedLock;
+
+}
+
+const unsigned FrameTimeStats::WINDOW;
+const unsigned FrameTimeStats::NUM_BUCKETS;
+const unsigned FrameTimeStats::MAX_HITCHES;
+
+// 0.25 ms buckets cover frames up to 100 ms
+const double FrameTimeStats::BUCKET_WIDTH = 0.00025;
+
+FrameTimeStats::FrameTimeStats()
+    : _hitchBudget(1.0 / 30.0)
+{
+    reset();
+}
+
+void FrameTimeStats::setHitchBudget(double seconds)
+{
+    ScopedLock lock(_mutex);
+    _hitchBudget = std::max(seconds, 0.0);
+}
+
+double FrameTimeStats::getHitchBudget() const
+{
+    ScopedLock lock(_mutex);
+    return _hitchBudget;
+}
+
+unsigned FrameTimeStats::bucketOf(double duration)
+{
+    if (duration <= 0.0)
+        return 0;
+    return std::min(static_cast<unsigned>(duration / BUCKET_WIDTH), NUM_BUCKETS);
+}
+
+bool FrameTimeStats::addFrame(unsigned frame, double duration, const double phases[NUM_PHASES])
+{
+    ScopedLock lock(_mutex);
+
+    // Replace the oldest sample once the window is full
+    bool rescan = false;
+    if (_count == WINDOW) {
+        double evicted = _samples[_next];
+        --_buckets[bucketOf(evicted)];
+        rescan = evicted >= _max;
+    } else {
+        ++_count;
+    }
+    _samples[_next] = duration;
+    _next = (_next + 1) % WINDOW;
+    ++_buckets[bucketOf(duration)];
+
+    // Only evicting the maximum needs a pass over the window
+    if (rescan)
+        _max = *std::max_element(_samples, _samples + _count);
+    else
+        _max = std::max(_max, duration);
+
+    if (_hitchBudget <= 0.0 || duration <= _hitchBudget)
+        return false;
+
+    Hitch& hitch = _hitches[_numHitches % MAX_HITCHES];
+    hitch.frame = frame;
+    hitch.duration = duration;
+    hitch.phase = EVENT;
+    for (int p = EVENT + 1; p < NUM_PHASES; ++p) {
+        if (phases[p] > phases[hitch.phase])
+            hitch.phase = static_cast<Phase>(p);
+    }
+    hitch.phaseTime = phases[hitch.phase];
+    ++_numHitches;
+    return true;
+}
+
+double FrameTimeStats::percentile(double p) const
+{
+    ScopedLock lock(_mutex);
+    if (_count == 0)
+        return 0.0;
+    unsigned rank = static_cast<unsigned>(p * _count + 0.5);
+    rank = std::max(1u, std::min(rank, _count));
+    unsigned seen = 0;
+    for (unsigned b = 0; b < NUM_BUCKETS; ++b) {
+        seen += _buckets[b];
+        if (seen >= rank)
+            return std::min((b + 1) * BUCKET_WIDTH, _max);
+    }
+    return _max;
+}
+
+double FrameTimeStats::maximum() const
+{
+    ScopedLock lock(_mutex);
+    return _max;
+}
+
+unsigned FrameTimeStats::getNumFrames() const
+{
+    ScopedLock lock(_mutex);
+    return _count;
+}
+
+unsigned FrameTimeStats::getHistogram(unsigned* out_bins, unsigned numBins) const
+{
+    ScopedLock lock(_mutex);
+    std::fill(out_bins, out_bins + numBins, 0u);
+    if (numBins == 0)
+        return 0;
+    unsigned perBin = (NUM_BUCKETS + 1 + numBins - 1) / numBins;
+    for (unsigned b = 0; b <= NUM_BUCKETS; ++b)
+        out_bins[std::min(b / perBin, numBins - 1)] += _buckets[b];
+    return *std::max_element(out_bins, out_bins + numBins);
+}
+
+unsigned FrameTimeStats::getNumHitches() const
+{
+    ScopedLock lock(_mutex);
+    return _numHitches;
+}
+
+unsigned FrameTimeStats::getHitches(Hitch* out_hitches, unsigned maxHitches) const
+{
+    ScopedLock lock(_mutex);
+    unsigned n = std::min(std::min(_numHitches, MAX_HITCHES), maxHitches);
+    for (unsigned i = 0; i < n; ++i)
+        out_hitches[i] = _hitches[(_numHitches - 1 - i) % MAX_HITCHES];
+    return n;
+}
+
+void FrameTimeStats::reset()
+{
+    ScopedLock lock(_mutex);
+    _next = 0;
+    _count = 0;
+    _max = 0.0;
+    _numHitches = 0;
+    std::fill(_buckets, _buckets + NUM_BUCKETS + 1, 0u);
+}
+
+const char* FrameTimeStats::phaseName(Phase phase)
+{
+    static const char* names[NUM_PHASES] = { "event", "update", "cull", "draw", "gpu" };
+    return phase >= EVENT && phase < NUM_PHASES ? names[phase] : "";
+}
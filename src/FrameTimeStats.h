@@ -0,0 +1,110 @@
+#ifndef FRAMETIMESTATS_H
+#define FRAMETIMESTATS_H
+
+#include <osg/Referenced>
+#include <OpenThreads/Mutex>
+
+/**
+ * Sliding window of frame times with percentiles, and a hitch detector. The window
+ * keeps the last WINDOW frames in a ring and counts them in fixed-width buckets, so
+ * adding a frame moves one sample in and one out and a percentile is a walk over
+ * the buckets; memory and per-frame cost do not depend on how long it runs.
+ *
+ * Frames over the hitch budget are recorded along with the phase that took the
+ * longest in them. The last MAX_HITCHES are kept.
+ *
+ * Frames are added on the main thread; the statistics may be read from any thread,
+ * e.g. by the stats page while drawing.
+ */
+class FrameTimeStats : public osg::Referenced
+{
+public:
+    enum Phase {
+        EVENT = 0,
+        UPDATE,         ///< Includes merging pager results into the scene
+        CULL,
+        DRAW,
+        GPU,
+        NUM_PHASES
+    };
+
+    /** A frame over the budget */
+    struct Hitch {
+        unsigned frame;
+        double duration;            ///< Frame time (s)
+        Phase phase;                ///< Longest phase of the frame
+        double phaseTime;           ///< Time taken by that phase (s)
+    };
+
+    /** Frames in the sliding window */
+    static const unsigned WINDOW = 1024;
+
+    /** Histogram buckets of BUCKET_WIDTH; longer frames share an overflow bucket */
+    static const unsigned NUM_BUCKETS = 400;
+    static const double BUCKET_WIDTH;
+
+    /** Hitches remembered */
+    static const unsigned MAX_HITCHES = 16;
+
+    FrameTimeStats();
+
+    /** Frames longer than this are hitches (seconds, default 1/30); 0 disables detection */
+    void setHitchBudget(double seconds);
+    double getHitchBudget() const;
+
+    /**
+     * Adds a finished frame.
+     * @param frame Frame number
+     * @param duration Frame time (s)
+     * @param phases Time taken by each phase of the frame (s), 0 if unknown
+     * @return true if the frame was a hitch
+     */
+    bool addFrame(unsigned frame, double duration, const double phases[NUM_PHASES]);
+
+    /** Frame time (s) at or below which the fraction p of the window falls, to bucket precision */
+    double percentile(double p) const;
+
+    /** Longest frame time (s) in the window */
+    double maximum() const;
+
+    /** Frames in the window */
+    unsigned getNumFrames() const;
+
+    /**
+     * Copies the bucket counts, merging them down to the given number of bins.
+     * @return frames counted in the largest bin
+     */
+    unsigned getHistogram(unsigned* out_bins, unsigned numBins) const;
+
+    /** Hitches seen since the last reset */
+    unsigned getNumHitches() const;
+
+    /** Copies up to maxHitches of the most recent hitches, newest first; returns the count */
+    unsigned getHitches(Hitch* out_hitches, unsigned maxHitches) const;
+
+    /** Forgets all frames and hitches */
+    void reset();
+
+    /** Short name of a phase, e.g. for the stats page */
+    static const char* phaseName(Phase phase);
+
+protected:
+    virtual ~FrameTimeStats() { }
+
+private:
+    static unsigned bucketOf(double duration);
+
+    mutable OpenThreads::Mutex _mutex;
+    double _hitchBudget;
+
+    double _samples[WINDOW];
+    unsigned _next;
+    unsigned _count;
+    unsigned _buckets[NUM_BUCKETS + 1];
+    double _max;
+
+    Hitch _hitches[MAX_HITCHES];
+    unsigned _numHitches;
+};
+
+#endif
@@ -0,0 +1,279 @@
+#include "OverviewImage.h"
+
+#include <osgDB/FileNameUtils>
+#include <osgDB/FileUtils>
+#include <osgDB/ImageProcessor>
+#include <osgDB/ReadFile>
+#include <osgDB/Registry>
+#include <osgDB/WriteFile>
+#include <osgEarth/ImageUtils>
+#include <osgEarth/Notify>
+#include <osgEarth/StringUtils>
+#include <OpenThreads/ScopedLock>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#define LC "[OverviewImageLoader] "
+
+namespace {
+
+unsigned nextPowerOfTwo(unsigned v)
+{
+    unsigned p = 1;
+    while (p < v)
+        p <<= 1;
+    return p;
+}
+
+// Averages the source pixels covered by each destination pixel. Both images
+// hold tightly packed 8 bit channels.
+void boxFilter(const unsigned char* src, unsigned ss, unsigned st, unsigned srcRow,
+    unsigned char* dst, unsigned ds, unsigned dt, unsigned channels)
+{
+    std::vector<unsigned> sum(channels);
+    for (unsigned y = 0; y < dt; ++y) {
+        unsigned y0 = y * st / dt;
+        unsigned y1 = osg::maximum(y0 + 1, (y + 1) * st / dt);
+        for (unsigned x = 0; x < ds; ++x) {
+            unsigned x0 = x * ss / ds;
+            unsigned x1 = osg::maximum(x0 + 1, (x + 1) * ss / ds);
+            std::fill(sum.begin(), sum.end(), 0u);
+            for (unsigned sy = y0; sy < y1; ++sy) {
+                const unsigned char* row = src + sy * srcRow;
+                for (unsigned sx = x0; sx < x1; ++sx) {
+                    for (unsigned c = 0; c < channels; ++c)
+                        sum[c] += row[sx * channels + c];
+                }
+            }
+            unsigned count = (x1 - x0) * (y1 - y0);
+            unsigned char* out = dst + (y * ds + x) * channels;
+            for (unsigned c = 0; c < channels; ++c)
+                out[c] = static_cast<unsigned char>((sum[c] + count / 2) / count);
+        }
+    }
+}
+
+// Resamples an equirectangular image into the projector's layout at the
+// same size. Off-map pixels become transparent black.
+struct ReprojectJob {
+    const unsigned char* src;
+    unsigned char* dst;
+    unsigned s, t, channels;
+    bool topDown;
+    const OverviewProjector* projector;
+};
+
+void reprojectRow(const ReprojectJob& job, unsigned y)
+{
+    const unsigned s = job.s, t = job.t, channels = job.channels;
+    float su = job.projector->getWidth() / s;
+    float sv = job.projector->getHeight() / t;
+    // Image rows may run top down; control pixels run bottom up
+    float v = ((job.topDown ? t - 1 - y : y) + 0.5f) * sv;
+    unsigned char* out = job.dst + y * s * channels;
+
+    for (unsigned x = 0; x < s; ++x, out += channels) {
+        float lon, lat;
+        if (!job.projector->unproject((x + 0.5f) * su, v, lon, lat)) {
+            std::fill(out, out + channels, 0);
+            continue;
+        }
+        // Bilinear sample, wrapping in longitude and clamping in latitude
+        float fx = (lon + 180.0f) / 360.0f * s - 0.5f;
+        float fy = (lat + 90.0f) / 180.0f * t - 0.5f;
+        if (job.topDown)
+            fy = t - 1 - fy;
+        fy = osg::clampBetween(fy, 0.0f, static_cast<float>(t - 1));
+        int x0 = static_cast<int>(floor(fx));
+        int y0 = static_cast<int>(fy);
+        float ax = fx - x0;
+        float ay = fy - y0;
+        unsigned c0 = static_cast<unsigned>((x0 % static_cast<int>(s) + s) % s);
+        unsigned c1 = (c0 + 1) % s;
+        unsigned r0 = static_cast<unsigned>(y0);
+        unsigned r1 = osg::minimum(r0 + 1, t - 1);
+        const unsigned char* p00 = job.src + (r0 * s + c0) * channels;
+        const unsigned char* p01 = job.src + (r0 * s + c1) * channels;
+        const unsigned char* p10 = job.src + (r1 * s + c0) * channels;
+        const unsigned char* p11 = job.src + (r1 * s + c1) * channels;
+        for (unsigned c = 0; c < channels; ++c) {
+            float top = p00[c] + (p01[c] - p00[c]) * ax;
+            float bottom = p10[c] + (p11[c] - p10[c]) * ax;
+            out[c] = static_cast<unsigned char>(top + (bottom - top) * ay + 0.5f);
+        }
+    }
+}
+
+// Takes every n-th row so the costly rows in the middle of azimuthal
+// projections are spread across the workers
+class ReprojectWorker : public OpenThreads::Thread
+{
+public:
+    ReprojectWorker(const ReprojectJob& job, unsigned first, unsigned step)
+        : _job(job), _first(first), _step(step) { }
+
+    virtual void run()
+    {
+        for (unsigned y = _first; y < _job.t; y += _step)
+            reprojectRow(_job, y);
+    }
+
+private:
+    ReprojectJob _job;
+    unsigned _first;
+    unsigned _step;
+};
+
+void reproject(const ReprojectJob& job)
+{
+    unsigned numThreads = osg::clampBetween(static_cast<unsigned>(OpenThreads::GetNumberOfProcessors()), 1u, job.t);
+    std::vector<ReprojectWorker*> workers;
+    for (unsigned i = 1; i < numThreads; ++i) {
+        workers.push_back(new ReprojectWorker(job, i, numThreads));
+        workers.back()->start();
+    }
+    // The calling thread takes its share too
+    for (unsigned y = 0; y < job.t; y += numThreads)
+        reprojectRow(job, y);
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i]->join();
+        delete workers[i];
+    }
+}
+
+}
+
+OverviewImageLoader::OverviewImageLoader(const std::string& filename, unsigned width, unsigned height)
+    : _filename(filename)
+    , _width(width)
+    , _height(height)
+    , _compress(false)
+    , _done(false)
+{
+}
+
+OverviewImageLoader::~OverviewImageLoader()
+{
+    if (isRunning())
+        join();
+}
+
+bool OverviewImageLoader::takeImage(osg::ref_ptr<osg::Image>& out_image)
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    if (!_result.valid())
+        return false;
+    out_image = _result;
+    _result = NULL;
+    return true;
+}
+
+std::string OverviewImageLoader::cacheFileName(const std::string& sourceHash) const
+{
+    std::stringstream name;
+    name << sourceHash << "_" << nextPowerOfTwo(_width) << "x" << nextPowerOfTwo(_height)
+         << (_projector.valid() ? "_" + _projector->getKey() : std::string())
+         << (_compress ? "_dxt" : "") << ".dds";
+    return osgDB::concatPaths(_cacheDir, name.str());
+}
+
+osg::Image* OverviewImageLoader::process(const osg::Image* source, unsigned width, unsigned height, bool compress,
+    const OverviewProjector* projector)
+{
+    if (!source || width == 0 || height == 0)
+        return NULL;
+
+    if (projector && projector->getType() == OverviewProjector::EQUIRECTANGULAR)
+        projector = NULL;
+    // Azimuthal projections leave the corners off the map, which need alpha
+    bool alpha = osgEarth::ImageUtils::hasAlphaChannel(source) || (projector && !projector->isCylindrical());
+    osg::ref_ptr<osg::Image> src = alpha
+        ? osgEarth::ImageUtils::convertToRGBA8(source)
+        : osgEarth::ImageUtils::convertToRGB8(source);
+    if (!src.valid())
+        return NULL;
+    unsigned channels = alpha ? 4 : 3;
+
+    // Never upsample past the source; the result stays a power of two
+    unsigned s = osg::minimum(nextPowerOfTwo(width), nextPowerOfTwo(src->s()));
+    unsigned t = osg::minimum(nextPowerOfTwo(height), nextPowerOfTwo(src->t()));
+
+    // Lay out the whole mipmap chain in one block
+    osg::Image::MipmapDataType offsets;
+    unsigned total = 0;
+    for (unsigned w = s, h = t;; w = osg::maximum(1u, w / 2), h = osg::maximum(1u, h / 2)) {
+        if (total > 0)
+            offsets.push_back(total);
+        total += w * h * channels;
+        if (w == 1 && h == 1)
+            break;
+    }
+
+    osg::ref_ptr<osg::Image> out = new osg::Image();
+    out->setImage(s, t, 1, alpha ? GL_RGBA8 : GL_RGB8, alpha ? GL_RGBA : GL_RGB, GL_UNSIGNED_BYTE,
+        new unsigned char[total], osg::Image::USE_NEW_DELETE, 1);
+    out->setMipmapLevels(offsets);
+    out->setOrigin(src->getOrigin());
+
+    boxFilter(src->data(), src->s(), src->t(), src->getRowStepInBytes(), out->data(), s, t, channels);
+    if (projector) {
+        std::vector<unsigned char> equirect(out->data(), out->data() + s * t * channels);
+        ReprojectJob job = { &equirect[0], out->data(), s, t, channels,
+            out->getOrigin() == osg::Image::TOP_LEFT, projector };
+        reproject(job);
+    }
+    unsigned w = s, h = t;
+    for (unsigned level = 1; level <= offsets.size(); ++level) {
+        unsigned nw = osg::maximum(1u, w / 2);
+        unsigned nh = osg::maximum(1u, h / 2);
+        boxFilter(out->getMipmapData(level - 1), w, h, w * channels, out->getMipmapData(level), nw, nh, channels);
+        w = nw;
+        h = nh;
+    }
+
+    if (compress) {
+        osgDB::ImageProcessor* ip = osgDB::Registry::instance()->getImageProcessorForExtension("fastdxt");
+        if (ip) {
+            ip->compress(*out,
+                alpha ? osg::Texture::USE_S3TC_DXT5_COMPRESSION : osg::Texture::USE_S3TC_DXT1_COMPRESSION,
+                true, true, osgDB::ImageProcessor::USE_CPU, osgDB::ImageProcessor::FASTEST);
+        } else {
+            OE_WARN << LC << "fastdxt image processor not available, overview left uncompressed" << std::endl;
+        }
+    }
+    return out.release();
+}
+
+void OverviewImageLoader::run()
+{
+    osg::ref_ptr<osg::Image> result;
+
+    std::string cacheFile;
+    if (!_cacheDir.empty()) {
+        std::ifstream in(_filename.c_str(), std::ios::binary);
+        if (in) {
+            std::stringstream bytes;
+            bytes << in.rdbuf();
+            cacheFile = cacheFileName(osgEarth::hashToString(bytes.str()));
+            if (osgDB::fileExists(cacheFile))
+                result = osgDB::readImageFile(cacheFile);
+        }
+    }
+
+    if (!result.valid()) {
+        osg::ref_ptr<osg::Image> source = osgDB::readImageFile(_filename);
+        result = process(source.get(), _width, _height, _compress, _projector.get());
+        if (result.valid() && !cacheFile.empty()) {
+            if (!osgDB::makeDirectory(_cacheDir) || !osgDB::writeImageFile(*result, cacheFile))
+                OE_WARN << LC << "Failed to cache overview image to " << cacheFile << std::endl;
+        }
+    }
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+    _result = result;
+    _done = true;
+}
@@ -0,0 +1,67 @@
+#ifndef OVERVIEWIMAGE_H
+#define OVERVIEWIMAGE_H 1
+
+#include "OverviewProjection.h"
+
+#include <osg/Image>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/Thread>
+
+#include <string>
+
+/**
+ * Prepares the overview map background off the frame thread. The source image
+ * is box-filtered down to the smallest power of two that covers the control's
+ * render size, given a full mipmap chain, and optionally DXT compressed by the
+ * fastdxt image processor. An equirectangular source can be reprojected for
+ * the overview's projection, spreading rows over all cores. Results are
+ * cached on disk as DDS, keyed by a hash of the source file and the
+ * projection, so later startups only read the small cached image.
+ */
+class OverviewImageLoader : public osg::Referenced, public OpenThreads::Thread {
+public:
+    OverviewImageLoader(const std::string& filename, unsigned width, unsigned height);
+
+    /** Compress the result to DXT1 (DXT5 for images with alpha). */
+    void setCompress(bool compress) { _compress = compress; }
+    bool getCompress() const { return _compress; }
+
+    /** Directory of the processed image cache; empty disables the cache. */
+    void setCacheDir(const std::string& dir) { _cacheDir = dir; }
+    const std::string& getCacheDir() const { return _cacheDir; }
+
+    /** Reprojects the equirectangular source for this projector; NULL keeps it as is. */
+    void setProjector(const OverviewProjector* projector) { _projector = projector; }
+    const OverviewProjector* getProjector() const { return _projector.get(); }
+
+    /** Hands over the processed image once it is ready; false before that. */
+    bool takeImage(osg::ref_ptr<osg::Image>& out_image);
+
+    /** True once the worker finished, whether or not it produced an image. */
+    bool isDone() const { return _done; }
+
+    /** Downsamples, reprojects and mipmaps; only reprojection uses extra threads. */
+    static osg::Image* process(const osg::Image* source, unsigned width, unsigned height, bool compress,
+        const OverviewProjector* projector = NULL);
+
+    virtual void run();
+
+protected:
+    virtual ~OverviewImageLoader();
+
+private:
+    std::string cacheFileName(const std::string& sourceHash) const;
+
+    std::string _filename;
+    unsigned _width;
+    unsigned _height;
+    bool _compress;
+    std::string _cacheDir;
+    osg::ref_ptr<const OverviewProjector> _projector;
+
+    OpenThreads::Mutex _mutex;
+    osg::ref_ptr<osg::Image> _result;
+    volatile bool _done;
+};
+
+#endif
@@ -0,0 +1,482 @@
+#include "OverviewLive.h"
+
+#include <osg/BlendFunc>
+#include <osg/Geometry>
+#include <osgEarth/ImageLayer>
+#include <osgEarth/MapCallback>
+#include <osgEarth/NodeUtils>
+#include <osgEarth/TileKey>
+#include <OpenThreads/Condition>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+
+#include <deque>
+#include <vector>
+
+namespace {
+
+// Tiles are assumed to be this many pixels wide when picking the LOD
+const unsigned NOMINAL_TILE_SIZE = 256;
+
+struct TileJob {
+    unsigned generation;
+    unsigned order;
+    osg::ref_ptr<osgEarth::ImageLayer> layer;
+    osgEarth::TileKey key;
+};
+
+struct TileResult {
+    unsigned generation;
+    unsigned order;
+    osg::ref_ptr<osgEarth::ImageLayer> layer;
+    osgEarth::TileKey key;
+    osgEarth::GeoExtent extent;
+    osg::ref_ptr<osg::Image> image;
+};
+
+osg::Texture2D* createTexture(osg::Image* image)
+{
+    osg::Texture2D* tex = new osg::Texture2D(image);
+    tex->setResizeNonPowerOfTwoHint(false);
+    tex->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+    tex->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+    tex->setWrap(osg::Texture::WRAP_S, osg::Texture::CLAMP_TO_EDGE);
+    tex->setWrap(osg::Texture::WRAP_T, osg::Texture::CLAMP_TO_EDGE);
+    tex->setUnRefImageDataAfterApply(true);
+    return tex;
+}
+
+// Textured quad covering the extent, in the lon/lat space of the RTT camera
+osg::Geometry* createTile(const osgEarth::GeoExtent& e, osg::Texture2D* tex, bool flip, osg::Vec4Array* color)
+{
+    osg::Geometry* geom = new osg::Geometry();
+    geom->setUseVertexBufferObjects(true);
+    geom->setUseDisplayList(false);
+
+    osg::Vec3Array* verts = new osg::Vec3Array(4);
+    (*verts)[0].set(e.xMin(), e.yMin(), 0);
+    (*verts)[1].set(e.xMax(), e.yMin(), 0);
+    (*verts)[2].set(e.xMax(), e.yMax(), 0);
+    (*verts)[3].set(e.xMin(), e.yMax(), 0);
+    geom->setVertexArray(verts);
+
+    osg::Vec2Array* t = new osg::Vec2Array(4);
+    (*t)[0].set(0, flip ? 1 : 0);
+    (*t)[1].set(1, flip ? 1 : 0);
+    (*t)[2].set(1, flip ? 0 : 1);
+    (*t)[3].set(0, flip ? 0 : 1);
+    geom->setTexCoordArray(0, t);
+
+    geom->setColorArray(color, osg::Array::BIND_OVERALL);
+    geom->addPrimitiveSet(new osg::DrawArrays(GL_QUADS, 0, 4));
+    geom->getOrCreateStateSet()->setTextureAttributeAndModes(0, tex, osg::StateAttribute::ON);
+    return geom;
+}
+
+osg::Vec4 layerColor(const osgEarth::ImageLayer* layer)
+{
+    return osg::Vec4(1, 1, 1, layer->getOpacity());
+}
+
+}
+
+// Reads tiles from the image layers. Starting a new generation drops the
+// queued jobs of the previous one.
+class OverviewLayerRenderer::Worker : public OpenThreads::Thread
+{
+public:
+    Worker() : _done(false) { }
+
+    ~Worker()
+    {
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+            _done = true;
+            _jobs.clear();
+            _cond.signal();
+        }
+        join();
+    }
+
+    void post(const std::vector<TileJob>& jobs)
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        _jobs.assign(jobs.begin(), jobs.end());
+        _cond.signal();
+    }
+
+    bool takeResult(TileResult& out)
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        if (_results.empty())
+            return false;
+        out = _results.front();
+        _results.pop_front();
+        return true;
+    }
+
+    virtual void run()
+    {
+        for (;;) {
+            TileJob job;
+            {
+                OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+                while (_jobs.empty() && !_done)
+                    _cond.wait(&_mutex);
+                if (_done)
+                    return;
+                job = _jobs.front();
+                _jobs.pop_front();
+            }
+
+            TileResult result;
+            result.generation = job.generation;
+            result.order = job.order;
+            result.layer = job.layer;
+            result.key = job.key;
+            osgEarth::GeoImage image = job.layer->createImage(job.key);
+            if (image.valid()) {
+                result.image = image.getImage();
+                result.extent = image.getExtent().transform(osgEarth::SpatialReference::get("wgs84"));
+            }
+
+            // Failed tiles are reported too so the generation can complete
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+            _results.push_back(result);
+        }
+    }
+
+private:
+    OpenThreads::Mutex _mutex;
+    OpenThreads::Condition _cond;
+    std::deque<TileJob> _jobs;
+    std::deque<TileResult> _results;
+    bool _done;
+};
+
+// Flags the renderer when image layers change. Callbacks may come from any
+// thread, so they only set flags that the update traversal acts on.
+class OverviewLayerRenderer::LayerWatcher : public osgEarth::MapCallback
+{
+public:
+    struct Appearance : public osgEarth::VisibleLayerCallback {
+        Appearance(LayerWatcher* watcher) : _watcher(watcher) { }
+        virtual void onVisibleChanged(osgEarth::VisibleLayer*) { _watcher->appearanceChanged(); }
+        virtual void onOpacityChanged(osgEarth::VisibleLayer*) { _watcher->appearanceChanged(); }
+        LayerWatcher* _watcher;
+    };
+
+    LayerWatcher(OverviewLayerRenderer* renderer)
+        : _renderer(renderer)
+    {
+        _appearance = new Appearance(this);
+    }
+
+    void watch(osgEarth::ImageLayer* layer) { layer->addCallback(_appearance.get()); }
+    void unwatch(osgEarth::ImageLayer* layer) { layer->removeCallback(_appearance.get()); }
+
+    void appearanceChanged()
+    {
+        osg::ref_ptr<OverviewLayerRenderer> renderer;
+        if (_renderer.lock(renderer))
+            renderer->redraw();
+    }
+
+    virtual void onImageLayerAdded(osgEarth::ImageLayer* layer, unsigned int)
+    {
+        watch(layer);
+        layersChanged();
+    }
+
+    virtual void onImageLayerRemoved(osgEarth::ImageLayer* layer, unsigned int)
+    {
+        unwatch(layer);
+        layersChanged();
+    }
+
+    virtual void onImageLayerMoved(osgEarth::ImageLayer*, unsigned int, unsigned int) { layersChanged(); }
+
+private:
+    void layersChanged()
+    {
+        osg::ref_ptr<OverviewLayerRenderer> renderer;
+        if (_renderer.lock(renderer))
+            renderer->refresh();
+    }
+
+    osg::observer_ptr<OverviewLayerRenderer> _renderer;
+    osg::ref_ptr<Appearance> _appearance;
+};
+
+OverviewLayerRenderer::OverviewLayerRenderer(osgEarth::MapNode* mapNode, unsigned width, unsigned height, unsigned lod)
+    : _mapNode(mapNode)
+    , _worker(new Worker())
+    , _lod(lod)
+    , _refreshInterval(0.0)
+    , _lastRefresh(0.0)
+    , _maxTilesPerFrame(2)
+    , _layersDirty(true)
+    , _appearanceDirty(false)
+    , _windowDirty(false)
+    , _renderPending(false)
+    , _window(-180.0, -90.0, 180.0, 90.0)
+    , _buildingWindow(_window)
+    , _shownWindow(_window)
+    , _maxLod(10)
+    , _tileCacheSize(128)
+    , _tileCacheHits(0)
+    , _tileCacheMisses(0)
+    , _generation(0)
+    , _expected(0)
+    , _received(0)
+{
+    _texture = new osg::Texture2D();
+    _texture->setTextureSize(width, height);
+    _texture->setInternalFormat(GL_RGBA);
+    _texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+    _texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+
+    _camera = new osg::Camera();
+    _camera->setReferenceFrame(osg::Transform::ABSOLUTE_RF);
+    _camera->setRenderOrder(osg::Camera::PRE_RENDER);
+    _camera->setRenderTargetImplementation(osg::Camera::FRAME_BUFFER_OBJECT);
+    _camera->setComputeNearFarMode(osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR);
+    _camera->setViewport(0, 0, width, height);
+    _camera->setProjectionMatrixAsOrtho2D(-180.0, 180.0, -90.0, 90.0);
+    _camera->setViewMatrix(osg::Matrixd::identity());
+    _camera->setClearColor(osg::Vec4(0, 0, 0, 1));
+    _camera->setClearMask(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    _camera->attach(osg::Camera::COLOR_BUFFER, _texture.get());
+
+    osg::StateSet* ss = _camera->getOrCreateStateSet();
+    ss->setMode(GL_DEPTH_TEST, osg::StateAttribute::OFF | osg::StateAttribute::PROTECTED);
+    ss->setMode(GL_CULL_FACE, osg::StateAttribute::OFF | osg::StateAttribute::PROTECTED);
+    ss->setMode(GL_BLEND, osg::StateAttribute::ON);
+    ss->setAttributeAndModes(new osg::BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA));
+    addChild(_camera.get());
+
+    _worker->start();
+
+    if (mapNode) {
+        _watcher = new LayerWatcher(this);
+        osgEarth::ImageLayerVector layers;
+        mapNode->getMap()->getLayers(layers);
+        for (osgEarth::ImageLayerVector::const_iterator i = layers.begin(); i != layers.end(); ++i)
+            _watcher->watch(i->get());
+        mapNode->getMap()->addMapCallback(_watcher.get());
+    }
+
+    ADJUST_UPDATE_TRAV_COUNT(this, 1);
+}
+
+OverviewLayerRenderer::~OverviewLayerRenderer()
+{
+    osg::ref_ptr<osgEarth::MapNode> mapNode;
+    if (_watcher.valid() && _mapNode.lock(mapNode)) {
+        osgEarth::ImageLayerVector layers;
+        mapNode->getMap()->getLayers(layers);
+        for (osgEarth::ImageLayerVector::const_iterator i = layers.begin(); i != layers.end(); ++i)
+            _watcher->unwatch(i->get());
+        mapNode->getMap()->removeMapCallback(_watcher.get());
+    }
+    delete _worker;
+}
+
+void OverviewLayerRenderer::setWindow(const osg::Vec4d& window)
+{
+    if (window != _window) {
+        _window = window;
+        _windowDirty = true;
+    }
+}
+
+void OverviewLayerRenderer::setTileCacheSize(unsigned tiles)
+{
+    _tileCacheSize = tiles;
+    while (_tiles.size() > _tileCacheSize) {
+        _tileIndex.erase(_tiles.back().first);
+        _tiles.pop_back();
+    }
+}
+
+const OverviewLayerRenderer::CachedTile* OverviewLayerRenderer::findTile(const TileId& id)
+{
+    TileIndex::iterator i = _tileIndex.find(id);
+    if (i == _tileIndex.end()) {
+        ++_tileCacheMisses;
+        return NULL;
+    }
+    ++_tileCacheHits;
+    _tiles.splice(_tiles.begin(), _tiles, i->second);
+    return &i->second->second;
+}
+
+void OverviewLayerRenderer::cacheTile(const TileId& id, const CachedTile& tile)
+{
+    if (_tileCacheSize == 0)
+        return;
+    TileIndex::iterator i = _tileIndex.find(id);
+    if (i != _tileIndex.end()) {
+        i->second->second = tile;
+        _tiles.splice(_tiles.begin(), _tiles, i->second);
+        return;
+    }
+    _tiles.push_front(std::make_pair(id, tile));
+    _tileIndex[id] = _tiles.begin();
+    if (_tiles.size() > _tileCacheSize) {
+        _tileIndex.erase(_tiles.back().first);
+        _tiles.pop_back();
+    }
+}
+
+unsigned OverviewLayerRenderer::computeLod(const osgEarth::Profile* profile) const
+{
+    // Finest LOD whose tiles are no sharper than the texture needs
+    double degreesPerPixel = (_window.z() - _window.x()) / _texture->getTextureWidth();
+    double worldWidth = profile->getLatLongExtent().width();
+    unsigned lod = _lod;
+    for (; lod < _maxLod; ++lod) {
+        unsigned tilesWide, tilesHigh;
+        profile->getNumTiles(lod, tilesWide, tilesHigh);
+        if (worldWidth / tilesWide / NOMINAL_TILE_SIZE <= degreesPerPixel)
+            break;
+    }
+    return lod;
+}
+
+void OverviewLayerRenderer::startGeneration(double time)
+{
+    // Layer changes and periodic refreshes need fresh tiles; a new window
+    // alone can reuse cached ones
+    bool windowOnly = _windowDirty && !_layersDirty;
+    if (!windowOnly) {
+        _tiles.clear();
+        _tileIndex.clear();
+    }
+    _layersDirty = false;
+    _windowDirty = false;
+    _lastRefresh = time;
+    ++_generation;
+    _received = 0;
+    _building = new osg::Group();
+    _built.clear();
+
+    osg::ref_ptr<osgEarth::MapNode> mapNode;
+    if (!_mapNode.lock(mapNode))
+        return;
+
+    const osgEarth::Profile* profile = mapNode->getMap()->getProfile();
+    osgEarth::ImageLayerVector layers;
+    mapNode->getMap()->getLayers(layers);
+
+    _buildingWindow = _window;
+    unsigned lod = computeLod(profile);
+    std::vector<osgEarth::TileKey> keys;
+    profile->getIntersectingTiles(
+        osgEarth::GeoExtent(osgEarth::SpatialReference::get("wgs84"), _window.x(), _window.y(), _window.z(), _window.w()),
+        lod, keys);
+
+    std::vector<TileJob> jobs;
+    for (unsigned order = 0; order < layers.size(); ++order) {
+        osgEarth::ImageLayer* layer = layers[order].get();
+        LayerState& state = _built[layer];
+        state.layer = layer;
+        state.group = new osg::Group();
+        state.group->getOrCreateStateSet()->setRenderBinDetails(order, "RenderBin");
+        state.group->setNodeMask(layer->getVisible() ? ~0 : 0);
+        state.color = new osg::Vec4Array(1);
+        (*state.color)[0] = layerColor(layer);
+        _building->addChild(state.group.get());
+
+        for (unsigned k = 0; k < keys.size(); ++k) {
+            const CachedTile* cached = findTile(TileId(layer->getUID(), keys[k]));
+            if (cached) {
+                state.group->addChild(createTile(cached->extent, cached->texture.get(), cached->flip, state.color.get()));
+                continue;
+            }
+            TileJob job;
+            job.generation = _generation;
+            job.order = order;
+            job.layer = layer;
+            job.key = keys[k];
+            jobs.push_back(job);
+        }
+    }
+    _expected = jobs.size();
+    _worker->post(jobs);
+
+    // Nothing to fetch; show the picture right away
+    if (_expected == 0)
+        mergeTiles();
+}
+
+void OverviewLayerRenderer::mergeTiles()
+{
+    TileResult tile;
+    for (unsigned n = 0; n < _maxTilesPerFrame && _worker->takeResult(tile);) {
+        // Tiles of superseded generations still go into the cache
+        CachedTile cached;
+        if (tile.image.valid()) {
+            cached.extent = tile.extent;
+            cached.texture = createTexture(tile.image.get());
+            cached.flip = tile.image->getOrigin() == osg::Image::TOP_LEFT;
+            cacheTile(TileId(tile.layer->getUID(), tile.key), cached);
+        }
+        if (tile.generation != _generation)
+            continue;
+        ++_received;
+        ++n;
+        LayerStates::iterator i = _built.find(tile.layer.get());
+        if (cached.texture.valid() && i != _built.end())
+            i->second.group->addChild(createTile(cached.extent, cached.texture.get(), cached.flip, i->second.color.get()));
+    }
+
+    // Swap in the finished picture in one step
+    if (_building.valid() && _received >= _expected) {
+        _camera->setProjectionMatrixAsOrtho2D(_buildingWindow.x(), _buildingWindow.z(), _buildingWindow.y(), _buildingWindow.w());
+        _shownWindow = _buildingWindow;
+        _camera->removeChildren(0, _camera->getNumChildren());
+        _camera->addChild(_building.get());
+        _building = NULL;
+        _shown.swap(_built);
+        _built.clear();
+        _renderPending = true;
+    }
+}
+
+void OverviewLayerRenderer::updateAppearance()
+{
+    _appearanceDirty = false;
+    for (LayerStates::iterator i = _shown.begin(); i != _shown.end(); ++i) {
+        osg::ref_ptr<osgEarth::ImageLayer> layer;
+        if (!i->second.layer.lock(layer))
+            continue;
+        (*i->second.color)[0] = layerColor(layer.get());
+        i->second.color->dirty();
+        i->second.group->setNodeMask(layer->getVisible() ? ~0 : 0);
+    }
+    _renderPending = true;
+}
+
+void OverviewLayerRenderer::traverse(osg::NodeVisitor& nv)
+{
+    if (nv.getVisitorType() == osg::NodeVisitor::UPDATE_VISITOR) {
+        double time = nv.getFrameStamp() ? nv.getFrameStamp()->getReferenceTime() : 0.0;
+        if (_layersDirty || _windowDirty || (_refreshInterval > 0.0 && time - _lastRefresh >= _refreshInterval))
+            startGeneration(time);
+        if (_building.valid())
+            mergeTiles();
+        if (_appearanceDirty)
+            updateAppearance();
+        osg::Group::traverse(nv);
+    } else if (nv.getVisitorType() == osg::NodeVisitor::CULL_VISITOR) {
+        // The texture keeps its contents; only render on frames where it changed
+        if (_renderPending) {
+            _renderPending = false;
+            osg::Group::traverse(nv);
+        }
+    } else {
+        osg::Group::traverse(nv);
+    }
+}
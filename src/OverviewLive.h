@@ -0,0 +1,145 @@
+#ifndef OVERVIEWLIVE_H
+#define OVERVIEWLIVE_H 1
+
+#include <osg/Camera>
+#include <osg/Group>
+#include <osg/Texture2D>
+#include <osg/observer_ptr>
+#include <osgEarth/MapNode>
+#include <osgEarth/TileKey>
+
+#include <list>
+#include <map>
+
+/**
+ * Renders the map's image layers into a small equirectangular texture for the
+ * overview map, using a render-to-texture camera that only runs on frames
+ * where the picture changed. Tiles are read from the layers at a low LOD on a
+ * worker thread and merged into the RTT scene a few per frame; the finished
+ * set replaces the previous one at once, so a half-built picture is never
+ * rendered. Layers being added, removed or moved trigger a new set of tiles;
+ * opacity and visibility changes only re-render. An optional refresh interval
+ * re-reads the tiles for layers whose content changes over time.
+ *
+ * The renderer can show a window of the world instead of all of it; tiles
+ * then come from the LOD whose resolution matches the texture. Tile textures
+ * are kept in an in-memory LRU cache, so zooming back out or panning over
+ * seen ground needs no new reads.
+ */
+class OverviewLayerRenderer : public osg::Group
+{
+public:
+    OverviewLayerRenderer(osgEarth::MapNode* mapNode, unsigned width = 512, unsigned height = 256, unsigned lod = 1);
+
+    /** Texture the layers are rendered into. */
+    osg::Texture2D* getTexture() const { return _texture.get(); }
+
+    /** Seconds between periodic tile refreshes; 0 (default) refreshes only on layer changes. */
+    void setRefreshInterval(double seconds) { _refreshInterval = seconds; }
+    double getRefreshInterval() const { return _refreshInterval; }
+
+    /** Maximum number of finished tiles merged into the RTT scene per frame. */
+    void setMaxTilesPerFrame(unsigned value) { _maxTilesPerFrame = value > 0 ? value : 1; }
+    unsigned getMaxTilesPerFrame() const { return _maxTilesPerFrame; }
+
+    /** Re-reads every tile, bypassing the tile cache. */
+    void refresh() { _layersDirty = true; }
+
+    /**
+     * Sets the geographic window (west, south, east, north degrees) to render.
+     * The texture keeps showing the previous window until all tiles of the new
+     * one are available; see getShownWindow().
+     */
+    void setWindow(const osg::Vec4d& window);
+    const osg::Vec4d& getWindow() const { return _window; }
+
+    /** Window of the picture currently in the texture. */
+    const osg::Vec4d& getShownWindow() const { return _shownWindow; }
+
+    /** Highest LOD read when zoomed in (default 10). */
+    void setMaxLod(unsigned lod) { _maxLod = lod; }
+    unsigned getMaxLod() const { return _maxLod; }
+
+    /** Number of tile textures kept in the LRU cache (default 128). */
+    void setTileCacheSize(unsigned tiles);
+    unsigned getTileCacheSize() const { return _tileCacheSize; }
+
+    /** Tile cache lookups answered from and missing the cache since creation. */
+    unsigned getTileCacheHits() const { return _tileCacheHits; }
+    unsigned getTileCacheMisses() const { return _tileCacheMisses; }
+
+    /** Re-renders the current tiles, e.g. after an opacity change. */
+    void redraw() { _appearanceDirty = true; }
+
+public: // osg::Node
+    virtual void traverse(osg::NodeVisitor& nv);
+
+protected:
+    virtual ~OverviewLayerRenderer();
+
+private:
+    class Worker;
+    class LayerWatcher;
+
+    void startGeneration(double time);
+    void mergeTiles();
+    void updateAppearance();
+    unsigned computeLod(const osgEarth::Profile* profile) const;
+
+    // Tile textures by layer and key, most recently used first
+    struct CachedTile {
+        osgEarth::GeoExtent extent;
+        osg::ref_ptr<osg::Texture2D> texture;
+        bool flip;
+    };
+    typedef std::pair<osgEarth::UID, osgEarth::TileKey> TileId;
+    typedef std::list<std::pair<TileId, CachedTile> > TileList;
+    typedef std::map<TileId, TileList::iterator> TileIndex;
+
+    const CachedTile* findTile(const TileId& id);
+    void cacheTile(const TileId& id, const CachedTile& tile);
+
+    osg::observer_ptr<osgEarth::MapNode> _mapNode;
+    osg::ref_ptr<osg::Camera> _camera;
+    osg::ref_ptr<osg::Texture2D> _texture;
+    osg::ref_ptr<osg::Group> _building;
+    Worker* _worker;
+    osg::ref_ptr<LayerWatcher> _watcher;
+    unsigned _lod;
+
+    double _refreshInterval;
+    double _lastRefresh;
+    unsigned _maxTilesPerFrame;
+
+    volatile bool _layersDirty;
+    volatile bool _appearanceDirty;
+    bool _windowDirty;
+    bool _renderPending;
+
+    osg::Vec4d _window;
+    osg::Vec4d _buildingWindow;
+    osg::Vec4d _shownWindow;
+    unsigned _maxLod;
+
+    TileList _tiles;
+    TileIndex _tileIndex;
+    unsigned _tileCacheSize;
+    unsigned _tileCacheHits;
+    unsigned _tileCacheMisses;
+
+    unsigned _generation;
+    unsigned _expected;
+    unsigned _received;
+
+    // Per-layer state of the tiles being shown or built
+    struct LayerState {
+        osg::observer_ptr<osgEarth::ImageLayer> layer;
+        osg::ref_ptr<osg::Group> group;
+        osg::ref_ptr<osg::Vec4Array> color;
+    };
+    typedef std::map<const osgEarth::ImageLayer*, LayerState> LayerStates;
+    LayerStates _shown;
+    LayerStates _built;
+};
+
+#endif
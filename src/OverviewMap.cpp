@@ -1,18 +1,32 @@
 ﻿
 
 #include "OverviewMap.h"
+#include "ScreenQuery.h"
+#include "OverviewImage.h"
+#include "OverviewLive.h"
+#include "EllipsoidMath.h"
+#include "StatsHandler.h"
+#include "WidgetMetrics.h"
 #include <osg/LineWidth>
-#include <osg/Point>
+#include <cfloat>
 #include <osgEarthSymbology/Color>
 
 namespace {
 
-void convertXY2LatLon(float w, float h, float x, float y, float& lat, float& lon)
+// Rays traced per frustum edge for the camera footprint
+const unsigned FOOTPRINT_EDGE_SAMPLES = 8;
+
+// Deepest overview zoom; a 200 pixel wide control then spans about 0.09 degrees
+const float MAX_ZOOM = 4096.0f;
+
+WIDGET_METRIC_COUNTER(s_intersections, "OverviewMap", "intersections");
+WIDGET_METRIC_COUNTER(s_geometryRebuilds, "OverviewMap", "geometry rebuilds");
+
+// Viewport of a camera as (x, y, width, height), zero if it has none
+osg::Vec4d getViewport(const osg::Camera* camera)
 {
-    float u = (x + 0.5) / w;
-    float v = (y + 0.5) / h;
-    lat = (u - 0.5) * (2 * osg::PI);
-    lon = (0.5 - v) * osg::PI;
+    const osg::Viewport* vp = camera->getViewport();
+    return vp ? osg::Vec4d(vp->x(), vp->y(), vp->width(), vp->height()) : osg::Vec4d();
 }
 
 bool worldToScreen(osgViewer::View* viewer, const osg::Vec3d& world, osg::Vec3d *screen, bool invertY)
@@ -107,18 +121,123 @@ osg::Geometry* newGeometry()
     geom->setDataVariance(osg::Object::DYNAMIC);
     return geom;
 }
+
+// Polls the image loader during the update traversal and removes itself
+// once the image has been handed to the control.
+class ImageLoaderCallback : public osg::NodeCallback
+{
+public:
+    ImageLoaderCallback(OverviewImageLoader* loader) : _loader(loader) { }
+
+    virtual void operator()(osg::Node* node, osg::NodeVisitor* nv)
+    {
+        osg::ref_ptr<osg::Image> image;
+        bool done = _loader->isDone();
+        if (_loader->takeImage(image))
+            static_cast<OverviewMapControl*>(node)->setImage(image.get());
+        if (done) {
+            // Hold a ref since removing the callback releases this object
+            osg::ref_ptr<osg::NodeCallback> self = this;
+            node->removeUpdateCallback(this);
+        }
+        traverse(node, nv);
+    }
+
+private:
+    osg::ref_ptr<OverviewImageLoader> _loader;
+};
+
+// Lets the control pick up projector changes that happen outside draw(), such
+// as a live renderer finishing the tiles of a new zoom window.
+class ProjectorCallback : public osg::NodeCallback
+{
+public:
+    virtual void operator()(osg::Node* node, osg::NodeVisitor* nv)
+    {
+        static_cast<OverviewMapControl*>(node)->updateProjector();
+        traverse(node, nv);
+    }
+};
 }
 
 OverviewMapControl::OverviewMapControl( osg::Image* image)
     : _rotation(0.0, Units::RADIANS)
     , _fixSizeForRot(false)
     , _opacity(1.0f)
+    , _projectionType(OverviewProjector::EQUIRECTANGULAR)
+    , _zoom(1.0f)
 {
     setImage(image);
+    addUpdateCallback(new ProjectorCallback());
     //setAlign(Control::ALIGN_LEFT, Control::ALIGN_BOTTOM);
     setAlign(Control::ALIGN_LEFT, Control::ALIGN_BOTTOM);
 }
 
+void OverviewMapControl::setProjection(OverviewProjector::Type type, float centerLon, float centerLat)
+{
+    if (type == _projectionType && _projectionCenter == osg::Vec2f(centerLon, centerLat))
+        return;
+    _projectionType = type;
+    _projectionCenter.set(centerLon, centerLat);
+    _projector = NULL;
+    updateLiveWindow();
+    dirty();
+}
+
+void OverviewMapControl::setZoom(float zoom, float centerLon, float centerLat)
+{
+    if (_projectionType != OverviewProjector::EQUIRECTANGULAR)
+        return;
+    zoom = osg::clampBetween(zoom, 1.0f, MAX_ZOOM);
+    OverviewProjector::computeWindow(zoom, centerLon, centerLat);
+    if (zoom == _zoom && _projectionCenter == osg::Vec2f(centerLon, centerLat))
+        return;
+    _zoom = zoom;
+    _projectionCenter.set(centerLon, centerLat);
+    updateLiveWindow();
+    dirty();
+}
+
+void OverviewMapControl::updateLiveWindow()
+{
+    float centerLon = _projectionCenter.x();
+    float centerLat = _projectionCenter.y();
+    float zoom = _projectionType == OverviewProjector::EQUIRECTANGULAR ? _zoom : 1.0f;
+    if (_liveRenderer.valid())
+        _liveRenderer->setWindow(OverviewProjector::computeWindow(zoom, centerLon, centerLat));
+}
+
+const OverviewProjector* OverviewMapControl::getProjector()
+{
+    float w = width().get();
+    float h = height().get();
+    float zoom = _zoom;
+    osg::Vec2f center = _projectionCenter;
+    if (_projectionType == OverviewProjector::EQUIRECTANGULAR) {
+        if (_liveRenderer.valid()) {
+            // Follow the window actually in the texture, which lags a zoom
+            // until its tiles are ready
+            const osg::Vec4d& shown = _liveRenderer->getShownWindow();
+            zoom = 360.0 / (shown.z() - shown.x());
+            center.set((shown.x() + shown.z()) / 2.0, (shown.y() + shown.w()) / 2.0);
+        }
+        OverviewProjector::computeWindow(zoom, center.x(), center.y());
+    } else {
+        zoom = 1.0f;
+    }
+    if (!_projector.valid() || _projector->getWidth() != w || _projector->getHeight() != h
+        || _projector->getZoom() != zoom || _projector->getCenterLon() != center.x() || _projector->getCenterLat() != center.y()) {
+        _projector = new OverviewProjector(_projectionType, w, h, center.x(), center.y(), 45.0f, zoom);
+    }
+    return _projector.get();
+}
+
+void OverviewMapControl::updateProjector()
+{
+    if (_drawnProjector.valid() && getProjector() != _drawnProjector.get())
+        dirty();
+}
+
 osg::Geometry* OverviewMapControl::getOrCreateCross()
 {
     if (!_cross.valid()) {
@@ -139,56 +258,88 @@ osg::Geometry* OverviewMapControl::getOrCreateCross()
     return _cross.get();
 }
 
-osg::Vec3 OverviewMapControl::convertXYZ2UV(const osg::Vec3& v3)
+osg::Geometry* OverviewMapControl::getOrCreateFootprint()
 {
-    double w = width().get();
-    double h = height().get();
-    double x = (v3.x() + 180.0) * w / 360.0;
-    double y = (v3.y() + 90.0) * h / 180.0;
-    return osg::Vec3(x, y, 0.0);
+    if (!_footprint.valid()) {
+        _footprint = newGeometry();
+        _footprint->setVertexArray(new osg::Vec3Array);
+        osg::ref_ptr<osg::Vec4Array> color = new osg::Vec4Array;
+        color->push_back(osg::Vec4(1, 0.85, 0, 1));
+        _footprint->setColorArray(color, osg::Array::BIND_OVERALL);
+        _footprint->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::LINES, 0, 0));
+        _footprint->getOrCreateStateSet()->setAttribute(
+            new osg::LineWidth(1.0), osg::StateAttribute::ON);
+    }
+    return _footprint.get();
 }
 
-
-osg::Geometry* createPoints(const osg::Vec4& color)
+void OverviewMapControl::setFootprint(const osg::Vec2d* lonLat, unsigned count)
 {
-    osg::Geometry* pts = new osg::Geometry;
-    pts->setUseVertexBufferObjects(true);
-    osg::ref_ptr<osg::Vec3dArray> ptVt = new osg::Vec3dArray;
-    pts->setVertexArray(ptVt);
-    pts->addPrimitiveSet(new osg::DrawArrays(GL_POINTS, 0, ptVt->size()));
-
-    // bind color
-    osg::ref_ptr<osg::Vec4Array> colorArry = new osg::Vec4Array;
-    colorArry->push_back(color);
-    pts->setColorArray(colorArry, osg::Array::BIND_OVERALL);
-    // bind point state set
-    osg::StateSet* stateset = new osg::StateSet;
-    osg::Point* point = new osg::Point;
-    // set point size
-    point->setSize(5.0f);
-    stateset->setAttribute(point);
+    WIDGET_METRIC_ADD(s_geometryRebuilds, 1);
+    osg::Geometry* geom = getOrCreateFootprint();
+    osg::Vec3Array* verts = static_cast<osg::Vec3Array*>(geom->getVertexArray());
+    if (verts->size() != count * 2) {
+        verts->resize(count * 2);
+        static_cast<osg::DrawArrays*>(geom->getPrimitiveSet(0))->setCount(count * 2);
+    }
 
-    pts->setStateSet(stateset);
+    const OverviewProjector* projector = getProjector();
+    for (unsigned i = 0; i < count; ++i) {
+        const osg::Vec2d& a = lonLat[i];
+        const osg::Vec2d& b = lonLat[(i + 1) % count];
+        osg::Vec2f pa, pb;
+        bool shown = projector->project(a.x(), a.y(), pa);
+        shown = projector->project(b.x(), b.y(), pb) && shown;
+        // Collapse segments that are partly hidden or wrap around the antimeridian
+        if (!shown || (projector->isCylindrical() && fabs(a.x() - b.x()) > 180.0))
+            pb = pa;
+        (*verts)[i * 2].set(pa.x(), pa.y(), 0.0f);
+        (*verts)[i * 2 + 1].set(pb.x(), pb.y(), 0.0f);
+    }
+    verts->dirty();
+    geom->dirtyBound();
+}
 
-    return pts;
+osg::Vec3 OverviewMapControl::convertXYZ2UV(const osg::Vec3& v3)
+{
+    osg::Vec2f uv;
+    getProjector()->project(v3.x(), v3.y(), uv);
+    return osg::Vec3(uv.x(), uv.y(), 0.0);
 }
 
-osg::Geometry* OverviewMapControl::getOrCreateRedPoints()
+
+EntityPointLayer* OverviewMapControl::getOrCreateRedPoints()
 {
      if (!_redPts.valid()) {
-        _redPts = createPoints(osgEarth::Symbology::Color(0xFF0000FF, osgEarth::Symbology::Color::RGBA));
+        _redPts = new EntityPointLayer(osgEarth::Symbology::Color(0xFF0000FF, osgEarth::Symbology::Color::RGBA));
      }
      return _redPts.get();
 }
 
-osg::Geometry *OverviewMapControl::getOrCreateBluePoints()
+EntityPointLayer* OverviewMapControl::getOrCreateBluePoints()
 {
     if (!_bluePts.valid()) {
-       _bluePts = createPoints(osgEarth::Symbology::Color(0x1C86EFFF, osgEarth::Symbology::Color::RGBA));
+       _bluePts = new EntityPointLayer(osgEarth::Symbology::Color(0x1C86EFFF, osgEarth::Symbology::Color::RGBA));
     }
     return _bluePts.get();
 }
 
+EntityTrailLayer* OverviewMapControl::getOrCreateRedTrails()
+{
+    if (!_redTrails.valid()) {
+        _redTrails = new EntityTrailLayer(osgEarth::Symbology::Color(0xFF000099, osgEarth::Symbology::Color::RGBA));
+    }
+    return _redTrails.get();
+}
+
+EntityTrailLayer* OverviewMapControl::getOrCreateBlueTrails()
+{
+    if (!_blueTrails.valid()) {
+        _blueTrails = new EntityTrailLayer(osgEarth::Symbology::Color(0x1C86EF99, osgEarth::Symbology::Color::RGBA));
+    }
+    return _blueTrails.get();
+}
+
 void OverviewMapControl::setVisible(bool value) {
     Control::setVisible(value);
     if (_xform.valid()) {
@@ -204,6 +355,31 @@ void OverviewMapControl::setImage(osg::Image* image)
     }
 }
 
+void OverviewMapControl::setImageLoader(OverviewImageLoader* loader)
+{
+    if (loader == _loader.get())
+        return;
+    _loader = loader;
+    if (_loader.valid()) {
+        if (!_loader->isRunning() && !_loader->isDone())
+            _loader->start();
+        addUpdateCallback(new ImageLoaderCallback(_loader.get()));
+    }
+}
+
+void OverviewMapControl::setLiveRenderer(OverviewLayerRenderer* renderer)
+{
+    if (renderer == _liveRenderer.get())
+        return;
+    if (_liveRenderer.valid())
+        removeChild(_liveRenderer.get());
+    _liveRenderer = renderer;
+    if (_liveRenderer.valid())
+        addChild(_liveRenderer.get());
+    updateLiveWindow();
+    dirty();
+}
+
 void OverviewMapControl::setRotation(const Angular& angle)
 {
     if (angle != _rotation) {
@@ -257,35 +433,93 @@ void OverviewMapControl::calcSize(const ControlContext& cx, osg::Vec2f& out_size
     }
 }
 
-#undef IMAGECONTROL_TEXRECT
-
 void OverviewMapControl::draw(const ControlContext& cx)
 {
+    WIDGET_METRIC_SCOPED("OverviewMapControl::draw");
     Control::draw(cx);
 
-    if (visible() && parentIsVisible() && _image.valid()) {
-        //TODO: this is not precisely correct..images get deformed slightly..
-        osg::Geometry* g = newGeometry();
+    if (visible() && parentIsVisible() && (_image.valid() || _liveRenderer.valid())) {
+        // The quad and texture are built once; later draws only move the
+        // vertices, and the texture is re-uploaded only after setImage()
+        if (!_geom.valid()) {
+            _geom = newGeometry();
+            _geom->setVertexArray(new osg::Vec3Array(6));
+            _geom->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLES, 0, 6));
+
+            osg::Vec4Array* c = new osg::Vec4Array(1);
+            (*c)[0] = osg::Vec4f(1, 1, 1, 1);
+            _geom->setColorArray(c);
+            _geom->setColorBinding(osg::Geometry::BIND_OVERALL);
+            _geom->setTexCoordArray(0, new osg::Vec2Array(6));
+
+            _texture = new osg::Texture2D();
+            _texture->setResizeNonPowerOfTwoHint(false);
+            _texture->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
+            _texture->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
+            _geom->getOrCreateStateSet()->setTextureAttributeAndModes(0, _texture.get(), osg::StateAttribute::ON);
+        }
+
+        // A live renderer's texture replaces the static image
+        osg::Texture2D* source = _liveRenderer.valid() ? _liveRenderer->getTexture() : _texture.get();
+        osg::StateSet* ss = _geom->getStateSet();
+        bool sourceChanged = ss->getTextureAttribute(0, osg::StateAttribute::TEXTURE) != source;
+        if (sourceChanged)
+            ss->setTextureAttributeAndModes(0, source, osg::StateAttribute::ON);
+
+        if (!_liveRenderer.valid() && _texture->getImage() != _image.get()) {
+            _texture->setImage(_image.get());
+            // Mipmapped images come from the OverviewImageLoader pipeline
+            _texture->setFilter(osg::Texture::MIN_FILTER,
+                _image->isMipmap() ? osg::Texture::LINEAR_MIPMAP_LINEAR : osg::Texture::LINEAR);
+            sourceChanged = true;
+        }
+
+        // A live texture holds exactly the shown window; a static equirectangular
+        // image covers the world and is cropped to the zoom window
+        const OverviewProjector* projector = getProjector();
+        osg::Vec4d window(0, 0, 1, 1);
+        if (!_liveRenderer.valid() && projector->getType() == OverviewProjector::EQUIRECTANGULAR) {
+            osg::Vec4d geo = projector->getWindow();
+            window.set((geo.x() + 180.0) / 360.0, (geo.y() + 90.0) / 180.0, (geo.z() + 180.0) / 360.0, (geo.w() + 90.0) / 180.0);
+        }
+        if (sourceChanged || projector != _drawnProjector.get()) {
+            bool flip = !_liveRenderer.valid() && _image->getOrigin() == osg::Image::TOP_LEFT;
+            float bottom = flip ? 1.0 - window.y() : window.y();
+            float top = flip ? 1.0 - window.w() : window.w();
+            osg::Vec2Array* t = static_cast<osg::Vec2Array*>(_geom->getTexCoordArray(0));
+            (*t)[0].set(window.x(), top);
+            (*t)[1].set(window.x(), bottom);
+            (*t)[2].set(window.z(), bottom);
+            (*t)[3].set((*t)[2]);
+            (*t)[4].set(window.z(), top);
+            (*t)[5].set((*t)[0]);
+            t->dirty();
+            WIDGET_METRIC_ADD(s_geometryRebuilds, 1);
+        }
 
+        //TODO: this is not precisely correct..images get deformed slightly..
         float rx = osg::round(_renderPos.x());
         float ry = osg::round(_renderPos.y());
         float vph = cx._vp->height();
 
-        osg::Vec3Array* verts = new osg::Vec3Array(6);
-        g->setVertexArray(verts);
+        osg::Vec3Array* verts = static_cast<osg::Vec3Array*>(_geom->getVertexArray());
 
         if (_rotation.as(Units::RADIANS) != 0.0f || _fixSizeForRot == true) {
             osg::Vec2f rc(rx + _renderSize.x() / 2, (vph - ry) - _renderSize.y() / 2);
             float ra = osg::PI - _rotation.as(Units::RADIANS);
 
-            rx += 0.5 * _renderSize.x() - 0.5 * (float)_image->s();
-            ry += 0.5 * _renderSize.y() - 0.5 * (float)_image->t();
+            // Explicit sizes win over the image size, which may be a downsampled texture
+            float iw = width().isSet() ? width().value() : _image.valid() ? (float)_image->s() : _renderSize.x();
+            float ih = height().isSet() ? height().value() : _image.valid() ? (float)_image->t() : _renderSize.y();
+
+            rx += 0.5 * _renderSize.x() - 0.5 * iw;
+            ry += 0.5 * _renderSize.y() - 0.5 * ih;
 
             rot(rx, vph - ry, rc, ra, (*verts)[0]);
-            rot(rx, vph - ry - _image->t(), rc, ra, (*verts)[1]);
-            rot(rx + _image->s(), vph - ry - _image->t(), rc, ra, (*verts)[2]);
+            rot(rx, vph - ry - ih, rc, ra, (*verts)[1]);
+            rot(rx + iw, vph - ry - ih, rc, ra, (*verts)[2]);
             (*verts)[3].set((*verts)[2]);
-            rot(rx + _image->s(), vph - ry, rc, ra, (*verts)[4]);
+            rot(rx + iw, vph - ry, rc, ra, (*verts)[4]);
             (*verts)[5].set((*verts)[0]);
         } else {
             (*verts)[0].set(rx, vph - ry, 0);
@@ -295,70 +529,71 @@ void OverviewMapControl::draw(const ControlContext& cx)
             (*verts)[4].set(rx + _renderSize.x(), vph - ry, 0);
             (*verts)[5].set((*verts)[0]);
         }
+        verts->dirty();
+        _geom->dirtyBound();
 
-        g->addPrimitiveSet(new osg::DrawArrays(GL_TRIANGLES, 0, 6));
-
-        osg::Vec4Array* c = new osg::Vec4Array(1);
-        (*c)[0] = osg::Vec4f(1, 1, 1, 1);
-        g->setColorArray(c);
-        g->setColorBinding(osg::Geometry::BIND_OVERALL);
-
-        bool flip = _image->getOrigin() == osg::Image::TOP_LEFT;
-
-        osg::Vec2Array* t = new osg::Vec2Array(6);
-
-#ifdef IMAGECONTROL_TEXRECT
-
-        (*t)[0].set(0, flip ? 0 : _image->t() - 1);
-        (*t)[1].set(0, flip ? _image->t() - 1 : 0);
-        (*t)[2].set(_image->s() - 1, flip ? _image->t() - 1 : 0);
-        (*t)[3].set((*t)[2]);
-        (*t)[4].set(_image->s() - 1, flip ? 0 : _image->t() - 1);
-        (*t)[5].set((*t)[0]);
-        osg::TextureRectangle* tex = new osg::TextureRectangle(_image.get());
-
-#else
-
-        (*t)[0].set(0, flip ? 0 : 1);
-        (*t)[1].set(0, flip ? 1 : 0);
-        (*t)[2].set(1, flip ? 1 : 0);
-        (*t)[3].set((*t)[2]);
-        (*t)[4].set(1, flip ? 0 : 1);
-        (*t)[5].set((*t)[0]);
-        osg::Texture2D* tex = new osg::Texture2D(_image.get());
-#endif
-
-        g->setTexCoordArray(0, t);
-
-        tex->setResizeNonPowerOfTwoHint(false);
-
-        tex->setFilter(osg::Texture::MIN_FILTER, osg::Texture::LINEAR);
-        tex->setFilter(osg::Texture::MAG_FILTER, osg::Texture::LINEAR);
-        g->getOrCreateStateSet()->setTextureAttributeAndModes(0, tex, osg::StateAttribute::ON);
-
-        /*osg::TexEnv* texenv = new osg::TexEnv( osg::TexEnv::MODULATE );
-        g->getStateSet()->setTextureAttributeAndModes( 0, texenv, osg::StateAttribute::ON );
-         */
-//        getGeode()->addDrawable(g);
-
-//        getGeode()->addDrawable(getOrCreateCross());
-//        getGeode()->addDrawable(getOrCreatePoints());
         if (!_xform.valid()) {
 
             _xform  = new osg::MatrixTransform;
-            _xform->addChild(g);
+            _xform->addChild(_geom.get());
             _xform->addChild(getOrCreateCross());
+            _xform->addChild(getOrCreateFootprint());
+            _xform->addChild(getOrCreateRedTrails());
+            _xform->addChild(getOrCreateBlueTrails());
             _xform->addChild(getOrCreateRedPoints());
             _xform->addChild(getOrCreateBluePoints());
             addChild(_xform);
         }
+        getOrCreateRedPoints()->setProjector(projector);
+        getOrCreateBluePoints()->setProjector(projector);
+        getOrCreateRedTrails()->setProjector(projector);
+        getOrCreateBlueTrails()->setProjector(projector);
+        _drawnProjector = projector;
 
         _dirty = false;
     }
 }
 
+OverviewMapHandler::OverviewMapHandler(OverviewMapControl* om, osgEarth::Util::EarthManipulator* em, ScreenQuery* query)
+    : clicked_(false)
+    , om_(om)
+    , em_(em)
+    , query_(query)
+    , hoverLayer_(NULL)
+    , hoverId_(0)
+    , tileCacheHits_(0)
+    , tileCacheMisses_(0)
+{
+}
+
+bool OverviewMapHandler::pickEntity(const osg::Vec3& pos, EntityPointLayer*& out_layer, unsigned& out_id, osg::Vec2f& out_lonLat)
+{
+    if (!isInside(pos))
+        return false;
+    osg::Vec3 delta = pos - om_->_xform->getMatrix().getTrans();
+    osg::Vec2f uv(delta.x(), delta.y());
+
+    EntityPointLayer* layers[2] = { om_->_redPts.get(), om_->_bluePts.get() };
+    float best = FLT_MAX;
+    for (unsigned i = 0; i < 2; ++i) {
+        unsigned id;
+        osg::Vec2f lonLat;
+        float distance;
+        if (layers[i] && layers[i]->pick(uv, id, lonLat, distance) && distance < best) {
+            best = distance;
+            out_layer = layers[i];
+            out_id = id;
+            out_lonLat = lonLat;
+        }
+    }
+    return best != FLT_MAX;
+}
+
 bool OverviewMapHandler::isInside(const osg::Vec3f& pos)
 {
+    // Nothing drawn yet, e.g. while the image is still loading
+    if (!om_->_xform.valid())
+      return false;
     osg::Vec3 trans = om_->_xform->getMatrix().getTrans();
     // Clicked below or left
     if (pos.x() < trans.x() || pos.y() < trans.y())
@@ -382,28 +617,132 @@ void OverviewMapHandler::processDrag(const osg::Vec3& newMousePos)
 }
 
 
+void OverviewMapHandler::recordTileCacheStats(osgViewer::View* view)
+{
+    OverviewLayerRenderer* live = om_->getLiveRenderer();
+    if (!live)
+        return;
+    // Hit rate of the lookups made since the last frame
+    unsigned hits = live->getTileCacheHits();
+    unsigned misses = live->getTileCacheMisses();
+    unsigned lookups = (hits - tileCacheHits_) + (misses - tileCacheMisses_);
+    if (lookups > 0)
+        StatsHandler::recordValue(view, StatsHandler::TILE_CACHE_HIT_RATE, double(hits - tileCacheHits_) / lookups);
+    tileCacheHits_ = hits;
+    tileCacheMisses_ = misses;
+}
+
+void OverviewMapHandler::updateFootprint(osgViewer::View* view)
+{
+    const osg::Camera* camera = view->getCamera();
+    const osg::Vec4d viewport = getViewport(camera);
+    // The outline is stored projected, so a new projector (e.g. a zoom) needs a new one
+    const OverviewProjector* projector = om_->getProjector();
+    if (camera->getViewMatrix() == footprintView_ && camera->getProjectionMatrix() == footprintProj_
+        && viewport == footprintViewport_ && projector == footprintProjector_.get()) {
+        return;
+    }
+    footprintProjector_ = projector;
+    footprintView_ = camera->getViewMatrix();
+    footprintProj_ = camera->getProjectionMatrix();
+    footprintViewport_ = viewport;
+
+    // The footprint is traced against the ellipsoid, so only round-earth maps get one
+    static const osg::ref_ptr<osg::EllipsoidModel> wgs84 = new osg::EllipsoidModel();
+    const osg::EllipsoidModel* ellipsoid = wgs84.get();
+    if (query_.valid() && query_->getMapNode()) {
+        const osgEarth::MapNode* mapNode = query_->getMapNode();
+        if (!mapNode->isGeocentric() || !mapNode->getMapSRS()->getEllipsoid())
+            return;
+        ellipsoid = mapNode->getMapSRS()->getEllipsoid();
+    }
+
+    osg::Matrixd inverse;
+    double zNear;
+    if (!computeInverseWindowMatrix(camera, inverse, zNear))
+        return;
+
+    // Walk the viewport edges; rays that miss the ellipsoid land on the horizon
+    const osg::Vec2d corners[4] = {
+        osg::Vec2d(viewport.x(), viewport.y()),
+        osg::Vec2d(viewport.x() + viewport.z(), viewport.y()),
+        osg::Vec2d(viewport.x() + viewport.z(), viewport.y() + viewport.w()),
+        osg::Vec2d(viewport.x(), viewport.y() + viewport.w())
+    };
+    osg::Vec2d ring[4 * FOOTPRINT_EDGE_SAMPLES];
+    for (unsigned e = 0; e < 4; ++e) {
+        const osg::Vec2d& c0 = corners[e];
+        const osg::Vec2d& c1 = corners[(e + 1) % 4];
+        for (unsigned i = 0; i < FOOTPRINT_EDGE_SAMPLES; ++i) {
+            osg::Vec2d px = c0 + (c1 - c0) * (double(i) / FOOTPRINT_EDGE_SAMPLES);
+            osg::Vec3d start, end, world;
+            computeWindowRay(inverse, zNear, px.x(), px.y(), start, end);
+            if (!intersectEllipsoid(ellipsoid, 0.0, start, end, world))
+                horizonPoint(ellipsoid, start, end, world);
+            double lat, lon, height;
+            ellipsoid->convertXYZToLatLongHeight(world.x(), world.y(), world.z(), lat, lon, height);
+            ring[e * FOOTPRINT_EDGE_SAMPLES + i].set(osg::RadiansToDegrees(lon), osg::RadiansToDegrees(lat));
+        }
+    }
+    WIDGET_METRIC_ADD(s_intersections, 4 * FOOTPRINT_EDGE_SAMPLES);
+    om_->setFootprint(ring, 4 * FOOTPRINT_EDGE_SAMPLES);
+}
+
+void OverviewMapHandler::updateCross(osgViewer::View* view)
+{
+    // The cross only moves with the camera or the projector
+    const osg::Camera* camera = view->getCamera();
+    const osg::Vec4d viewport = getViewport(camera);
+    const OverviewProjector* projector = om_->getProjector();
+    if (camera->getViewMatrix() == crossView_ && camera->getProjectionMatrix() == crossProj_
+        && viewport == crossViewport_ && projector == crossProjector_.get()) {
+        return;
+    }
+    crossProjector_ = projector;
+    crossView_ = camera->getViewMatrix();
+    crossProj_ = camera->getProjectionMatrix();
+    crossViewport_ = viewport;
+
+    // The view center stays in the shared batch, so whichever widget queries first in
+    // a frame resolves it along with the others' pixels in one pass
+    osgEarth::GeoPoint pt;
+    osg::Vec3d world;
+    const osg::GraphicsContext* gc = camera->getGraphicsContext();
+    if (!query_.valid() || !gc || !query_->getMapNode()
+        || !query_->getWorldCoords((gc->getTraits()->width - 1) / 2.0, (gc->getTraits()->height - 1) / 2.0, world)
+        || !pt.fromWorld(query_->getMapNode()->getMapSRS(), world) || !pt.makeGeographic()) {
+        osgEarth::Viewpoint vp = em_->getViewpoint();
+        pt = vp.focalPoint().get();
+    }
+    osg::Vec2f uv;
+    // A center on the hidden side of the projection moves the cross off the control
+    if (!projector->project(pt.vec3d().x(), pt.vec3d().y(), uv))
+        uv.set(-1.0e6f, -1.0e6f);
+    double x = uv.x();
+    double y = uv.y();
+    osg::Vec3dArray* crossVt = dynamic_cast<osg::Vec3dArray*>(om_->getOrCreateCross()->getVertexArray());
+    if (crossVt) {
+        crossVt->clear();
+        crossVt->push_back(osg::Vec3d(x, y - 5, 0));
+        crossVt->push_back(osg::Vec3d(x, y + 5, 0));
+        crossVt->push_back(osg::Vec3d(x - 5, y, 0));
+        crossVt->push_back(osg::Vec3d(x + 5, y, 0));
+        crossVt->dirty();
+        WIDGET_METRIC_ADD(s_geometryRebuilds, 1);
+    }
+}
+
 bool OverviewMapHandler::handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa)
 {
+    WIDGET_METRIC_SCOPED("OverviewMapHandler::handle");
     osgViewer::View* view = dynamic_cast<osgViewer::View*>(&aa);
     if (ea.getEventType() == ea.FRAME) {
-        if (em_) {
-            osgEarth::Viewpoint vp = em_->getViewpoint();
-            osgEarth::GeoPoint pt = vp.focalPoint().get();
-            double mapWidth = om_->width().get();
-            double mapHeight = om_->height().get();
-            double x = (pt.vec3d().x() + 180.0) * mapWidth / 360.0;
-            double y = (pt.vec3d().y() + 90.0) * mapHeight / 180.0;
-            if (om_) {
-                osg::Vec3dArray* crossVt = dynamic_cast<osg::Vec3dArray*>(om_->getOrCreateCross()->getVertexArray());
-                if (crossVt) {
-                    crossVt->clear();
-                    crossVt->push_back(osg::Vec3d(x, y - 5, 0));
-                    crossVt->push_back(osg::Vec3d(x, y + 5, 0));
-                    crossVt->push_back(osg::Vec3d(x - 5, y, 0));
-                    crossVt->push_back(osg::Vec3d(x + 5, y, 0));
-                    crossVt->dirty();
-                }
-            }
+        ScopedStatsTimer timer(view, StatsHandler::OVERVIEW_TIMER);
+        if (view && om_) {
+            updateFootprint(view);
+            if (em_)
+                updateCross(view);
+            recordTileCacheStats(view);
         }
     } else if (ea.getEventType() == ea.PUSH && ea.getButton() == ea.MIDDLE_MOUSE_BUTTON) {
          clickPos_ = osg::Vec3f(ea.getX(), ea.getY(), 0.0);
@@ -426,24 +765,70 @@ bool OverviewMapHandler::handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActi
             return true;
         }
     }  else if (ea.getEventType() == ea.MOVE) {
-        if (isInside(osg::Vec3f(ea.getX(), ea.getY(), 0.0))) {
-        } else {
+        EntityPointLayer* layer = NULL;
+        unsigned id = 0;
+        osg::Vec2f lonLat;
+        pickEntity(osg::Vec3f(ea.getX(), ea.getY(), 0.0), layer, id, lonLat);
+        if (layer != hoverLayer_ || id != hoverId_) {
+            hoverLayer_ = layer;
+            hoverId_ = id;
+            if (pickListener_)
+                pickListener_->onHover(layer, id);
         }
 
+    }  else if (ea.getEventType() == ea.SCROLL) {
+        osg::Vec3 pos(ea.getX(), ea.getY(), 0.0);
+        const OverviewProjector* projector = om_->getProjector();
+        if (!isInside(pos) || projector->getType() != OverviewProjector::EQUIRECTANGULAR)
+            return false;
+        float factor;
+        if (ea.getScrollingMotion() == ea.SCROLL_UP)
+            factor = 2.0f;
+        else if (ea.getScrollingMotion() == ea.SCROLL_DOWN)
+            factor = 0.5f;
+        else
+            return false;
+
+        // Zoom about the cursor so the position under it stays put
+        osg::Vec3 delta = pos - om_->_xform->getMatrix().getTrans();
+        float lon, lat;
+        if (!projector->unproject(delta.x(), delta.y(), lon, lat))
+            return true;
+        float zoom = om_->getZoom();
+        float newZoom = osg::clampBetween(zoom * factor, 1.0f, MAX_ZOOM);
+        osg::Vec2f cursor(lon, lat);
+        osg::Vec2f center(projector->getCenterLon(), projector->getCenterLat());
+        center = cursor + (center - cursor) * (zoom / newZoom);
+        om_->setZoom(newZoom, center.x(), center.y());
+        return true;
+
     }  else if (ea.getEventType() == ea.PUSH && ea.getButton() == ea.LEFT_MOUSE_BUTTON) {
         float x = ea.getX();
         float y = ea.getY();
-        float w = om_->width().value();
-        float h = om_->height().value();
         float lat, lon;
 
+        // Clicking an entity centers on it rather than on the clicked pixel
+        EntityPointLayer* layer;
+        unsigned id;
+        osg::Vec2f lonLat;
+        if (pickEntity(osg::Vec3f(x, y, 0.0), layer, id, lonLat)) {
+            if (pickListener_)
+                pickListener_->onPick(layer, id);
+            Viewpoint vp = em_->getViewpoint();
+            vp.focalPoint() = GeoPoint(SpatialReference::get("wgs84"), lonLat.x(), lonLat.y(), 0, ALTMODE_ABSOLUTE);
+            em_->setViewpoint(vp);
+            return true;
+        }
+
         if (isInside(osg::Vec3f(x, y, 0.0))) {
             osg::Vec3 clickPos(ea.getX(), ea.getY(), 0.0);
             osg::Vec3 omPos(om_->_xform->getMatrix().getTrans());
             osg::Vec3 delta = clickPos - omPos;
-            convertXY2LatLon( w,  h, delta.x(), h-delta.y(), lat,  lon);
+            // Clicks off the projected map, e.g. outside the globe, do nothing
+            if (!om_->getProjector()->unproject(delta.x() + 0.5f, delta.y() + 0.5f, lon, lat))
+                return true;
             Viewpoint vp;
-            vp.focalPoint() = GeoPoint(SpatialReference::get("wgs84"), osg::RadiansToDegrees(lat), osg::RadiansToDegrees(lon), 0, ALTMODE_ABSOLUTE);
+            vp.focalPoint() = GeoPoint(SpatialReference::get("wgs84"), lon, lat, 0, ALTMODE_ABSOLUTE);
             vp.heading()->set( 0.0, Units::DEGREES );
             vp.pitch()->set( -89.0, Units::DEGREES );
             vp.range()->set( SpatialReference::get("wgs84")->getEllipsoid()->getRadiusEquator()*0.5, Units::METERS );
@@ -5,6 +5,16 @@
 #include <osgEarthUtil/Controls>
 #include <osgEarthUtil/EarthManipulator>
 
+#include "EntityPoints.h"
+#include "EntityTrails.h"
+#include "OverviewProjection.h"
+
+#include <memory>
+
+class ScreenQuery;
+class OverviewImageLoader;
+class OverviewLayerRenderer;
+
 using namespace osgEarth;
 using namespace osgEarth::Util;
 using namespace osgEarth::Util::Controls;
@@ -20,6 +30,15 @@ class  OverviewMapControl : public Control
       void setImage( osg::Image* image );
       osg::Image* getImage() const { return _image.get(); }
 
+      /** Starts the loader and shows its image once ready; until then the
+          control keeps its current image, if any. */
+      void setImageLoader( OverviewImageLoader* loader );
+
+      /** Shows the texture rendered from the map's image layers instead of the
+          image. The renderer becomes a child of the control. */
+      void setLiveRenderer( OverviewLayerRenderer* renderer );
+      OverviewLayerRenderer* getLiveRenderer() const { return _liveRenderer.get(); }
+
       /** Rotates the image. */
       void setRotation( const Angular& angle );
       const Angular& getRotation() const { return _rotation; }
@@ -29,13 +48,47 @@ class  OverviewMapControl : public Control
       void setFixSizeForRotation( bool value );
       bool getFixSizeForRotation() const { return _fixSizeForRot; }
 
+      /** Selects the projection of the overview. The background image must be
+          prepared for the same projection, see OverviewImageLoader::setProjector. */
+      void setProjection( OverviewProjector::Type type, float centerLon = 0.0f, float centerLat = 0.0f );
+      OverviewProjector::Type getProjection() const { return _projectionType; }
+
+      /** Magnifies the equirectangular overview around a center (degrees); the
+          other projections always show the whole map. The center is moved as
+          needed to keep the window inside the world. With a live renderer the
+          tiles for the window are rendered from the map's tile cache and the
+          view switches once they are all ready. */
+      void setZoom( float zoom, float centerLon, float centerLat );
+      float getZoom() const { return _zoom; }
+
+      /** Projector for the current projection, size and zoom window, rebuilt when
+          any changes. With a live renderer the window follows the one its
+          texture shows, so entities stay aligned with the background. */
+      const OverviewProjector* getProjector();
+
+      /** Redraws if the projector changed, e.g. once a live zoom window is shown.
+          Called from the update traversal. */
+      void updateProjector();
+
       osg::Geometry* getOrCreateCross();
 
+      /** Outline of the main camera's ground footprint. */
+      osg::Geometry* getOrCreateFootprint();
+
+      /** Sets the footprint outline from a closed ring of (lon, lat) degrees. Segments
+          crossing the antimeridian are dropped rather than drawn across the map. */
+      void setFootprint( const osg::Vec2d* lonLat, unsigned count );
+
       osg::Geode* getGeode() { return Control::getGeode(); }
 
 
-      osg::Geometry* getOrCreateRedPoints();
-      osg::Geometry* getOrCreateBluePoints();
+      /** Entity point layers; positions may be streamed in from any thread. */
+      EntityPointLayer* getOrCreateRedPoints();
+      EntityPointLayer* getOrCreateBluePoints();
+
+      /** History trails drawn beneath the matching point layers. */
+      EntityTrailLayer* getOrCreateRedTrails();
+      EntityTrailLayer* getOrCreateBlueTrails();
 
       virtual void setVisible( bool value );
 
@@ -46,31 +99,91 @@ class  OverviewMapControl : public Control
       osg::Vec3 convertXYZ2UV(const osg::Vec3 &v3);
 
 private:
+      void updateLiveWindow();
+
       friend class OverviewMapHandler;
       osg::ref_ptr<osg::Image> _image;
       Angular _rotation;
       bool _fixSizeForRot;
-//      osg::Geometry* _geom;
+      osg::ref_ptr<osg::Geometry> _geom;
+      osg::ref_ptr<osg::Texture2D> _texture;
+      osg::ref_ptr<OverviewImageLoader> _loader;
+      osg::ref_ptr<OverviewLayerRenderer> _liveRenderer;
       osg::ref_ptr<osg::Geometry>  _cross;
-      osg::ref_ptr<osg::Geometry> _redPts;
-      osg::ref_ptr<osg::Geometry> _bluePts;
+      osg::ref_ptr<osg::Geometry> _footprint;
+      osg::ref_ptr<EntityPointLayer> _redPts;
+      osg::ref_ptr<EntityPointLayer> _bluePts;
+      osg::ref_ptr<EntityTrailLayer> _redTrails;
+      osg::ref_ptr<EntityTrailLayer> _blueTrails;
       osg::ref_ptr<osg::MatrixTransform> _xform;
       float _opacity;
+      OverviewProjector::Type _projectionType;
+      osg::Vec2f _projectionCenter;
+      osg::ref_ptr<const OverviewProjector> _projector;
+      osg::ref_ptr<const OverviewProjector> _drawnProjector;
+      float _zoom;
 
   };
 
+/** Receives entity picks from the overview map. */
+class OverviewPickListener
+{
+public:
+    OverviewPickListener() {}
+    virtual ~OverviewPickListener() {}
+
+    /** Executed when the hovered entity changes; layer is NULL when nothing is hovered */
+    virtual void onHover(EntityPointLayer* layer, unsigned id) =0;
+
+    /** Executed when an entity is clicked */
+    virtual void onPick(EntityPointLayer* layer, unsigned id) =0;
+};
+
+/// Shared pointer to an OverviewPickListener
+typedef std::shared_ptr<OverviewPickListener> OverviewPickListenerPtr;
+
 struct OverviewMapHandler : public osgGA::GUIEventHandler {
-    OverviewMapHandler(OverviewMapControl* om, osgEarth::Util::EarthManipulator* em)
-        : om_(om) , em_(em), clicked_(false) { }
+    OverviewMapHandler(OverviewMapControl* om, osgEarth::Util::EarthManipulator* em, ScreenQuery* query = 0L);
     bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa);
 
     bool isInside(const osg::Vec3& pos);
+
+    /** Sets the listener for entity hover and click picks */
+    void setPickListener(OverviewPickListenerPtr listener) { pickListener_ = listener; }
+
+    /** Finds the entity nearest a window position over either point layer */
+    bool pickEntity(const osg::Vec3& pos, EntityPointLayer*& out_layer, unsigned& out_id, osg::Vec2f& out_lonLat);
+
      bool clicked_;
      osg::Vec3 clickPos_;
      osg::Vec3 startingPos_;
     OverviewMapControl* om_;
     osgEarth::Util::EarthManipulator* em_;
+    osg::ref_ptr<ScreenQuery> query_;
     void processDrag(const osg::Vec3& newMousePos);
 
+    /** Recomputes the footprint outline if the camera changed since the last call. */
+    void updateFootprint(osgViewer::View* view);
+    osg::Matrixd footprintView_;
+    osg::Matrixd footprintProj_;
+    osg::Vec4d footprintViewport_;
+    osg::ref_ptr<const OverviewProjector> footprintProjector_;
+
+    /** Moves the view center cross if the camera changed since the last call. */
+    void updateCross(osgViewer::View* view);
+    osg::Matrixd crossView_;
+    osg::Matrixd crossProj_;
+    osg::Vec4d crossViewport_;
+    osg::ref_ptr<const OverviewProjector> crossProjector_;
+
+    OverviewPickListenerPtr pickListener_;
+    EntityPointLayer* hoverLayer_;
+    unsigned hoverId_;
+
+    /** Records the live overview's tile cache hit rate for the paging stats page. */
+    void recordTileCacheStats(osgViewer::View* view);
+    unsigned tileCacheHits_;
+    unsigned tileCacheMisses_;
+
 };
 #endif
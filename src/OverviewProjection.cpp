@@ -0,0 +1,195 @@
+#include "OverviewProjection.h"
+
+#include <osg/Math>
+
+#include <cmath>
+#include <sstream>
+
+namespace {
+
+// Web Mercator stops here, where the map becomes square
+const double MERCATOR_MAX_LAT = 85.05112878;
+
+double mercatorY(double latDeg)
+{
+    double lat = osg::DegreesToRadians(osg::clampBetween(latDeg, -MERCATOR_MAX_LAT, MERCATOR_MAX_LAT));
+    return log(tan(osg::PI_4 + lat / 2.0)) / (2.0 * osg::PI);
+}
+
+double stereoRadius(double latDeg)
+{
+    return tan(osg::PI_4 - osg::DegreesToRadians(latDeg) / 2.0);
+}
+
+}
+
+const unsigned OverviewProjector::LON_STEPS;
+const unsigned OverviewProjector::LAT_STEPS;
+
+OverviewProjector::OverviewProjector(Type type, float width, float height,
+    float centerLon, float centerLat, float boundaryLat, float zoom)
+    : _type(type)
+    , _width(width)
+    , _height(height)
+    , _centerLon(centerLon)
+    , _centerLat(centerLat)
+    , _boundaryLat(osg::clampBetween(boundaryLat, -89.0f, 89.0f))
+    , _zoom(type == EQUIRECTANGULAR ? osg::maximum(zoom, 1.0f) : 1.0f)
+    , _sinLat0(sin(osg::DegreesToRadians(centerLat)))
+    , _cosLat0(cos(osg::DegreesToRadians(centerLat)))
+{
+    // The azimuthal projections are drawn as the largest circle that fits,
+    // and Web Mercator as the largest square, so neither is stretched
+    float radius = osg::minimum(width, height) / 2.0f;
+
+    switch (_type) {
+    case WEB_MERCATOR:
+        _sx = radius / 180.0f;
+        _ox = width / 2.0f;
+        _sy = 2.0f * radius;
+        _oy = height / 2.0f;
+        _latA.resize(LAT_STEPS + 1);
+        for (unsigned i = 0; i <= LAT_STEPS; ++i)
+            _latA[i] = mercatorY(-90.0 + i * 180.0 / LAT_STEPS);
+        break;
+
+    case POLAR_STEREOGRAPHIC: {
+        _sx = _sy = radius;
+        _ox = width / 2.0f;
+        _oy = height / 2.0f;
+        // Radius is 1 at the boundary; far southern latitudes are capped since
+        // they are never visible
+        double boundary = stereoRadius(_boundaryLat);
+        _latA.resize(LAT_STEPS + 1);
+        for (unsigned i = 0; i <= LAT_STEPS; ++i)
+            _latA[i] = osg::minimum(stereoRadius(-90.0 + i * 180.0 / LAT_STEPS) / boundary, 4.0);
+        break;
+    }
+
+    case ORTHOGRAPHIC:
+        _sx = _sy = radius;
+        _ox = width / 2.0f;
+        _oy = height / 2.0f;
+        _latA.resize(LAT_STEPS + 1);
+        _latB.resize(LAT_STEPS + 1);
+        for (unsigned i = 0; i <= LAT_STEPS; ++i) {
+            double lat = osg::DegreesToRadians(-90.0 + i * 180.0 / LAT_STEPS);
+            _latA[i] = sin(lat);
+            _latB[i] = cos(lat);
+        }
+        break;
+
+    default: {
+        osg::Vec4d window = computeWindow(_zoom, _centerLon, _centerLat);
+        _sx = width / (window.z() - window.x());
+        _ox = -window.x() * _sx;
+        _sy = height / (window.w() - window.y());
+        _oy = -window.y() * _sy;
+        break;
+    }
+    }
+
+    if (_type == POLAR_STEREOGRAPHIC || _type == ORTHOGRAPHIC) {
+        _sinLon.resize(LON_STEPS + 1);
+        _cosLon.resize(LON_STEPS + 1);
+        for (unsigned i = 0; i <= LON_STEPS; ++i) {
+            double lon = osg::DegreesToRadians(-180.0 + i * 360.0 / LON_STEPS);
+            _sinLon[i] = sin(lon);
+            _cosLon[i] = cos(lon);
+        }
+    }
+}
+
+osg::Vec4d OverviewProjector::computeWindow(float zoom, float& inout_centerLon, float& inout_centerLat)
+{
+    double halfLon = 180.0 / zoom;
+    double halfLat = 90.0 / zoom;
+    inout_centerLon = osg::clampBetween(inout_centerLon, static_cast<float>(halfLon - 180.0), static_cast<float>(180.0 - halfLon));
+    inout_centerLat = osg::clampBetween(inout_centerLat, static_cast<float>(halfLat - 90.0), static_cast<float>(90.0 - halfLat));
+    return osg::Vec4d(inout_centerLon - halfLon, inout_centerLat - halfLat, inout_centerLon + halfLon, inout_centerLat + halfLat);
+}
+
+osg::Vec4d OverviewProjector::getWindow() const
+{
+    float centerLon = _centerLon;
+    float centerLat = _centerLat;
+    return computeWindow(_zoom, centerLon, centerLat);
+}
+
+std::string OverviewProjector::getKey() const
+{
+    static const char* names[] = { "equirect", "mercator", "polar", "ortho" };
+    std::stringstream key;
+    key << names[_type] << "_" << _width << "x" << _height;
+    if (_type == POLAR_STEREOGRAPHIC)
+        key << "_" << _boundaryLat;
+    else if (_type == ORTHOGRAPHIC || _zoom != 1.0f)
+        key << "_" << _centerLon << "_" << _centerLat;
+    if (_zoom != 1.0f)
+        key << "_z" << _zoom;
+    return key.str();
+}
+
+bool OverviewProjector::parseType(const std::string& name, Type& out_type)
+{
+    if (name == "equirect")
+        out_type = EQUIRECTANGULAR;
+    else if (name == "mercator")
+        out_type = WEB_MERCATOR;
+    else if (name == "polar")
+        out_type = POLAR_STEREOGRAPHIC;
+    else if (name == "ortho")
+        out_type = ORTHOGRAPHIC;
+    else
+        return false;
+    return true;
+}
+
+bool OverviewProjector::unproject(float u, float v, float& out_lon, float& out_lat) const
+{
+    double x = (u - _ox) / _sx;
+    double y = (v - _oy) / _sy;
+
+    switch (_type) {
+    case WEB_MERCATOR:
+        if (fabs(x) > 180.0 || fabs(y) > 0.5)
+            return false;
+        out_lon = x;
+        out_lat = osg::RadiansToDegrees(atan(sinh(y * 2.0 * osg::PI)));
+        return true;
+
+    case POLAR_STEREOGRAPHIC: {
+        double r = sqrt(x * x + y * y);
+        if (r > 1.0)
+            return false;
+        out_lat = osg::RadiansToDegrees(osg::PI_2 - 2.0 * atan(r * stereoRadius(_boundaryLat)));
+        out_lon = osg::RadiansToDegrees(atan2(x, -y));
+        return true;
+    }
+
+    case ORTHOGRAPHIC: {
+        double rho = sqrt(x * x + y * y);
+        if (rho > 1.0)
+            return false;
+        if (rho == 0.0) {
+            out_lon = _centerLon;
+            out_lat = _centerLat;
+            return true;
+        }
+        double c = asin(rho);
+        double sinC = sin(c), cosC = cos(c);
+        out_lat = osg::RadiansToDegrees(asin(cosC * _sinLat0 + y * sinC * _cosLat0 / rho));
+        double lon = _centerLon + osg::RadiansToDegrees(
+            atan2(x * sinC, rho * cosC * _cosLat0 - y * sinC * _sinLat0));
+        out_lon = lon > 180.0 ? lon - 360.0 : lon < -180.0 ? lon + 360.0 : lon;
+        return true;
+    }
+
+    default:
+        if (u < 0.0f || u > _width || v < 0.0f || v > _height)
+            return false;
+        out_lon = x;
+        out_lat = y;
+        return true;
+    }
+}
@@ -0,0 +1,159 @@
+#ifndef OVERVIEWPROJECTION_H
+#define OVERVIEWPROJECTION_H 1
+
+#include <osg/Referenced>
+#include <osg/Vec2f>
+#include <osg/Vec4d>
+
+#include <string>
+#include <vector>
+
+/**
+ * Maps lon/lat degrees to overview control pixels (origin bottom left) for
+ * one projection and control size. The trigonometry of the forward mapping
+ * is tabulated at construction, so project() is a couple of table lookups
+ * and multiply-adds per point; every point, trail, cross and footprint
+ * vertex on the overview goes through it. unproject() is exact and meant
+ * for clicks and the one-time background reprojection.
+ *
+ * Only the equirectangular map fills the control; the others keep their
+ * aspect and are centered in it, so pixels outside them do not unproject.
+ *
+ * A projector never changes after construction and may be shared between
+ * threads; changing the projection or size means building a new one.
+ */
+class OverviewProjector : public osg::Referenced
+{
+public:
+    enum Type {
+        EQUIRECTANGULAR,
+        WEB_MERCATOR,
+        POLAR_STEREOGRAPHIC,    ///< North polar, down to the boundary latitude
+        ORTHOGRAPHIC            ///< Globe seen from above the center point
+    };
+
+    /**
+     * @param centerLon, centerLat  View center of the orthographic globe, or of
+     *        the window of a zoomed equirectangular map
+     * @param boundaryLat  Outer latitude of the polar stereographic map
+     * @param zoom  Magnification of the equirectangular map; other projections
+     *        always show their whole extent
+     */
+    OverviewProjector(Type type, float width, float height,
+        float centerLon = 0.0f, float centerLat = 0.0f, float boundaryLat = 45.0f, float zoom = 1.0f);
+
+    Type getType() const { return _type; }
+    float getWidth() const { return _width; }
+    float getHeight() const { return _height; }
+    float getCenterLon() const { return _centerLon; }
+    float getCenterLat() const { return _centerLat; }
+    float getZoom() const { return _zoom; }
+
+    /**
+     * Window (west, south, east, north) of an equirectangular map at the zoom
+     * level, moving the center as needed to keep the window inside the world.
+     */
+    static osg::Vec4d computeWindow(float zoom, float& inout_centerLon, float& inout_centerLat);
+
+    /** Window shown by an equirectangular projector. */
+    osg::Vec4d getWindow() const;
+
+    /** True for projections where longitude wraps at the map's left and right edges. */
+    bool isCylindrical() const { return _type == EQUIRECTANGULAR || _type == WEB_MERCATOR; }
+
+    /** Identifies the projection and size, e.g. for cache file names. */
+    std::string getKey() const;
+
+    /** Parses "equirect", "mercator", "polar" or "ortho". */
+    static bool parseType(const std::string& name, Type& out_type);
+
+    /** Projects a position; false if it is not on the visible part of the map. */
+    inline bool project(float lon, float lat, osg::Vec2f& out_uv) const;
+
+    /** Inverse of project(); false for pixels off the projected map. */
+    bool unproject(float u, float v, float& out_lon, float& out_lat) const;
+
+private:
+    // Table resolution, 0.05 degrees
+    static const unsigned LON_STEPS = 7200;
+    static const unsigned LAT_STEPS = 3600;
+
+    static inline float lookup(const std::vector<float>& table, float index);
+    inline float lonIndex(float lon) const;
+    inline float latIndex(float lat) const;
+
+    Type _type;
+    float _width;
+    float _height;
+    float _centerLon;
+    float _centerLat;
+    float _boundaryLat;
+    float _zoom;
+
+    // Affine part of the mapping: u = x * _sx + _ox, v = y * _sy + _oy
+    float _sx, _sy, _ox, _oy;
+    float _sinLat0, _cosLat0;
+
+    std::vector<float> _sinLon;     ///< sin of lon (or of lon - center), -180..180
+    std::vector<float> _cosLon;
+    std::vector<float> _latA;       ///< Mercator y, stereographic radius or sin(lat)
+    std::vector<float> _latB;       ///< cos(lat) for the orthographic globe
+};
+
+inline float OverviewProjector::lookup(const std::vector<float>& table, float index)
+{
+    unsigned i = static_cast<unsigned>(index);
+    if (i >= table.size() - 1)
+        return table.back();
+    float f = index - static_cast<float>(i);
+    return table[i] + (table[i + 1] - table[i]) * f;
+}
+
+inline float OverviewProjector::lonIndex(float lon) const
+{
+    if (lon < -180.0f)
+        lon += 360.0f;
+    else if (lon > 180.0f)
+        lon -= 360.0f;
+    return (lon + 180.0f) * (LON_STEPS / 360.0f);
+}
+
+inline float OverviewProjector::latIndex(float lat) const
+{
+    float i = (lat + 90.0f) * (LAT_STEPS / 180.0f);
+    return i < 0.0f ? 0.0f : i;
+}
+
+inline bool OverviewProjector::project(float lon, float lat, osg::Vec2f& out_uv) const
+{
+    switch (_type) {
+    case WEB_MERCATOR:
+        out_uv.set(lon * _sx + _ox, lookup(_latA, latIndex(lat)) * _sy + _oy);
+        return true;
+
+    case POLAR_STEREOGRAPHIC: {
+        float r = lookup(_latA, latIndex(lat));
+        float li = lonIndex(lon);
+        out_uv.set(r * lookup(_sinLon, li) * _sx + _ox, -r * lookup(_cosLon, li) * _sy + _oy);
+        return lat >= _boundaryLat;
+    }
+
+    case ORTHOGRAPHIC: {
+        float li = lonIndex(lon - _centerLon);
+        float sinDl = lookup(_sinLon, li);
+        float cosDl = lookup(_cosLon, li);
+        float ai = latIndex(lat);
+        float sinLat = lookup(_latA, ai);
+        float cosLat = lookup(_latB, ai);
+        out_uv.set(cosLat * sinDl * _sx + _ox,
+            (_cosLat0 * sinLat - _sinLat0 * cosLat * cosDl) * _sy + _oy);
+        return _sinLat0 * sinLat + _cosLat0 * cosLat * cosDl >= 0.0f;
+    }
+
+    default:
+        out_uv.set(lon * _sx + _ox, lat * _sy + _oy);
+        return out_uv.x() >= 0.0f && out_uv.x() <= _width && out_uv.y() >= 0.0f && out_uv.y() <= _height;
+    }
+}
+
+#endif
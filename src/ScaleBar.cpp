@@ -1,8 +1,166 @@
 #include "ScaleBar.h"
+#include "ScreenQuery.h"
+#include "EllipsoidMath.h"
+#include "StatsHandler.h"
+#include "WidgetMetrics.h"
 
 #include <osg/GraphicsContext>
 #include <osgEarth/GeoMath>
 #include <osgEarth/Terrain>
+#include <osgEarth/ElevationPool>
+#include <OpenThreads/Condition>
+#include <OpenThreads/Thread>
+
+WIDGET_METRIC_COUNTER(s_intersections, "ScaleBar", "intersections");
+WIDGET_METRIC_COUNTER(s_geometryRebuilds, "ScaleBar", "geometry rebuilds");
+WIDGET_METRIC_COUNTER(s_textRelayouts, "ScaleBar", "text relayouts");
+
+// Computes scale results away from the event thread. Only the newest camera
+// state is kept; states posted while a computation runs replace each other.
+class ScaleBar::Worker : public OpenThreads::Thread {
+public:
+    Worker(ScaleBar* owner)
+        : _owner(owner)
+        , _hasState(false)
+        , _hasResult(false)
+        , _done(false)
+        , _heightValid(false)
+        , _height(0.0)
+    {
+    }
+
+    ~Worker()
+    {
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+            _done = true;
+            _cond.signal();
+        }
+        join();
+    }
+
+    void post(const CameraState& state)
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        _state = state;
+        _hasState = true;
+        _cond.signal();
+    }
+
+    bool takeResult(Result& out)
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+        if (!_hasResult)
+            return false;
+        out = _result;
+        _hasResult = false;
+        return true;
+    }
+
+    virtual void run()
+    {
+        for (;;) {
+            CameraState state;
+            {
+                OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+                while (!_hasState && !_done)
+                    _cond.wait(&_mutex);
+                if (_done)
+                    return;
+                state = _state;
+                _hasState = false;
+            }
+
+            Result result;
+            compute(state, result);
+
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock(_mutex);
+            _result = result;
+            _hasResult = true;
+        }
+    }
+
+private:
+    void compute(const CameraState& state, Result& result)
+    {
+        result.generation = state.generation;
+        result.valid = false;
+
+        osg::Vec3d world1, world2, center;
+        for (int pass = 0; pass < 2; ++pass) {
+            if (!_heightValid && !sampleHeight(state))
+                return;
+            if (!_owner->intersectAnalytic(state, _height, center, world1, world2))
+                return;
+            double span = (world2 - world1).length();
+            if (pass > 0 || (center - _sample).length() <= span * state.tolerance)
+                break;
+            _heightValid = false;
+        }
+
+        double meters;
+        if (_owner->computeDistance(world1, world2, meters))
+            _owner->formatScale(meters, state, result);
+    }
+
+    // Samples the elevation data under the view center; unlike a terrain
+    // intersection this does not touch the live scene graph. The center is
+    // found at the last sampled height, which an invalidated sample keeps,
+    // so it lands near the terrain rather than on the ellipsoid.
+    bool sampleHeight(const CameraState& state)
+    {
+        osg::Vec3d center;
+        if (!_owner->intersectAnalytic(state, _height, center))
+            return false;
+
+        double height = 0.0;
+        osgEarth::ElevationPool* pool = _owner->_map->getElevationPool();
+        osgEarth::GeoPoint point;
+        if (pool && point.fromWorld(_owner->_mapNode->getMapSRS(), center)) {
+            osg::ref_ptr<osgEarth::ElevationSample> sample = pool->getElevation(point).get();
+            if (sample.valid() && sample->elevation != NO_DATA_VALUE)
+                height = sample->elevation;
+        }
+        _height = height;
+        _sample = center;
+        _heightValid = true;
+        return true;
+    }
+
+    ScaleBar* _owner;
+    OpenThreads::Mutex _mutex;
+    OpenThreads::Condition _cond;
+    CameraState _state;
+    Result _result;
+    bool _hasState;
+    bool _hasResult;
+    bool _done;
+
+    // Only touched by the worker thread
+    bool _heightValid;
+    double _height;
+    osg::Vec3d _sample;
+};
+
+// Applies finished async results during the update traversal.
+class ScaleBar::ApplyCallback : public osg::NodeCallback {
+public:
+    ApplyCallback(ScaleBar* owner)
+        : _owner(owner)
+    {
+    }
+
+    virtual void operator()(osg::Node* node, osg::NodeVisitor* nv)
+    {
+        osg::ref_ptr<ScaleBar> owner;
+        if (_owner.lock(owner))
+            owner->applyAsyncResult();
+        traverse(node, nv);
+    }
+
+private:
+    osg::observer_ptr<ScaleBar> _owner;
+};
 
 double ScaleBar::normalizeScaleMeters(double meters)
 {
@@ -147,9 +305,18 @@ ScaleBar::ScaleBar(osgEarth::MapNode* mapNode, osgViewer::View* view)
     , _view(view)
     , _windowWidth(500)
     , _windowHeight(500)
+    , _mapScale(-1.0)
     , _scaleBarUnits(UNITS_METERS)
+    , _fastMode(false)
+    , _fastModeTolerance(0.25)
+    , _heightValid(false)
+    , _cachedHeight(0.0)
+    , _requestGeneration(0)
+    , _appliedGeneration(0)
+    , _updatePending(false)
 {
     _map = mapNode->getMap();
+    _screenQuery = ScreenQuery::getOrCreate(view, mapNode);
 
     _scaleLabel = new osgEarth::Util::Controls::LabelControl("- km", 12.0f);
     _scaleLabel->setForeColor(osg::Vec4f(0, 0, 0, 1));
@@ -161,6 +328,11 @@ ScaleBar::ScaleBar(osgEarth::MapNode* mapNode, osgViewer::View* view)
     _scaleBar->setBorderWidth(1.0);
 }
 
+ScaleBar::~ScaleBar()
+{
+    setAsync(false);
+}
+
 void ScaleBar::setVisible(bool visible)
 {
     if (_scaleLabel.valid()) {
@@ -169,6 +341,36 @@ void ScaleBar::setVisible(bool visible)
     if (_scaleBar.valid()) {
         _scaleBar->setVisible(visible);
     }
+    // Results computed before a visibility change are stale, and nothing was
+    // computed while hidden
+    _appliedGeneration = _requestGeneration;
+    if (visible)
+        _updatePending = true;
+}
+
+bool ScaleBar::takeUpdatePending()
+{
+    bool pending = _updatePending;
+    _updatePending = false;
+    return pending;
+}
+
+void ScaleBar::setAsync(bool async)
+{
+    if (async == getAsync())
+        return;
+
+    if (async) {
+        _worker.reset(new Worker(this));
+        _worker->start();
+        _applyCallback = new ApplyCallback(this);
+        _scaleBar->addUpdateCallback(_applyCallback.get());
+    } else {
+        _scaleBar->removeUpdateCallback(_applyCallback.get());
+        _applyCallback = NULL;
+        _worker.reset();
+    }
+    _appliedGeneration = _requestGeneration;
 }
 
 double ScaleBar::computeScale()
@@ -184,7 +386,44 @@ double ScaleBar::computeScale()
         //        ERROR("No viewer");
         return -1.0;
     }
+    ScopedStatsTimer timer(_view.get(), StatsHandler::SCALEBAR_TIMER);
+    WIDGET_METRIC_SCOPED("ScaleBar::computeScale");
+
+    CameraState state;
+    if (!snapshotCamera(state))
+        return -1.0;
+
+    if (_worker) {
+        // The result is applied by the update callback; report the last known scale
+        _worker->post(state);
+        return _mapScale;
+    }
+
+    Result result;
+    result.generation = state.generation;
+    result.valid = false;
 
+    osg::Vec3d world1, world2;
+    bool onMap = _fastMode
+        ? computeWorldPointsFast(state, world1, world2)
+        : computeWorldPoints(state, world1, world2);
+
+#if 0
+    TRACE("w1: %g %g %g w2: %g %g %g",
+          world1.x(), world1.y(), world1.z(),
+          world2.x(), world2.y(), world2.z());
+#endif
+
+    double meters;
+    if (onMap && computeDistance(world1, world2, meters)) {
+        formatScale(meters, state, result);
+    }
+    applyResult(result);
+    return result.valid ? result.scale : -1.0;
+}
+
+bool ScaleBar::snapshotCamera(CameraState& state)
+{
     osg::ref_ptr<osg::GraphicsContext> gc = _view->getCamera()->getGraphicsContext();
     if (gc) {
         auto t = gc->getTraits();
@@ -192,39 +431,103 @@ double ScaleBar::computeScale()
         _windowHeight = t->height;
     }
 
-    double x, y;
     double pixelWidth = _windowWidth * 0.1 * 2.0;
     if (pixelWidth < 10)
         pixelWidth = 10;
     if (pixelWidth > 150)
         pixelWidth = 150;
-    x = (double)(_windowWidth - 1) / 2.0 - pixelWidth / 2.0;
-    y = (double)(_windowHeight - 1) / 2.0;
+    state.pixelWidth = pixelWidth;
+    state.x = (double)(_windowWidth - 1) / 2.0 - pixelWidth / 2.0;
+    state.y = (double)(_windowHeight - 1) / 2.0;
 
-    osg::Vec3d world1, world2;
-    if (!_mapNode->getTerrain()->getWorldCoordsUnderMouse(_view->asView(), x, y, world1)) {
-        // off map
-        //        TRACE("Off map coords: %g %g", x, y);
-        _scaleLabel->setText("");
-        _scaleBar->setWidth(0);
-        return -1.0;
-    }
-    x += pixelWidth;
-    if (!_mapNode->getTerrain()->getWorldCoordsUnderMouse(_view->asView(), x, y, world2)) {
-        // off map
-        //        TRACE("Off map coords: %g %g", x, y);
-        _scaleLabel->setText("");
-        _scaleBar->setWidth(0);
-        return -1.0;
+    if (!computeInverseWindowMatrix(_view->getCamera(), state.inverseWindowMatrix, state.zNear))
+        return false;
+
+    state.units = _scaleBarUnits;
+    state.tolerance = _fastModeTolerance;
+    state.generation = ++_requestGeneration;
+    return true;
+}
+
+bool ScaleBar::computeWorldPoints(const CameraState& state, osg::Vec3d& world1, osg::Vec3d& world2)
+{
+    // Batch both ends (and the center other widgets look at) into one pass
+    _screenQuery->request(state.x + state.pixelWidth, state.y);
+    _screenQuery->request(state.x + state.pixelWidth / 2.0, state.y);
+    if (!_screenQuery->getWorldCoords(state.x, state.y, world1))
+        return false;
+    return _screenQuery->getWorldCoords(state.x + state.pixelWidth, state.y, world2);
+}
+
+bool ScaleBar::computeWorldPointsFast(const CameraState& state, osg::Vec3d& world1, osg::Vec3d& world2)
+{
+    if (_map->isGeocentric() && !(_mapNode->getMapSRS() && _mapNode->getMapSRS()->getEllipsoid()))
+        return computeWorldPoints(state, world1, world2);
+
+    double cx = state.x + state.pixelWidth / 2.0;
+    if (!_heightValid && !sampleTerrainHeight(cx, state.y))
+        return false;
+
+    // Re-sample the terrain at most once if the cached height was taken too far away
+    for (int pass = 0; pass < 2; ++pass) {
+        osg::Vec3d center;
+        if (!intersectAnalytic(state, _cachedHeight, center, world1, world2))
+            return false;
+
+        double span = (world2 - world1).length();
+        if (pass > 0 || (center - _heightSample).length() <= span * state.tolerance)
+            return true;
+        if (!sampleTerrainHeight(cx, state.y))
+            return false;
     }
+    return true;
+}
 
-#if 0
-    TRACE("w1: %g %g %g w2: %g %g %g",
-          world1.x(), world1.y(), world1.z(),
-          world2.x(), world2.y(), world2.z());
-#endif
+bool ScaleBar::intersectAnalytic(const CameraState& state, double height, osg::Vec3d& center) const
+{
+    const osg::EllipsoidModel* ellipsoid = _map->isGeocentric() ? _mapNode->getMapSRS()->getEllipsoid() : NULL;
+    osg::Vec3d start, end;
+    computeWindowRay(state.inverseWindowMatrix, state.zNear, state.x + state.pixelWidth / 2.0, state.y, start, end);
+    WIDGET_METRIC_ADD(s_intersections, 1);
+    return intersectSurface(ellipsoid, height, start, end, center);
+}
 
-    double meters;
+bool ScaleBar::intersectAnalytic(const CameraState& state, double height,
+    osg::Vec3d& center, osg::Vec3d& world1, osg::Vec3d& world2) const
+{
+    const osg::EllipsoidModel* ellipsoid = _map->isGeocentric() ? _mapNode->getMapSRS()->getEllipsoid() : NULL;
+    osg::Vec3d start, end;
+    if (!intersectAnalytic(state, height, center))
+        return false;
+    WIDGET_METRIC_ADD(s_intersections, 2);
+    computeWindowRay(state.inverseWindowMatrix, state.zNear, state.x, state.y, start, end);
+    if (!intersectSurface(ellipsoid, height, start, end, world1))
+        return false;
+    computeWindowRay(state.inverseWindowMatrix, state.zNear, state.x + state.pixelWidth, state.y, start, end);
+    return intersectSurface(ellipsoid, height, start, end, world2);
+}
+
+bool ScaleBar::sampleTerrainHeight(double x, double y)
+{
+    osg::Vec3d world;
+    if (!_screenQuery->getWorldCoords(x, y, world)) {
+        _heightValid = false;
+        return false;
+    }
+    if (_map->isGeocentric()) {
+        double lat, lon;
+        _mapNode->getMapSRS()->getEllipsoid()->convertXYZToLatLongHeight(
+            world.x(), world.y(), world.z(), lat, lon, _cachedHeight);
+    } else {
+        _cachedHeight = world.z();
+    }
+    _heightSample = world;
+    _heightValid = true;
+    return true;
+}
+
+bool ScaleBar::computeDistance(const osg::Vec3d& world1, const osg::Vec3d& world2, double& meters) const
+{
     double radius = 6378137.0;
     if (_mapNode->getMapSRS() && _mapNode->getMapSRS()->getEllipsoid()) {
         radius = _mapNode->getMapSRS()->getEllipsoid()->getRadiusEquator();
@@ -250,11 +553,14 @@ double ScaleBar::computeScale()
     } else {
         // Assume geocentric?
         //        ERROR("No map SRS");
-        _scaleLabel->setText("");
-        _scaleBar->setWidth(0);
-        return -1.0;
+        return false;
     }
+    return true;
+}
 
+void ScaleBar::formatScale(double meters, const CameraState& state, Result& result) const
+{
+    double pixelWidth = state.pixelWidth;
     double scale = meters / pixelWidth;
     // 1mi = 5280 feet
     //double scaleMiles = scale / 1609.344; // International mile = 1609.344m
@@ -264,34 +570,30 @@ double ScaleBar::computeScale()
 #if 0
     TRACE("m: %g px: %g m/px: %g", meters, pixelWidth, scale);
 #endif
-    _mapScale = scale;
-    switch (_scaleBarUnits) {
+    result.mapScale = scale;
+    switch (state.units) {
     case UNITS_NAUTICAL_MILES: {
         double nmi = meters / 1852.0;
         scale = nmi / pixelWidth;
         nmi = normalizeScaleNauticalMiles(nmi);
         pixelWidth = nmi / scale;
-        if (_scaleLabel.valid()) {
-            _scaleLabel->setText(osgEarth::Stringify()
-                << nmi
-                << " nmi");
-        }
+        result.label = osgEarth::Stringify()
+            << nmi
+            << " nmi";
     } break;
     case UNITS_US_SURVEY_FEET: {
         double feet = meters * 3937.0 / 1200.0;
         scale = feet / pixelWidth;
         feet = normalizeScaleFeet(feet);
         pixelWidth = feet / scale;
-        if (_scaleLabel.valid()) {
-            if (feet >= 5280) {
-                _scaleLabel->setText(osgEarth::Stringify()
-                    << feet / 5280.0
-                    << " miUS");
-            } else {
-                _scaleLabel->setText(osgEarth::Stringify()
-                    << feet
-                    << " ftUS");
-            }
+        if (feet >= 5280) {
+            result.label = osgEarth::Stringify()
+                << feet / 5280.0
+                << " miUS";
+        } else {
+            result.label = osgEarth::Stringify()
+                << feet
+                << " ftUS";
         }
     } break;
     case UNITS_INTL_FEET: {
@@ -299,48 +601,123 @@ double ScaleBar::computeScale()
         scale = feet / pixelWidth;
         feet = normalizeScaleFeet(feet);
         pixelWidth = feet / scale;
-        if (_scaleLabel.valid()) {
-            if (feet >= 5280) {
-                _scaleLabel->setText(osgEarth::Stringify()
-                    << feet / 5280.0
-                    << " mi");
-            } else {
-                _scaleLabel->setText(osgEarth::Stringify()
-                    << feet
-                    << " ft");
-            }
+        if (feet >= 5280) {
+            result.label = osgEarth::Stringify()
+                << feet / 5280.0
+                << " mi";
+        } else {
+            result.label = osgEarth::Stringify()
+                << feet
+                << " ft";
         }
     } break;
     case UNITS_METERS:
     default: {
         meters = normalizeScaleMeters(meters);
         pixelWidth = meters / scale;
-        if (_scaleLabel.valid()) {
-            if (meters >= 1000) {
-                _scaleLabel->setText(osgEarth::Stringify()
-                    << meters / 1000.0
-                    << " km");
-            } else {
-                _scaleLabel->setText(osgEarth::Stringify()
-                    << meters
-                    << " m");
-            }
+        if (meters >= 1000) {
+            result.label = osgEarth::Stringify()
+                << meters / 1000.0
+                << " km";
+        } else {
+            result.label = osgEarth::Stringify()
+                << meters
+                << " m";
         }
     } break;
     }
-    if (_scaleBar.valid()) {
-        _scaleBar->setWidth(pixelWidth);
+    result.scale = scale;
+    result.barWidth = pixelWidth;
+    result.valid = true;
+}
+
+void ScaleBar::applyResult(const Result& result)
+{
+    if (!result.valid) {
+        // off map
+        applyLabel("", 0.0f);
+        return;
     }
-    return scale;
+    _mapScale = result.mapScale;
+    applyLabel(result.label, result.barWidth);
+}
+
+void ScaleBar::applyLabel(const std::string& label, float barWidth)
+{
+    if (_scaleLabel.valid() && _scaleLabel->text() != label) {
+        WIDGET_METRIC_ADD(s_textRelayouts, 1);
+        _scaleLabel->setText(label);
+    }
+    if (_scaleBar.valid() && (!_scaleBar->width().isSet() || _scaleBar->width().value() != barWidth)) {
+        WIDGET_METRIC_ADD(s_geometryRebuilds, 1);
+        _scaleBar->setWidth(barWidth);
+    }
+}
+
+void ScaleBar::applyAsyncResult()
+{
+    Result result;
+    if (!_worker || !_worker->takeResult(result))
+        return;
+    // Drop results overtaken by one already applied or by a visibility/mode change
+    if (result.generation <= _appliedGeneration)
+        return;
+    _appliedGeneration = result.generation;
+    applyResult(result);
+}
+
+ScaleBarHandler::ScaleBarHandler(ScaleBar* scaleBar)
+    : scaleBar_(scaleBar)
+    , epsilon_(1e-9)
+    , minInterval_(0.0)
+    , lastUpdateTime_(0.0)
+    , pending_(true)
+{
+}
+
+bool ScaleBarHandler::cameraChanged(const osg::Camera* camera)
+{
+    const osg::Matrixd& view = camera->getViewMatrix();
+    const osg::Matrixd& proj = camera->getProjectionMatrix();
+    osg::Vec4d viewport;
+    if (camera->getViewport()) {
+        const osg::Viewport* vp = camera->getViewport();
+        viewport.set(vp->x(), vp->y(), vp->width(), vp->height());
+    }
+
+    bool changed = viewport != viewport_;
+    for (int i = 0; i < 16 && !changed; ++i) {
+        double v = view.ptr()[i];
+        double p = proj.ptr()[i];
+        changed = fabs(v - viewMatrix_.ptr()[i]) > epsilon_ * osg::maximum(1.0, fabs(v))
+            || fabs(p - projMatrix_.ptr()[i]) > epsilon_ * osg::maximum(1.0, fabs(p));
+    }
+    if (changed) {
+        viewMatrix_ = view;
+        projMatrix_ = proj;
+        viewport_ = viewport;
+    }
+    return changed;
 }
 
 bool ScaleBarHandler::handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa)
 {
+    WIDGET_METRIC_SCOPED("ScaleBarHandler::handle");
     osgViewer::View* view = dynamic_cast<osgViewer::View*>(&aa);
     if (view) {
-        if (ea.getEventType() == ea.SCROLL || ea.getEventType() == ea.KEYDOWN) {
-            scaleBar_->computeScale();
-            return false;
+        if (ea.getEventType() == ea.RESIZE) {
+            pending_ = true;
+        } else if (ea.getEventType() == ea.FRAME) {
+            if (cameraChanged(view->getCamera()))
+                pending_ = true;
+            if (scaleBar_->takeUpdatePending())
+                pending_ = true;
+            // A change deferred by the rate limit is picked up on a later frame
+            if (pending_ && ea.getTime() - lastUpdateTime_ >= minInterval_) {
+                scaleBar_->computeScale();
+                lastUpdateTime_ = ea.getTime();
+                pending_ = false;
+            }
         }
     }
     return false;
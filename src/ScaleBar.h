@@ -6,6 +6,10 @@
 #include <osgEarth/MapNode>
 #include <osgEarth/Map>
 
+#include <memory>
+
+class ScreenQuery;
+
 enum ScaleBarUnits {
     UNITS_METERS,
     UNITS_INTL_FEET,
@@ -21,10 +25,40 @@ public:
     static double normalizeScaleNauticalMiles(double nmi);
 
     ScaleBar(osgEarth::MapNode* mapNode, osgViewer::View* view);
+    virtual ~ScaleBar();
 
     void setVisible(bool visible);
     double computeScale();
 
+    /**
+     * True once after the scale went stale without the camera moving, e.g. when
+     * the bar was shown again after computeScale() skipped it while hidden.
+     */
+    bool takeUpdatePending();
+
+    /**
+     * Fast mode intersects the two screen rays with the map ellipsoid (or the
+     * z plane of a projected map) raised by a cached terrain height, instead of
+     * intersecting the terrain scene graph twice per update. The height is
+     * re-sampled with a real terrain intersection only when the analytic view
+     * center drifts from the sample by more than the tolerance, expressed as a
+     * fraction of the ground distance covered by the bar.
+     */
+    void setFastMode(bool fastMode) { _fastMode = fastMode; _heightValid = false; }
+    bool getFastMode() const { return _fastMode; }
+    void setFastModeTolerance(double tolerance) { _fastModeTolerance = tolerance; }
+    double getFastModeTolerance() const { return _fastModeTolerance; }
+
+    /**
+     * Async mode makes computeScale() snapshot the camera and hand it to a
+     * worker thread, which runs the analytic computation with heights from the
+     * map's ElevationPool. Finished results are applied to the label and bar in
+     * the next update traversal; results older than the last applied one, or
+     * computed before a visibility change, are dropped.
+     */
+    void setAsync(bool async);
+    bool getAsync() const { return _worker.get() != NULL; }
+
     osg::ref_ptr<osgEarth::Util::Controls::LabelControl> _scaleLabel;
     osg::ref_ptr<osgEarth::Util::Controls::Frame> _scaleBar;
     osg::ref_ptr<osgEarth::MapNode> _mapNode;
@@ -33,13 +67,86 @@ public:
     int _windowWidth, _windowHeight;
     double _mapScale;
     ScaleBarUnits _scaleBarUnits;
+
+    bool _fastMode;
+    double _fastModeTolerance;
+    bool _heightValid;
+    double _cachedHeight;
+    osg::Vec3d _heightSample;
+
+private:
+    class Worker;
+    class ApplyCallback;
+
+    // Everything needed to compute the scale without touching the view
+    struct CameraState {
+        osg::Matrixd inverseWindowMatrix;
+        double zNear;
+        double x, y;
+        double pixelWidth;
+        double tolerance;
+        ScaleBarUnits units;
+        unsigned generation;
+    };
+
+    struct Result {
+        unsigned generation;
+        bool valid;
+        double scale;
+        double mapScale;
+        double barWidth;
+        std::string label;
+    };
+
+    bool snapshotCamera(CameraState& state);
+    bool computeWorldPoints(const CameraState& state, osg::Vec3d& world1, osg::Vec3d& world2);
+    bool computeWorldPointsFast(const CameraState& state, osg::Vec3d& world1, osg::Vec3d& world2);
+    bool intersectAnalytic(const CameraState& state, double height, osg::Vec3d& center) const;
+    bool intersectAnalytic(const CameraState& state, double height,
+        osg::Vec3d& center, osg::Vec3d& world1, osg::Vec3d& world2) const;
+    bool sampleTerrainHeight(double x, double y);
+    bool computeDistance(const osg::Vec3d& world1, const osg::Vec3d& world2, double& meters) const;
+    void formatScale(double meters, const CameraState& state, Result& result) const;
+    void applyResult(const Result& result);
+    // Updates only the controls whose content changed, so the others keep their layout
+    void applyLabel(const std::string& label, float barWidth);
+    void applyAsyncResult();
+
+    osg::ref_ptr<ScreenQuery> _screenQuery;
+    std::unique_ptr<Worker> _worker;
+    osg::ref_ptr<osg::NodeCallback> _applyCallback;
+    unsigned _requestGeneration;
+    unsigned _appliedGeneration;
+    bool _updatePending;
 };
 
 // ScaleBarHandler
+// Recomputes the scale at most once per frame, and only when the camera's view
+// matrix, projection matrix or viewport changed by more than the epsilon, or the
+// scale bar asks for an update.
 struct ScaleBarHandler : public osgGA::GUIEventHandler {
-    ScaleBarHandler(ScaleBar* scaleBar) : scaleBar_(scaleBar) { }
+    ScaleBarHandler(ScaleBar* scaleBar);
     bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa);
+
+    /** Caps recomputes to the given rate in Hz; 0 means once per changed frame. */
+    void setMaxUpdateRate(double hz) { minInterval_ = hz > 0.0 ? 1.0 / hz : 0.0; }
+    /** Relative tolerance used when comparing camera matrices. */
+    void setEpsilon(double epsilon) { epsilon_ = epsilon; }
+    /** Forces a recompute on the next frame, e.g. after changing units. */
+    void dirty() { pending_ = true; }
+
     osg::ref_ptr<ScaleBar> scaleBar_;
+
+private:
+    bool cameraChanged(const osg::Camera* camera);
+
+    osg::Matrixd viewMatrix_;
+    osg::Matrixd projMatrix_;
+    osg::Vec4d viewport_;
+    double epsilon_;
+    double minInterval_;
+    double lastUpdateTime_;
+    bool pending_;
 };
 
 #endif
@@ -0,0 +1,155 @@
+#include "ScreenQuery.h"
+#include "EllipsoidMath.h"
+#include "WidgetMetrics.h"
+
+#include <osgEarth/TerrainEngineNode>
+#include <osgUtil/IntersectionVisitor>
+#include <osgUtil/LineSegmentIntersector>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+
+#include <cmath>
+#include <vector>
+
+namespace {
+
+// Pixels not queried for this many frames drop out of the batch
+const unsigned MAX_IDLE_FRAMES = 60;
+
+WIDGET_METRIC_COUNTER(s_intersections, "ScreenQuery", "intersections");
+
+typedef std::map<const osgViewer::View*, osg::ref_ptr<ScreenQuery> > Registry;
+
+OpenThreads::Mutex s_registryMutex;
+Registry s_registry;
+
+unsigned currentFrame(const osgViewer::View* view)
+{
+    const osg::FrameStamp* fs = view->getFrameStamp();
+    return fs ? fs->getFrameNumber() : 0;
+}
+
+}
+
+ScreenQuery* ScreenQuery::getOrCreate(osgViewer::View* view, osgEarth::MapNode* mapNode)
+{
+    if (!view || !mapNode)
+        return NULL;
+
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock(s_registryMutex);
+    // Forget services whose view went away, since a new view may reuse the address
+    for (Registry::iterator i = s_registry.begin(); i != s_registry.end();) {
+        if (!i->second->_view.valid())
+            s_registry.erase(i++);
+        else
+            ++i;
+    }
+    osg::ref_ptr<ScreenQuery>& query = s_registry[view];
+    if (!query.valid())
+        query = new ScreenQuery(view, mapNode);
+    return query.get();
+}
+
+ScreenQuery::ScreenQuery(osgViewer::View* view, osgEarth::MapNode* mapNode)
+    : _view(view)
+    , _mapNode(mapNode)
+    , _numPasses(0)
+{
+}
+
+ScreenQuery::Pixel ScreenQuery::makePixel(double x, double y)
+{
+    return Pixel(static_cast<int>(floor(x * 8.0 + 0.5)), static_cast<int>(floor(y * 8.0 + 0.5)));
+}
+
+ScreenQuery::Entry& ScreenQuery::getEntry(double x, double y)
+{
+    Entries::iterator i = _entries.find(makePixel(x, y));
+    if (i == _entries.end()) {
+        i = _entries.insert(std::make_pair(makePixel(x, y), Entry())).first;
+        i->second.x = x;
+        i->second.y = y;
+    }
+    return i->second;
+}
+
+void ScreenQuery::request(double x, double y)
+{
+    Entry& entry = getEntry(x, y);
+    if (_view.valid())
+        entry.lastUsed = currentFrame(_view.get());
+}
+
+bool ScreenQuery::getWorldCoords(double x, double y, osg::Vec3d& out_world)
+{
+    if (!_view.valid() || !_mapNode.valid())
+        return false;
+
+    unsigned frame = currentFrame(_view.get());
+    Entry& entry = getEntry(x, y);
+    entry.lastUsed = frame;
+    if (entry.frame != frame)
+        runPass(frame);
+
+    if (!entry.hit)
+        return false;
+    out_world = entry.world;
+    return true;
+}
+
+bool ScreenQuery::peekWorldCoords(double x, double y, osg::Vec3d& out_world) const
+{
+    if (!_view.valid())
+        return false;
+    Entries::const_iterator i = _entries.find(makePixel(x, y));
+    if (i == _entries.end() || i->second.frame != currentFrame(_view.get()) || !i->second.hit)
+        return false;
+    out_world = i->second.world;
+    return true;
+}
+
+void ScreenQuery::runPass(unsigned frame)
+{
+    WIDGET_METRIC_SCOPED("ScreenQuery::runPass");
+    osg::Matrixd inverse;
+    double zNear;
+    if (!computeInverseWindowMatrix(_view->getCamera(), inverse, zNear))
+        return;
+
+    // One intersector per stale pixel, all sharing a single traversal
+    osg::ref_ptr<osgUtil::IntersectorGroup> group = new osgUtil::IntersectorGroup();
+    std::vector<std::pair<Entry*, osgUtil::LineSegmentIntersector*> > pending;
+    for (Entries::iterator i = _entries.begin(); i != _entries.end();) {
+        if (frame - i->second.lastUsed > MAX_IDLE_FRAMES) {
+            _entries.erase(i++);
+            continue;
+        }
+        Entry& entry = i->second;
+        if (entry.frame != frame) {
+            osg::Vec3d start, end;
+            computeWindowRay(inverse, zNear, entry.x, entry.y, start, end);
+            osgUtil::LineSegmentIntersector* picker = new osgUtil::LineSegmentIntersector(
+                osgUtil::Intersector::MODEL, start, end);
+            picker->setIntersectionLimit(osgUtil::Intersector::LIMIT_NEAREST);
+            group->addIntersector(picker);
+            pending.push_back(std::make_pair(&entry, picker));
+        }
+        ++i;
+    }
+    if (pending.empty())
+        return;
+
+    WIDGET_METRIC_ADD(s_intersections, static_cast<unsigned>(pending.size()));
+    osgUtil::IntersectionVisitor iv(group.get());
+    _mapNode->getTerrainEngine()->accept(iv);
+    ++_numPasses;
+
+    for (size_t i = 0; i < pending.size(); ++i) {
+        Entry* entry = pending[i].first;
+        osgUtil::LineSegmentIntersector* picker = pending[i].second;
+        entry->frame = frame;
+        entry->hit = picker->containsIntersections();
+        if (entry->hit)
+            entry->world = picker->getIntersections().begin()->getWorldIntersectPoint();
+    }
+}
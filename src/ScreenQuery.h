@@ -0,0 +1,85 @@
+#ifndef SCREENQUERY_H
+#define SCREENQUERY_H 1
+
+#include <osg/observer_ptr>
+#include <osgViewer/View>
+#include <osgEarth/MapNode>
+
+#include <map>
+#include <utility>
+
+/**
+ * Per-view, per-frame cache of screen to world queries against the terrain.
+ * HUD widgets ask for the world point under a window pixel; the first query
+ * in a frame intersects every pixel requested so far in a single
+ * IntersectionVisitor pass, and later queries for those pixels in the same
+ * frame are answered from the cache. Pixels queried in one frame are kept in
+ * the batch for the next, so widgets that look at the same pixels every frame
+ * share one traversal.
+ *
+ * Event handlers see each FRAME event in the order they were added to the
+ * view, so which widget runs the frame's pass depends on that order. Sharing
+ * works either way with getWorldCoords(); peekWorldCoords() only hits if a
+ * handler added earlier already ran a pass covering the pixel this frame.
+ */
+class ScreenQuery : public osg::Referenced {
+public:
+    /** Retrieves the query service for the view, creating it on first use. */
+    static ScreenQuery* getOrCreate(osgViewer::View* view, osgEarth::MapNode* mapNode);
+
+    /**
+     * Adds a pixel (window coordinates, origin bottom left) to the batch for
+     * the next intersection pass without running it.
+     */
+    void request(double x, double y);
+
+    /**
+     * Gets the world point under the pixel for the current frame. Runs the
+     * batched intersection at most once per frame, plus once more if a pixel
+     * that was not in the batch is asked for.
+     */
+    bool getWorldCoords(double x, double y, osg::Vec3d& out_world);
+
+    /**
+     * Gets the world point under the pixel only if it was already resolved
+     * this frame; never runs an intersection pass. That needs an event handler
+     * added ahead of the caller to have queried this frame, with the pixel in
+     * the batch.
+     */
+    bool peekWorldCoords(double x, double y, osg::Vec3d& out_world) const;
+
+    osgEarth::MapNode* getMapNode() const { return _mapNode.get(); }
+
+    /** Number of intersection passes run since creation. */
+    unsigned numPasses() const { return _numPasses; }
+
+protected:
+    ScreenQuery(osgViewer::View* view, osgEarth::MapNode* mapNode);
+    virtual ~ScreenQuery() { }
+
+private:
+    // Pixels are keyed at 1/8 pixel so callers computing the same pixel
+    // slightly differently still share an entry
+    typedef std::pair<int, int> Pixel;
+    static Pixel makePixel(double x, double y);
+
+    struct Entry {
+        Entry() : x(0.0), y(0.0), frame(~0u), lastUsed(0), hit(false) { }
+        double x, y;
+        unsigned frame;
+        unsigned lastUsed;
+        bool hit;
+        osg::Vec3d world;
+    };
+    typedef std::map<Pixel, Entry> Entries;
+
+    Entry& getEntry(double x, double y);
+    void runPass(unsigned frame);
+
+    osg::observer_ptr<osgViewer::View> _view;
+    osg::observer_ptr<osgEarth::MapNode> _mapNode;
+    Entries _entries;
+    unsigned _numPasses;
+};
+
+#endif
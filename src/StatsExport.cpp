@@ -0,0 +1,267 @@
+#include "StatsExport.h"
+
+#include <osg/Notify>
+
+#include <fstream>
+#include <iomanip>
+#include <new>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// How long the writer sleeps between drains
+const unsigned WRITER_SLEEP_US = 20000;
+
+unsigned roundUpPowerOfTwo(unsigned value)
+{
+    unsigned result = 1;
+    while (result < value)
+        result <<= 1;
+    return result;
+}
+
+}
+
+// Where drained records go; used by the writer thread only
+class StatsExporter::Sink
+{
+public:
+    virtual ~Sink() { }
+    virtual bool isOpen() const = 0;
+    virtual void write(const FrameStatsRecord& record) = 0;
+    virtual void flush() { }
+};
+
+namespace {
+
+class CsvSink : public StatsExporter::Sink
+{
+public:
+    CsvSink(const std::string& path) : _out(path.c_str())
+    {
+        if (_out)
+            _out << "frame,time,duration_ms,event_ms,update_ms,cull_ms,draw_ms,gpu_ms,"
+                    "pager_requests,pager_compile,pager_merge\n";
+        _out << std::fixed << std::setprecision(3);
+    }
+
+    virtual bool isOpen() const { return static_cast<bool>(_out); }
+
+    virtual void write(const FrameStatsRecord& record)
+    {
+        _out << record.frame << ',' << record.time << ',' << record.duration * 1000.0;
+        for (int p = 0; p < FrameTimeStats::NUM_PHASES; ++p)
+            _out << ',' << record.phases[p] * 1000.0;
+        _out << ',' << record.pagerRequests << ',' << record.pagerToCompile << ',' << record.pagerToMerge << '\n';
+    }
+
+    virtual void flush() { _out.flush(); }
+
+private:
+    std::ofstream _out;
+};
+
+class JsonLinesSink : public StatsExporter::Sink
+{
+public:
+    JsonLinesSink(const std::string& path) : _out(path.c_str())
+    {
+        _out << std::fixed << std::setprecision(3);
+    }
+
+    virtual bool isOpen() const { return static_cast<bool>(_out); }
+
+    virtual void write(const FrameStatsRecord& record)
+    {
+        _out << "{\"frame\":" << record.frame << ",\"time\":" << record.time
+             << ",\"duration_ms\":" << record.duration * 1000.0;
+        for (int p = 0; p < FrameTimeStats::NUM_PHASES; ++p)
+            _out << ",\"" << FrameTimeStats::phaseName(static_cast<FrameTimeStats::Phase>(p)) << "_ms\":" << record.phases[p] * 1000.0;
+        _out << ",\"pager_requests\":" << record.pagerRequests << ",\"pager_compile\":" << record.pagerToCompile
+             << ",\"pager_merge\":" << record.pagerToMerge << "}\n";
+    }
+
+    virtual void flush() { _out.flush(); }
+
+private:
+    std::ofstream _out;
+};
+
+class SharedMemorySink : public StatsExporter::Sink
+{
+public:
+    SharedMemorySink(const std::string& name, unsigned capacity)
+        : _header(NULL)
+        , _records(NULL)
+        , _size(sizeof(SharedStatsHeader) + capacity * sizeof(FrameStatsRecord))
+    {
+#ifndef _WIN32
+        int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+        if (fd < 0) {
+            OSG_WARN << "StatsExporter: cannot open shared memory " << name << std::endl;
+            return;
+        }
+        void* mem = MAP_FAILED;
+        if (ftruncate(fd, _size) == 0)
+            mem = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) {
+            OSG_WARN << "StatsExporter: cannot map shared memory " << name << std::endl;
+            return;
+        }
+        _header = new (mem) SharedStatsHeader;
+        _header->magic = SharedStatsHeader::MAGIC;
+        _header->version = SharedStatsHeader::VERSION;
+        _header->capacity = capacity;
+        _header->recordSize = sizeof(FrameStatsRecord);
+        _header->written.store(0, std::memory_order_relaxed);
+        _header->sequence.store(0, std::memory_order_release);
+        _records = reinterpret_cast<FrameStatsRecord*>(_header + 1);
+#else
+        OSG_WARN << "StatsExporter: shared memory export is not supported on this platform" << std::endl;
+#endif
+    }
+
+    ~SharedMemorySink()
+    {
+#ifndef _WIN32
+        if (_header)
+            munmap(_header, _size);
+#endif
+    }
+
+    virtual bool isOpen() const { return _header != NULL; }
+
+    virtual void write(const FrameStatsRecord& record)
+    {
+        // Readers that see the odd sequence, or a different one after their copy, retry
+        unsigned sequence = _header->sequence.load(std::memory_order_relaxed);
+        _header->sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        unsigned long long written = _header->written.load(std::memory_order_relaxed);
+        _records[written % _header->capacity] = record;
+        _header->written.store(written + 1, std::memory_order_release);
+        _header->sequence.store(sequence + 2, std::memory_order_release);
+    }
+
+private:
+    SharedStatsHeader* _header;
+    FrameStatsRecord* _records;
+    size_t _size;
+};
+
+}
+
+// Drains the ring until stopped, then once more so nothing pushed is lost
+class StatsExporter::Writer : public OpenThreads::Thread
+{
+public:
+    Writer(StatsExporter* owner) : _owner(owner), _done(false) { }
+
+    ~Writer()
+    {
+        _done.store(true);
+        join();
+    }
+
+    virtual void run()
+    {
+        while (!_done.load()) {
+            if (_owner->drain() == 0)
+                OpenThreads::Thread::microSleep(WRITER_SLEEP_US);
+        }
+        _owner->drain();
+    }
+
+private:
+    StatsExporter* _owner;
+    std::atomic<bool> _done;
+};
+
+StatsExporter::StatsExporter(Format format, const std::string& path, unsigned capacity)
+    : _ring(roundUpPowerOfTwo(capacity > 0 ? capacity : 1))
+    , _mask(static_cast<unsigned>(_ring.size()) - 1)
+    , _head(0)
+    , _tail(0)
+    , _dropped(0)
+{
+    switch (format) {
+    case CSV:
+        _sink.reset(new CsvSink(path));
+        break;
+    case JSON_LINES:
+        _sink.reset(new JsonLinesSink(path));
+        break;
+    default:
+        _sink.reset(new SharedMemorySink(path, static_cast<unsigned>(_ring.size())));
+        break;
+    }
+
+    if (_sink->isOpen()) {
+        _writer.reset(new Writer(this));
+        _writer->start();
+    } else {
+        OSG_WARN << "StatsExporter: cannot open " << path << std::endl;
+    }
+}
+
+StatsExporter::~StatsExporter()
+{
+    // Stop the writer before the sink it writes to
+    _writer.reset();
+}
+
+bool StatsExporter::isOpen() const
+{
+    return _writer.get() != NULL;
+}
+
+bool StatsExporter::push(const FrameStatsRecord& record)
+{
+    if (!_writer)
+        return false;
+    unsigned head = _head.load(std::memory_order_relaxed);
+    if (head - _tail.load(std::memory_order_acquire) > _mask) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    _ring[head & _mask] = record;
+    _head.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+unsigned StatsExporter::getNumDropped() const
+{
+    return _dropped.load(std::memory_order_relaxed);
+}
+
+unsigned StatsExporter::drain()
+{
+    unsigned tail = _tail.load(std::memory_order_relaxed);
+    unsigned head = _head.load(std::memory_order_acquire);
+    for (unsigned i = tail; i != head; ++i)
+        _sink->write(_ring[i & _mask]);
+    _tail.store(head, std::memory_order_release);
+    if (head != tail)
+        _sink->flush();
+    return head - tail;
+}
+
+bool StatsExporter::parseFormat(const std::string& name, Format& out_format)
+{
+    if (name == "csv")
+        out_format = CSV;
+    else if (name == "jsonl")
+        out_format = JSON_LINES;
+    else if (name == "shm")
+        out_format = SHARED_MEMORY;
+    else
+        return false;
+    return true;
+}
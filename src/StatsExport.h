@@ -0,0 +1,106 @@
+#ifndef STATSEXPORT_H
+#define STATSEXPORT_H
+
+#include "FrameTimeStats.h"
+
+#include <osg/Referenced>
+#include <OpenThreads/Thread>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+/** Stats of one finished frame, as exported. Plain data, so it can be copied into shared memory. */
+struct FrameStatsRecord
+{
+    unsigned frame;
+    unsigned pagerRequests;
+    unsigned pagerToCompile;
+    unsigned pagerToMerge;
+    double time;                                    ///< Viewer reference time at the start of the frame (s)
+    double duration;                                ///< Frame time (s)
+    double phases[FrameTimeStats::NUM_PHASES];      ///< Time taken by each phase (s), 0 if unknown
+};
+
+/**
+ * Header of the shared memory export: a ring of `capacity` FrameStatsRecords follows
+ * it. Record i lives in slot i % capacity; `written` counts records published, so the
+ * valid ones are [max(0, written - capacity + 1), written). The slot of the oldest of
+ * the last `capacity` records is the one the next write overwrites.
+ *
+ * `sequence` is a seqlock around each write: it is odd while a record is being copied
+ * in and bumped to even, with release, once the copy and `written` are done. A reader
+ * loads `sequence` with acquire and waits for it to be even, loads `written`, copies
+ * the records it wants, issues an acquire fence and loads `sequence` again; if it
+ * changed, the copy may be torn and the reader starts over.
+ */
+struct SharedStatsHeader
+{
+    static const unsigned MAGIC = 0x454d5354;      ///< "EMST"
+    static const unsigned VERSION = 2;
+
+    unsigned magic;
+    unsigned version;
+    unsigned capacity;
+    unsigned recordSize;
+    std::atomic<unsigned long long> written;
+    std::atomic<unsigned> sequence;
+};
+
+/**
+ * Streams per-frame stats off the render thread. push() copies the record into a
+ * single-producer, single-consumer ring without locks or allocation; a writer thread
+ * drains the ring into a CSV file, a JSON lines file or a POSIX shared memory segment.
+ * Records pushed while the ring is full are dropped and counted.
+ */
+class StatsExporter : public osg::Referenced
+{
+public:
+    enum Format {
+        CSV,
+        JSON_LINES,
+        SHARED_MEMORY       ///< Path is the segment name, e.g. "/earthmisc_stats"
+    };
+
+    /**
+     * Opens the destination and starts the writer thread.
+     * @param capacity Records buffered between the render and writer threads, rounded up to a power of two
+     */
+    StatsExporter(Format format, const std::string& path, unsigned capacity = 4096);
+
+    /** False if the destination could not be opened; nothing is exported then. */
+    bool isOpen() const;
+
+    /** Queues a record; called from the one producing thread. False if the ring was full. */
+    bool push(const FrameStatsRecord& record);
+
+    /** Records dropped because the writer fell behind. */
+    unsigned getNumDropped() const;
+
+    /** Parses "csv", "jsonl" or "shm". */
+    static bool parseFormat(const std::string& name, Format& out_format);
+
+    /** Destination of drained records, one per format */
+    class Sink;
+
+protected:
+    virtual ~StatsExporter();
+
+private:
+    class Writer;
+
+    /** Hands queued records to the sink; writer thread only. Returns the number written. */
+    unsigned drain();
+
+    std::vector<FrameStatsRecord> _ring;
+    unsigned _mask;
+    std::atomic<unsigned> _head;        ///< Records pushed
+    std::atomic<unsigned> _tail;        ///< Records drained
+    std::atomic<unsigned> _dropped;
+
+    std::unique_ptr<Sink> _sink;
+    std::unique_ptr<Writer> _writer;
+};
+
+#endif
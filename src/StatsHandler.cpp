@@ -1,13 +1,203 @@
 #include "StatsHandler.h"
-#include <limits>
+#include "WidgetMetrics.h"
+#include <osg/Notify>
+#include <osgDB/DatabasePager>
+#include <osgText/Text>
+#include <cstdio>
 
 
 /// Defines the sentinel value used by OSG for no-key mappings
 static const int NO_KEY_MAPPING = -1;
 
+/// Space between the custom page lines and their background edge
+static const float BACKGROUND_MARGIN = 5.0f;
+
+/// Bars of the frame time histogram: 1 ms each, the last one for everything longer
+static const unsigned int HISTOGRAM_BINS = 101;
+
+/// Histogram height, in stats lines
+static const float HISTOGRAM_LINES = 4.0f;
+
+/// Seconds between refreshes of the frame time text
+static const double FRAME_TIMES_TEXT_INTERVAL = 0.25;
+
+/// Frames a frame is recorded after it starts; its draw and GPU times are only in the stats by then
+static const unsigned int FRAME_STATS_LAG = 3;
+
+WIDGET_METRIC_COUNTER(s_geometryRebuilds, "StatsHandler", "geometry rebuilds");
+WIDGET_METRIC_COUNTER(s_textRelayouts, "StatsHandler", "text relayouts");
+
+/// Stats collection flag of each custom page
+static const std::string& customPageCollectName(StatsHandler::CustomPage page)
+{
+  static const std::string names[StatsHandler::LAST_CUSTOM_PAGE] = {
+    "", "earthmisc_widgets", "earthmisc_paging", "earthmisc_frametimes"
+  };
+  return names[page];
+}
+
+/// Stats attribute names of a timed block
+struct TimerNames
+{
+  std::string label;
+  std::string begin;
+  std::string end;
+  std::string taken;
+};
+
+static const TimerNames& timerNames(StatsHandler::StatsTimer timer)
+{
+  static const TimerNames names[StatsHandler::LAST_TIMER] = {
+    { "ScaleBar: ", "EarthMisc ScaleBar begin time", "EarthMisc ScaleBar end time", "EarthMisc ScaleBar time taken" },
+    { "Overview: ", "EarthMisc Overview begin time", "EarthMisc Overview end time", "EarthMisc Overview time taken" },
+    { "Compass: ", "EarthMisc Compass begin time", "EarthMisc Compass end time", "EarthMisc Compass time taken" }
+  };
+  return names[timer];
+}
+
+/// Stats attribute of a sampled value, and the scale it is shown at
+struct ValueNames
+{
+  std::string label;
+  std::string attribute;
+  float multiplier;
+  StatsHandler::CustomPage page;
+};
+
+static const ValueNames& valueNames(StatsHandler::StatsValue value)
+{
+  static const ValueNames names[StatsHandler::LAST_VALUE] = {
+    { "Pager requests: ", "EarthMisc pager requests", 1.0f, StatsHandler::PAGING_STATS },
+    { "Pager compile: ", "EarthMisc pager to compile", 1.0f, StatsHandler::PAGING_STATS },
+    { "Pager merge: ", "EarthMisc pager to merge", 1.0f, StatsHandler::PAGING_STATS },
+    { "Tile hits %: ", "EarthMisc tile cache hit rate", 100.0f, StatsHandler::PAGING_STATS }
+  };
+  return names[value];
+}
+
+/// Turns collection of the named statistic on or off for every camera of the viewer
+static void collectCameraStats(osgViewer::ViewerBase* viewer, const std::string& name, bool enabled)
+{
+  osgViewer::ViewerBase::Cameras cameras;
+  viewer->getCameras(cameras);
+  for (osgViewer::ViewerBase::Cameras::const_iterator i = cameras.begin(); i != cameras.end(); ++i)
+  {
+    if ((*i)->getStats())
+      (*i)->getStats()->collectStats(name, enabled);
+  }
+}
+
+/// Viewer stats attribute names of a frame's phases, indexed by FrameTimeStats::Phase
+static const std::string& phaseAttribute(FrameTimeStats::Phase phase)
+{
+  static const std::string names[FrameTimeStats::NUM_PHASES] = {
+    "Event traversal time taken", "Update traversal time taken", "Cull traversal time taken",
+    "Draw traversal time taken", "GPU draw time taken"
+  };
+  return names[phase];
+}
+
+/// Refreshes the percentile or hitch line of the FRAME_TIMES page while it is drawn
+class FrameTimesTextCallback : public osg::Drawable::DrawCallback
+{
+public:
+  FrameTimesTextCallback(const FrameTimeStats* frameTimes, bool hitches)
+    : frameTimes_(frameTimes),
+      hitches_(hitches),
+      lastUpdate_(0)
+  {
+  }
+
+  virtual void drawImplementation(osg::RenderInfo& renderInfo, const osg::Drawable* drawable) const
+  {
+    osgText::Text* text = const_cast<osgText::Text*>(static_cast<const osgText::Text*>(drawable));
+    const osg::Timer_t now = osg::Timer::instance()->tick();
+    if (osg::Timer::instance()->delta_s(lastUpdate_, now) >= FRAME_TIMES_TEXT_INTERVAL)
+    {
+      lastUpdate_ = now;
+      char buf[256];
+      if (!hitches_)
+      {
+        snprintf(buf, sizeof(buf), "Frame ms  p50: %.2f  p95: %.2f  p99: %.2f  max: %.2f  (%u frames)",
+          frameTimes_->percentile(0.5) * 1000.0, frameTimes_->percentile(0.95) * 1000.0,
+          frameTimes_->percentile(0.99) * 1000.0, frameTimes_->maximum() * 1000.0, frameTimes_->getNumFrames());
+      }
+      else
+      {
+        FrameTimeStats::Hitch hitch;
+        const double budget = frameTimes_->getHitchBudget() * 1000.0;
+        if (frameTimes_->getHitches(&hitch, 1) > 0)
+        {
+          snprintf(buf, sizeof(buf), "Hitches > %.1f ms: %u  last: frame %u, %.1f ms, %s %.1f ms",
+            budget, frameTimes_->getNumHitches(), hitch.frame, hitch.duration * 1000.0,
+            FrameTimeStats::phaseName(hitch.phase), hitch.phaseTime * 1000.0);
+        }
+        else
+          snprintf(buf, sizeof(buf), "Hitches > %.1f ms: 0", budget);
+      }
+      WIDGET_METRIC_ADD(s_textRelayouts, 1);
+      text->setText(buf);
+    }
+    text->drawImplementation(renderInfo);
+  }
+
+private:
+  osg::ref_ptr<const FrameTimeStats> frameTimes_;
+  bool hitches_;
+  mutable osg::Timer_t lastUpdate_;
+};
+
+/// Resizes the bars of the frame time histogram while it is drawn
+class FrameTimesHistogramCallback : public osg::Drawable::DrawCallback
+{
+public:
+  FrameTimesHistogramCallback(const FrameTimeStats* frameTimes, const osg::Vec3& origin, float width, float height)
+    : frameTimes_(frameTimes),
+      origin_(origin),
+      barWidth_(width / HISTOGRAM_BINS),
+      height_(height)
+  {
+  }
+
+  virtual void drawImplementation(osg::RenderInfo& renderInfo, const osg::Drawable* drawable) const
+  {
+    osg::Geometry* geom = const_cast<osg::Geometry*>(drawable->asGeometry());
+    osg::Vec3Array* verts = static_cast<osg::Vec3Array*>(geom->getVertexArray());
+    const unsigned int tallest = frameTimes_->getHistogram(bins_, HISTOGRAM_BINS);
+    for (unsigned int i = 0; i < HISTOGRAM_BINS; ++i)
+    {
+      const float x0 = origin_.x() + i * barWidth_;
+      const float x1 = x0 + barWidth_ * 0.8f;
+      const float y1 = origin_.y() + (tallest > 0 ? height_ * bins_[i] / tallest : 0.0f);
+      (*verts)[i * 4].set(x0, origin_.y(), 0.0f);
+      (*verts)[i * 4 + 1].set(x1, origin_.y(), 0.0f);
+      (*verts)[i * 4 + 2].set(x1, y1, 0.0f);
+      (*verts)[i * 4 + 3].set(x0, y1, 0.0f);
+    }
+    verts->dirty();
+    WIDGET_METRIC_ADD(s_geometryRebuilds, 1);
+    drawable->drawImplementation(renderInfo);
+  }
+
+private:
+  osg::ref_ptr<const FrameTimeStats> frameTimes_;
+  osg::Vec3 origin_;
+  float barWidth_;
+  float height_;
+  mutable unsigned int bins_[HISTOGRAM_BINS];
+};
+
 StatsHandler::StatsHandler()
-  : osgViewer::StatsHandler()
+  : osgViewer::StatsHandler(),
+    customPage_(NO_CUSTOM_PAGE),
+    keyEventCyclesCustomPages_(NO_KEY_MAPPING),
+    frameTimes_(new FrameTimeStats),
+    trackFrameTimes_(false),
+    collectFrameStats_(false)
 {
+  for (int page = 0; page < LAST_CUSTOM_PAGE; ++page)
+    customPageChildNum_[page] = 0;
+
   setKeyEventPrintsOutStats(NO_KEY_MAPPING);
   setKeyEventTogglesOnScreenStats(NO_KEY_MAPPING);
 
@@ -19,12 +209,22 @@ void StatsHandler::setStatsType(StatsHandler::StatsType statsType, osgViewer::Vi
 {
   if (onWhichView == NULL)
     return;
+  osgViewer::ViewerBase* viewer = onWhichView->getViewerBase();
+  if (viewer == NULL || viewer->getViewerStats() == NULL)
+    return;
 
-  // Due to the way osgViewer::StatsHandler is written, we must iterate through each
-  // possible state until we get the one we want, else the display looks bad
   StatsHandler::StatsType validStats = validate_(statsType);
-  while (_statsType != validStats)
-    cycleStats(onWhichView);
+  if (_statsType == validStats)
+    return;
+
+  // The stock detail pages and the custom pages share the space below the frame rate
+  if (validStats > FRAME_RATE)
+    setCustomPage(NO_CUSTOM_PAGE, onWhichView);
+
+  // The pages are built on the first frame, so switching only flips their switch children
+  _statsType = validStats;
+  updateCollection_(viewer);
+  showPages_(onWhichView);
 }
 
 StatsHandler::StatsType StatsHandler::statsType() const
@@ -51,22 +251,359 @@ StatsHandler::StatsType StatsHandler::validate_(StatsHandler::StatsType type) co
 
 void StatsHandler::cycleStats(osgViewer::View* onWhichView)
 {
-  if (!onWhichView)
+  WIDGET_METRIC_SCOPED("StatsHandler::cycleStats");
+  setStatsType(static_cast<StatsType>((_statsType + 1) % LAST), onWhichView);
+}
+
+void StatsHandler::setCustomPage(CustomPage page, osgViewer::View* onWhichView)
+{
+  if (onWhichView == NULL)
+    return;
+  osgViewer::ViewerBase* viewer = onWhichView->getViewerBase();
+  if (viewer == NULL || viewer->getViewerStats() == NULL)
+    return;
+  if (page < NO_CUSTOM_PAGE || page >= LAST_CUSTOM_PAGE)
+    page = NO_CUSTOM_PAGE;
+  if (page == customPage_)
+    return;
+
+  if (page != NO_CUSTOM_PAGE && _statsType > FRAME_RATE)
+    setStatsType(FRAME_RATE, onWhichView);
+
+  customPage_ = page;
+  updateCollection_(viewer);
+  showPages_(onWhichView);
+}
+
+bool StatsHandler::setUpHUD_(osgViewer::ViewerBase* viewer)
+{
+  if (!_initialized)
+  {
+    // The stock setup leaves _initialized unset until there is a graphics context to draw into
+    setUpHUDCamera(viewer);
+    if (!_initialized)
+      return false;
+    setUpScene(viewer);
+  }
+  setUpCustomPages_(viewer);
+  return true;
+}
+
+void StatsHandler::showPages_(osgViewer::View* view)
+{
+  if (!_initialized || !_switch.valid())
+    return;
+
+  // Cycling with the hotkey leaves earlier pages on as later ones are added, so
+  // match that layout: every page up to the current one is shown
+  _switch->setValue(_frameRateChildNum, _statsType >= FRAME_RATE);
+  _switch->setValue(_viewerChildNum, _statsType >= VIEWER_STATS);
+  _switch->setValue(_cameraSceneChildNum, _statsType >= CAMERA_SCENE_STATS);
+  _switch->setValue(_viewerSceneChildNum, _statsType >= VIEWER_SCENE_STATS);
+  for (int p = NO_CUSTOM_PAGE + 1; p < LAST_CUSTOM_PAGE; ++p)
+  {
+    if (customPagesSwitch_.valid())
+      customPagesSwitch_->setValue(customPageChildNum_[p], p == customPage_);
+  }
+  _camera->setNodeMask(_statsType != NO_STATS || customPage_ != NO_CUSTOM_PAGE ? 0xffffffff : 0x0);
+  view->requestRedraw();
+}
+
+StatsHandler::CustomPage StatsHandler::customPage() const
+{
+  return customPage_;
+}
+
+void StatsHandler::setKeyEventCyclesCustomPages(int key)
+{
+  keyEventCyclesCustomPages_ = key;
+}
+
+void StatsHandler::setHitchBudget(double seconds, osgViewer::View* onWhichView)
+{
+  frameTimes_->setHitchBudget(seconds);
+  trackFrameTimes_ = seconds > 0.0;
+  osgViewer::ViewerBase* viewer = onWhichView ? onWhichView->getViewerBase() : NULL;
+  if (viewer != NULL && viewer->getViewerStats() != NULL)
+    updateCollection_(viewer);
+}
+
+const FrameTimeStats* StatsHandler::frameTimes() const
+{
+  return frameTimes_.get();
+}
+
+void StatsHandler::setExporter(StatsExporter* exporter, osgViewer::View* onWhichView)
+{
+  exporter_ = exporter;
+  osgViewer::ViewerBase* viewer = onWhichView ? onWhichView->getViewerBase() : NULL;
+  if (viewer != NULL && viewer->getViewerStats() != NULL)
+    updateCollection_(viewer);
+}
+
+StatsExporter* StatsHandler::exporter() const
+{
+  return exporter_.get();
+}
+
+void StatsHandler::setCollectFrameStats(bool collect, osgViewer::View* onWhichView)
+{
+  collectFrameStats_ = collect;
+  osgViewer::ViewerBase* viewer = onWhichView ? onWhichView->getViewerBase() : NULL;
+  if (viewer != NULL && viewer->getViewerStats() != NULL)
+    updateCollection_(viewer);
+}
+
+void StatsHandler::updateCollection_(osgViewer::ViewerBase* viewer)
+{
+  // Frame times and the export need the frame duration and every phase's time
+  const bool frameTimes = customPage_ == FRAME_TIMES || trackFrameTimes_ || exporter_.valid() || collectFrameStats_;
+  const bool viewerStats = _statsType >= VIEWER_STATS;
+
+  osg::Stats* stats = viewer->getViewerStats();
+  stats->collectStats("frame_rate", _statsType >= FRAME_RATE || frameTimes);
+  stats->collectStats("event", viewerStats || frameTimes);
+  stats->collectStats("update", viewerStats || frameTimes);
+  stats->collectStats("scene", _statsType >= VIEWER_SCENE_STATS);
+  collectCameraStats(viewer, "rendering", viewerStats || frameTimes);
+  collectCameraStats(viewer, "gpu", viewerStats || frameTimes);
+  collectCameraStats(viewer, "scene", _statsType >= CAMERA_SCENE_STATS);
+
+  for (int p = NO_CUSTOM_PAGE + 1; p < LAST_CUSTOM_PAGE; ++p)
+    stats->collectStats(customPageCollectName(static_cast<CustomPage>(p)), p == customPage_ || (p == FRAME_TIMES && (customPage_ == FRAME_TIMES || trackFrameTimes_)));
+}
+
+bool StatsHandler::collecting(osgViewer::View* view, CustomPage page)
+{
+  if (view == NULL || page <= NO_CUSTOM_PAGE || page >= LAST_CUSTOM_PAGE)
+    return false;
+  osgViewer::ViewerBase* viewer = view->getViewerBase();
+  const osg::Stats* stats = viewer ? viewer->getViewerStats() : NULL;
+  return stats != NULL && stats->collectStats(customPageCollectName(page));
+}
+
+void StatsHandler::recordValue(osgViewer::View* view, StatsValue value, double sample)
+{
+  const ValueNames& names = valueNames(value);
+  if (!collecting(view, names.page))
+    return;
+  view->getViewerBase()->getViewerStats()->setAttribute(view->getFrameStamp()->getFrameNumber(), names.attribute, sample);
+}
+
+void StatsHandler::recordTime(osgViewer::View* view, StatsTimer timer, osg::Timer_t begin, osg::Timer_t end)
+{
+  const TimerNames& names = timerNames(timer);
+  const osg::Timer* clock = osg::Timer::instance();
+  osg::Stats* stats = view->getViewerBase()->getViewerStats();
+  const unsigned int frame = view->getFrameStamp()->getFrameNumber();
+  stats->setAttribute(frame, names.begin, clock->delta_s(view->getStartTick(), begin));
+  stats->setAttribute(frame, names.end, clock->delta_s(view->getStartTick(), end));
+  stats->setAttribute(frame, names.taken, clock->delta_s(begin, end));
+}
+
+void StatsHandler::setUpCustomPages_(osgViewer::ViewerBase* viewer)
+{
+  // reset() throws the stats scene away, so the pages go with it
+  if (!_switch.valid() || customPagesSwitch_.get() == _switch.get())
     return;
+  customPagesSwitch_ = _switch.get();
 
-  // Use a definitely-not-used key for simulated presses
-  static const int FAKE_KEY = std::numeric_limits<int>::max();
+  // createTimeStatsLine() draws into _statsGeode, so point it at each page in turn.
+  // The lines read the viewer stats ring buffer like the stock pages, and are only
+  // drawn, and so only update their text, while their page is switched on.
+  osg::ref_ptr<osg::Geode> stockGeode = _statsGeode;
+  osg::Stats* viewerStats = viewer->getViewerStats();
+  osg::Vec4 textColor(1.0f, 1.0f, 0.0f, 1.0f);
+  osg::Vec4 barColor(0.0f, 1.0f, 0.5f, 0.5f);
+  osg::Vec4 backgroundColor(0.0f, 0.0f, 0.0f, 0.3f);
+  const float top = _statsHeight - 24.0f - 2.0f * _lineHeight;
 
-  // Create a fake key event
-  osg::ref_ptr<osgGA::GUIEventAdapter> ea = new osgGA::GUIEventAdapter;
-  ea->setEventType(osgGA::GUIEventAdapter::KEYDOWN);
-  ea->setKey(FAKE_KEY);
+  for (int page = NO_CUSTOM_PAGE + 1; page < LAST_CUSTOM_PAGE; ++page)
+  {
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+    _statsGeode = geode;
+
+    unsigned int numLines = static_cast<unsigned int>(LAST_TIMER);
+    if (page == PAGING_STATS)
+      numLines = static_cast<unsigned int>(LAST_VALUE);
+    else if (page == FRAME_TIMES)
+      numLines = 3 + static_cast<unsigned int>(HISTOGRAM_LINES);
+    osg::Vec3 pos(_leftPos, top, 0.0f);
+    geode->addDrawable(createBackgroundRectangle(pos + osg::Vec3(-BACKGROUND_MARGIN, _characterSize + BACKGROUND_MARGIN, 0.0f),
+      _statsWidth - 2.0f * BACKGROUND_MARGIN, numLines * _lineHeight + 2.0f * BACKGROUND_MARGIN, backgroundColor));
+
+    if (page == WIDGET_STATS)
+    {
+      for (int timer = 0; timer < LAST_TIMER; ++timer)
+      {
+        const TimerNames& names = timerNames(static_cast<StatsTimer>(timer));
+        createTimeStatsLine(names.label, pos, textColor, barColor, viewerStats, viewerStats,
+          names.taken, 1000.0f, true, false, names.begin, names.end);
+        pos.y() -= _lineHeight;
+      }
+    }
+    else if (page == FRAME_TIMES)
+      createFrameTimesPage_(geode.get(), pos);
+    else
+    {
+      for (int value = 0; value < LAST_VALUE; ++value)
+      {
+        const ValueNames& names = valueNames(static_cast<StatsValue>(value));
+        if (names.page != page)
+          continue;
+        createTimeStatsLine(names.label, pos, textColor, barColor, viewerStats, viewerStats,
+          names.attribute, names.multiplier, true, false, "", "");
+        pos.y() -= _lineHeight;
+      }
+    }
+
+    customPageChildNum_[page] = _switch->getNumChildren();
+    _switch->addChild(geode.get(), false);
+  }
+  _statsGeode = stockGeode;
+}
+
+void StatsHandler::createFrameTimesPage_(osg::Geode* geode, osg::Vec3 pos)
+{
+  const osg::Vec4 textColor(1.0f, 1.0f, 0.0f, 1.0f);
+  const char* labels[3] = { "", "", "Frame time histogram, 1 ms bars from 0 to 100+ ms" };
+  for (int line = 0; line < 3; ++line)
+  {
+    osg::ref_ptr<osgText::Text> text = new osgText::Text;
+    text->setColor(textColor);
+    text->setFont(_font);
+    text->setCharacterSize(_characterSize);
+    text->setPosition(pos);
+    text->setText(labels[line]);
+    text->setDataVariance(osg::Object::DYNAMIC);
+    if (line < 2)
+      text->setDrawCallback(new FrameTimesTextCallback(frameTimes_.get(), line == 1));
+    geode->addDrawable(text.get());
+    pos.y() -= _lineHeight;
+  }
+
+  // Bars grow up from the bottom of the page; their vertices are set while drawing
+  const float height = HISTOGRAM_LINES * _lineHeight - BACKGROUND_MARGIN;
+  const osg::Vec3 origin(_startBlocks, pos.y() - height + _characterSize, 0.0f);
+  osg::ref_ptr<osg::Geometry> bars = new osg::Geometry;
+  bars->setUseDisplayList(false);
+  bars->setDataVariance(osg::Object::DYNAMIC);
+  bars->setVertexArray(new osg::Vec3Array(HISTOGRAM_BINS * 4));
+  osg::Vec4Array* colors = new osg::Vec4Array;
+  colors->push_back(osg::Vec4(0.0f, 1.0f, 0.5f, 0.7f));
+  bars->setColorArray(colors, osg::Array::BIND_OVERALL);
+  bars->addPrimitiveSet(new osg::DrawArrays(osg::PrimitiveSet::QUADS, 0, HISTOGRAM_BINS * 4));
+  bars->setDrawCallback(new FrameTimesHistogramCallback(frameTimes_.get(), origin,
+    _statsWidth - _startBlocks - 2.0f * BACKGROUND_MARGIN, height));
+  geode->addDrawable(bars.get());
+}
+
+bool StatsHandler::readFrameStats(osgViewer::View* view, unsigned int frame, FrameStatsRecord& out_record)
+{
+  osgViewer::ViewerBase* viewer = view->getViewerBase();
+  const osg::Stats* stats = viewer->getViewerStats();
+  static const std::string FRAME_DURATION = "Frame duration";
+  static const std::string REFERENCE_TIME = "Reference time";
+  if (!stats->getAttribute(frame, FRAME_DURATION, out_record.duration))
+    return false;
+  out_record.frame = frame;
+  out_record.time = 0.0;
+  stats->getAttribute(frame, REFERENCE_TIME, out_record.time);
+
+  double* phases = out_record.phases;
+  for (int p = 0; p < FrameTimeStats::NUM_PHASES; ++p)
+    phases[p] = 0.0;
+  stats->getAttribute(frame, phaseAttribute(FrameTimeStats::EVENT), phases[FrameTimeStats::EVENT]);
+  stats->getAttribute(frame, phaseAttribute(FrameTimeStats::UPDATE), phases[FrameTimeStats::UPDATE]);
+  cameras_.clear();
+  viewer->getCameras(cameras_);
+  for (osgViewer::ViewerBase::Cameras::const_iterator i = cameras_.begin(); i != cameras_.end(); ++i)
+  {
+    const osg::Stats* cameraStats = (*i)->getStats();
+    if (cameraStats == NULL)
+      continue;
+    // Cameras are culled and drawn one after another, so their times add up
+    for (int p = FrameTimeStats::CULL; p < FrameTimeStats::NUM_PHASES; ++p)
+    {
+      double taken = 0.0;
+      if (cameraStats->getAttribute(frame, phaseAttribute(static_cast<FrameTimeStats::Phase>(p)), taken))
+        phases[p] += taken;
+    }
+  }
+
+  const osgDB::DatabasePager* pager = view->getDatabasePager();
+  out_record.pagerRequests = pager ? pager->getFileRequestListSize() : 0;
+  out_record.pagerToCompile = pager ? pager->getDataToCompileListSize() : 0;
+  out_record.pagerToMerge = pager ? pager->getDataToMergeListSize() : 0;
+  return true;
+}
+
+void StatsHandler::recordFrame_(osgViewer::View* view)
+{
+  const bool frameTimes = collecting(view, FRAME_TIMES);
+  if (!frameTimes && !exporter_.valid())
+    return;
+
+  // The viewer sets the last frame's duration as this one starts, but the draw thread
+  // and GPU queries fill in the late phases afterwards, so record an older frame
+  const unsigned int frame = view->getFrameStamp()->getFrameNumber();
+  FrameStatsRecord record;
+  if (frame < FRAME_STATS_LAG || !readFrameStats(view, frame - FRAME_STATS_LAG, record))
+    return;
+
+  if (exporter_.valid())
+    exporter_->push(record);
+
+  if (frameTimes && frameTimes_->addFrame(record.frame, record.duration, record.phases))
+  {
+    FrameTimeStats::Hitch hitch;
+    frameTimes_->getHitches(&hitch, 1);
+    OSG_NOTICE << "Hitch at frame " << hitch.frame << ": " << hitch.duration * 1000.0 << " ms, mostly "
+      << FrameTimeStats::phaseName(hitch.phase) << " (" << hitch.phaseTime * 1000.0 << " ms)" << std::endl;
+  }
+}
 
-  // Fake a key press on an unused key
-  int oldKey = getKeyEventTogglesOnScreenStats();
-  setKeyEventTogglesOnScreenStats(FAKE_KEY);
-  osgViewer::StatsHandler::handle(*ea, *onWhichView);
-  // Restore the old key
-  setKeyEventTogglesOnScreenStats(oldKey);
+void StatsHandler::recordPager_(osgViewer::View* view)
+{
+  if (!collecting(view, PAGING_STATS))
+    return;
+  const osgDB::DatabasePager* pager = view->getDatabasePager();
+  if (pager == NULL)
+    return;
+  recordValue(view, PAGER_REQUESTS, pager->getFileRequestListSize());
+  recordValue(view, PAGER_TO_COMPILE, pager->getDataToCompileListSize());
+  recordValue(view, PAGER_TO_MERGE, pager->getDataToMergeListSize());
 }
 
+bool StatsHandler::handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa)
+{
+  WIDGET_METRIC_SCOPED("StatsHandler::handle");
+  osgViewer::View* view = dynamic_cast<osgViewer::View*>(&aa);
+  if (view != NULL)
+  {
+    if (ea.getEventType() == osgGA::GUIEventAdapter::FRAME)
+    {
+      // Build every page once the viewer has a context to draw into, rather than on
+      // the first switch, so switching pages at run time never builds geometry
+      if (!_initialized && setUpHUD_(view->getViewerBase()))
+        showPages_(view);
+      recordPager_(view);
+      recordFrame_(view);
+    }
+    else if (ea.getEventType() == osgGA::GUIEventAdapter::KEYDOWN && !ea.getHandled())
+    {
+      if (keyEventCyclesCustomPages_ != NO_KEY_MAPPING && ea.getKey() == keyEventCyclesCustomPages_)
+      {
+        setCustomPage(static_cast<CustomPage>((customPage_ + 1) % LAST_CUSTOM_PAGE), view);
+        return true;
+      }
+      // Route the stock hotkey through setStatsType() so the custom pages stay in step
+      if (_keyEventTogglesOnScreenStats != NO_KEY_MAPPING && ea.getKey() == _keyEventTogglesOnScreenStats)
+      {
+        cycleStats(view);
+        return true;
+      }
+    }
+  }
+  return osgViewer::StatsHandler::handle(ea, aa);
+}
@@ -3,8 +3,12 @@
 #define STATSHANDLER_H
 
 #include <osg/observer_ptr>
+#include <osg/Switch>
+#include <osg/Timer>
 #include <osgViewer/ViewerEventHandlers>
 #include <osgViewer/View>
+#include "FrameTimeStats.h"
+#include "StatsExport.h"
 
 /**
  * Specialization of the osgViewer::StatsHandler that allows for easy programmatic
@@ -18,6 +22,35 @@ public:
     /** Typedef the base class StatsType for ease of use */
     typedef osgViewer::StatsHandler::StatsType StatsType;
 
+    /** EarthMisc pages, shown beneath the frame rate in place of the stock detail pages */
+    enum CustomPage
+    {
+      NO_CUSTOM_PAGE = 0,
+      WIDGET_STATS,       ///< Time spent in the scale bar, overview map and compass
+      PAGING_STATS,       ///< DatabasePager queue depths and overview tile cache hit rate
+      FRAME_TIMES,        ///< Frame time percentiles, histogram and hitches
+      LAST_CUSTOM_PAGE
+    };
+
+    /** Blocks timed for the WIDGET_STATS page */
+    enum StatsTimer
+    {
+      SCALEBAR_TIMER = 0,
+      OVERVIEW_TIMER,
+      COMPASS_TIMER,
+      LAST_TIMER
+    };
+
+    /** Values sampled for the PAGING_STATS page */
+    enum StatsValue
+    {
+      PAGER_REQUESTS = 0,
+      PAGER_TO_COMPILE,
+      PAGER_TO_MERGE,
+      TILE_CACHE_HIT_RATE,
+      LAST_VALUE
+    };
+
     /**
    * Instantiate a new StatsHandler.  This instance should be associated with any view
    * or viewer using the addEventHandler() call, otherwise window resize events will
@@ -26,8 +59,10 @@ public:
     StatsHandler();
 
     /**
-   * Programmatically alter the stats type shown.  This is equivalent to pressing the
-   * toggling hotkey specified in setKeyeventTogglesOnScreenStats().
+   * Programmatically alter the stats type shown.  The display matches what pressing the
+   * toggling hotkey specified in setKeyeventTogglesOnScreenStats() would reach, but the
+   * switch happens in one step without passing through the intermediate types.  All pages
+   * are built on the first frame after the viewer is realized, so a switch builds nothing.
    * @param statsType Statistics to show on the main view
    * @param onWhichView View with which to associate the stats
    */
@@ -39,10 +74,132 @@ public:
     /** Retrieves the currently displayed statistics. */
     StatsType statsType() const;
 
+    /**
+   * Shows one of the EarthMisc pages, or none.  Stock pages other than the frame rate
+   * are hidden while a custom page is shown.  Data for a page is only recorded while
+   * it is shown.
+   * @param page Page to show
+   * @param onWhichView View with which to associate the stats
+   */
+    void setCustomPage(CustomPage page, osgViewer::View* onWhichView);
+
+    /** Retrieves the currently displayed EarthMisc page. */
+    CustomPage customPage() const;
+
+    /** Sets the key that cycles through the EarthMisc pages; none by default. */
+    void setKeyEventCyclesCustomPages(int key);
+
+    /**
+   * Detects frames longer than the budget, even while the FRAME_TIMES page is hidden.
+   * Hitches are logged and kept in frameTimes().  Frame times are only tracked while
+   * the page is shown or a budget is set.
+   * @param seconds Frame time budget; 0 stops tracking unless the page is shown
+   * @param onWhichView View with which to associate the stats
+   */
+    void setHitchBudget(double seconds, osgViewer::View* onWhichView);
+
+    /** Frame time window and hitches shown by the FRAME_TIMES page. */
+    const FrameTimeStats* frameTimes() const;
+
+    /**
+   * Streams the stats of every finished frame (frame time, phase times, pager queues)
+   * to the exporter, which writes them out on its own thread.  NULL stops exporting.
+   * @param exporter Destination of the frame stats
+   * @param onWhichView View with which to associate the stats
+   */
+    void setExporter(StatsExporter* exporter, osgViewer::View* onWhichView);
+
+    /** Retrieves the frame stats exporter, if any. */
+    StatsExporter* exporter() const;
+
+    /**
+   * Keeps collecting everything readFrameStats() needs, whichever pages are shown.
+   * Cameras added to the viewer later only collect once this is called again.
+   */
+    void setCollectFrameStats(bool collect, osgViewer::View* onWhichView);
+
+    /**
+   * Reads a finished frame's time, phase times and the current pager queues from the
+   * viewer stats.  The frame time, event and update phases need the viewer's
+   * "frame_rate", "event" and "update" stats, and the other phases the cameras'
+   * "rendering" and "gpu" stats; GPU times arrive a few frames late.
+   * @return false if the viewer has no duration for the frame
+   */
+    bool readFrameStats(osgViewer::View* view, unsigned int frame, FrameStatsRecord& out_record);
+
+    /** True if the view's viewer is recording the data of the page. */
+    static bool collecting(osgViewer::View* view, CustomPage page);
+
+    /** Records a value for the current frame, if its page is being recorded. */
+    static void recordValue(osgViewer::View* view, StatsValue value, double sample);
+
+    /** Records begin and end ticks of a timed block for the current frame; see ScopedStatsTimer. */
+    static void recordTime(osgViewer::View* view, StatsTimer timer, osg::Timer_t begin, osg::Timer_t end);
+
+public: // osgGA::GUIEventHandler
+    virtual bool handle(const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa);
+
 
 private:
     /** Safely bounds the enum to [0,LAST) */
     StatsType validate_(StatsType type) const;
+
+    /** Adds the custom pages to the stats scene, once per scene */
+    void setUpCustomPages_(osgViewer::ViewerBase* viewer);
+
+    /** Builds the HUD camera and every page; false until the viewer has a graphics context */
+    bool setUpHUD_(osgViewer::ViewerBase* viewer);
+
+    /** Shows the pages of the current stats type and custom page, once they are built */
+    void showPages_(osgViewer::View* view);
+
+    /** Samples the DatabasePager queues for the PAGING_STATS page */
+    void recordPager_(osgViewer::View* view);
+
+    /** Adds a frame to the frame time window and the export, a few frames late so all its phases are in */
+    void recordFrame_(osgViewer::View* view);
+
+    /** Turns stats collection on for everything the shown pages and hitch detection need */
+    void updateCollection_(osgViewer::ViewerBase* viewer);
+
+    /** Builds the text and histogram of the FRAME_TIMES page */
+    void createFrameTimesPage_(osg::Geode* geode, osg::Vec3 pos);
+
+    CustomPage customPage_;
+    int keyEventCyclesCustomPages_;
+    osg::observer_ptr<osg::Switch> customPagesSwitch_;  ///< Stats switch the custom pages were added to
+    unsigned int customPageChildNum_[LAST_CUSTOM_PAGE];
+    osg::ref_ptr<FrameTimeStats> frameTimes_;
+    bool trackFrameTimes_;                              ///< Hitch budget set, so track frames while hidden
+    osg::ref_ptr<StatsExporter> exporter_;
+    bool collectFrameStats_;                            ///< Frame stats wanted by another client
+    osgViewer::ViewerBase::Cameras cameras_;            ///< Reused each frame by readFrameStats()
+};
+
+/**
+ * Times a block for the WIDGET_STATS page.  When the page is hidden this costs a single
+ * stats flag lookup.
+ */
+class ScopedStatsTimer
+{
+public:
+  ScopedStatsTimer(osgViewer::View* view, StatsHandler::StatsTimer timer)
+    : view_(StatsHandler::collecting(view, StatsHandler::WIDGET_STATS) ? view : NULL),
+      timer_(timer),
+      begin_(view_ ? osg::Timer::instance()->tick() : 0)
+  {
+  }
+
+  ~ScopedStatsTimer()
+  {
+    if (view_)
+      StatsHandler::recordTime(view_, timer_, begin_, osg::Timer::instance()->tick());
+  }
+
+private:
+  osgViewer::View* view_;
+  StatsHandler::StatsTimer timer_;
+  osg::Timer_t begin_;
 };
 
 
@@ -0,0 +1,74 @@
+#ifndef WIDGETMETRICS_H
+#define WIDGETMETRICS_H
+
+/**
+ * osgEarth Metrics instrumentation of the EarthMisc widgets.  With EARTHMISC_METRICS
+ * defined (the default, see EarthMisc.pro) each handler and control path records a
+ * scoped event, and work counters are sampled, whenever a metrics backend is
+ * installed.  Without it the macros below expand to nothing.
+ *
+ * Counters are running totals since tracing started, so the work done between two
+ * points of a trace is the difference of the samples.  Declare each counter once per
+ * source file with WIDGET_METRIC_COUNTER and add to it with WIDGET_METRIC_ADD.
+ */
+#ifdef EARTHMISC_METRICS
+
+#include <osgEarth/Metrics>
+#include <atomic>
+
+/** Begins an event on construction and ends it on destruction, if metrics are enabled */
+class WidgetMetric
+{
+public:
+    WidgetMetric(const char* name)
+        : name_(osgEarth::Metrics::enabled() ? name : NULL)
+    {
+        if (name_)
+            osgEarth::Metrics::begin(name_);
+    }
+
+    ~WidgetMetric()
+    {
+        // The backend may have been removed since begin()
+        if (name_ && osgEarth::Metrics::enabled())
+            osgEarth::Metrics::end(name_);
+    }
+
+private:
+    const char* name_;
+};
+
+/** Running total of some work, sampled on every addition while metrics are enabled */
+class WidgetMetricCounter
+{
+public:
+    WidgetMetricCounter(const char* graph, const char* name)
+        : graph_(graph), name_(name), total_(0)
+    {
+    }
+
+    void add(unsigned count)
+    {
+        if (osgEarth::Metrics::enabled())
+            osgEarth::Metrics::counter(graph_, name_, total_ += count);
+    }
+
+private:
+    const char* graph_;
+    const char* name_;
+    std::atomic<unsigned> total_;
+};
+
+#define WIDGET_METRIC_SCOPED(NAME) WidgetMetric widget_metric__(NAME)
+#define WIDGET_METRIC_COUNTER(VAR, GRAPH, NAME) static WidgetMetricCounter VAR(GRAPH, NAME)
+#define WIDGET_METRIC_ADD(VAR, COUNT) VAR.add(COUNT)
+
+#else
+
+#define WIDGET_METRIC_SCOPED(NAME) ((void)0)
+#define WIDGET_METRIC_COUNTER(VAR, GRAPH, NAME) struct VAR##_unused
+#define WIDGET_METRIC_ADD(VAR, COUNT) ((void)0)
+
+#endif
+
+#endif